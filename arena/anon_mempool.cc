@@ -0,0 +1,65 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena/anon_mempool.h"
+
+namespace base {
+
+AnonMempool::AnonMempool() {
+}
+
+AnonMempool::~AnonMempool() {
+  stopWarmUp();
+  stopGrowth();
+  waitSnapshot();
+  if (file_ != NULL) {
+    munmap(file_, data_offset_ + kMmapSize_);
+  }
+  file_ = NULL;
+  header_file_ = NULL;
+  base_ = NULL;
+}
+
+int32_t AnonMempool::init(const char* name, uint32_t mode) {
+  if (Mempool::init(name) != 0 || file_ != NULL || mode == MFILE_MODE_READ
+      || mode == MFILE_MODE_WRITE_SHARED) {
+    return -1;
+  }
+  data_offset_ = sysconf(_SC_PAGESIZE);
+  void* addr = mmap(NULL, data_offset_ + kMmapSize_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    return -1;
+  }
+  file_ = reinterpret_cast<char*>(addr);
+  header_file_ = reinterpret_cast<MMapFileHeader*>(file_);
+  base_ = file_ + data_offset_;
+  applyMapPolicy();
+  return 0;
+}
+
+int32_t AnonMempool::dump() {
+  return 0;
+}
+
+int32_t AnonMempool::release(const int64_t& offset, const int64_t& length) {
+  if (base_ == NULL) {
+    return -1;
+  }
+  saveSnapshot(offset, length);
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+  int64_t begin = (offset + page_size - 1) & ~(page_size - 1);
+  int64_t end = (offset + length) & ~(page_size - 1);
+  if (begin >= end) {
+    return 0;
+  }
+  // Private anonymous pages read back as zeros once dropped.
+  return madvise(base_ + begin, end - begin, MADV_DONTNEED);
+}
+
+int32_t AnonMempool::growFile(const int64_t& offset, const int64_t& length) {
+  return 0;
+}
+
+}  // namespace base
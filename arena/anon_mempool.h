@@ -0,0 +1,39 @@
+#ifndef BASE_ANON_MEMPOOL_H_
+#define BASE_ANON_MEMPOOL_H_
+
+#include "arena/mmap_mempool.h"
+
+namespace base {
+
+// Mempool over anonymous memory, for arenas that live and die with the
+// process such as per-request caches and tests.  It allocates like
+// MMapMempool, with the header in a page in front of the data, but has no
+// file and never writes anything back.
+class AnonMempool : public MMapMempool {
+ public:
+  using MMapMempool::init;
+
+  AnonMempool();
+
+  ~AnonMempool();
+
+  // name is only recorded.  mode must be writable.
+  virtual int32_t init(const char* name, uint32_t mode);
+
+  virtual int32_t dump();
+
+  virtual int32_t release(const int64_t& offset, const int64_t& length);
+
+  // Returns -1, private pages cannot be unmapped without losing them.
+  virtual int32_t recordHeat() {
+    return -1;
+  }
+
+ protected:
+  // Anonymous pages appear on first touch, growing is bookkeeping.
+  virtual int32_t growFile(const int64_t& offset, const int64_t& length);
+};
+
+}  // namespace base
+
+#endif  // BASE_ANON_MEMPOOL_H_
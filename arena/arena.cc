@@ -1,14 +1,79 @@
+#include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <algorithm>
 #include <iostream>
 
 #include "arena/arena.h"
+#include "arena/compactor.h"
 
 namespace base {
 
-const uint32_t kDefaultDelayQueueSize = 100000;
 bool use_delay_queue = true;
 
+namespace {
+
+// Orders batch entries by size class.
+struct LevelLess {
+    explicit LevelLess(const uint32_t* levels) : levels_(levels) {}
+    bool operator()(uint32_t a, uint32_t b) const {
+        return levels_[a] < levels_[b];
+    }
+    const uint32_t* levels_;
+};
+
+// A slice of a parallel copy.
+struct CopyTask {
+    char* dst;
+    const char* src;
+    int64_t length;
+};
+
+void* copyMain(void* data) {
+    CopyTask* task = reinterpret_cast<CopyTask*>(data);
+    memcpy(task->dst, task->src, task->length);
+    return NULL;
+}
+
+// memcpy split over up to threads threads, in slices of at least 1MB.
+void parallelCopy(char* dst, const char* src, int64_t length,
+                  uint32_t threads) {
+    const int64_t kMinSlice = 1024 * 1024;
+    int64_t count = std::min<int64_t>(std::max<uint32_t>(threads, 1),
+                                      (length + kMinSlice - 1) / kMinSlice);
+    int64_t slice = (length + count - 1) / count;
+    std::vector<CopyTask> tasks(count);
+    std::vector<pthread_t> workers(count);
+    std::vector<bool> started(count, false);
+    for (int64_t i = 0; i < count; i++) {
+        int64_t offset = i * slice;
+        tasks[i].dst = dst + offset;
+        tasks[i].src = src + offset;
+        tasks[i].length = std::min(slice, length - offset);
+        started[i] = i > 0
+            && pthread_create(&workers[i], NULL, &copyMain, &tasks[i]) == 0;
+    }
+    for (int64_t i = 0; i < count; i++) {
+        if (!started[i]) {
+            copyMain(&tasks[i]);
+        }
+    }
+    for (int64_t i = 0; i < count; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+}
+
+int64_t translateKey(int64_t key, int64_t delta) {
+    if (isSlabKey(key)) {
+        return kSlabKeyTag | ((key & kKeyOffsetMask) + delta);
+    }
+    return key + delta;
+}
+
+}  // namespace
+
 Arena::Arena()
     : pool_(NULL),
       min_mem_size_(0),
@@ -16,18 +81,56 @@ Arena::Arena()
       rate_(0.0),
       level_(0),
       free_list_offset_(0),
+      free_bitmap_offset_(0),
+      size_class_offset_(0),
       delay_time_(0),
       delay_queue_offset_(0),
+      epochs_(NULL),
       header_size_(0),
       use_free_list_(false),
-      expand_factor_(2.0) {
+      expand_factor_(2.0),
+      slab_offset_(0),
+      slab_max_size_(0),
+      release_size_(0),
+      compactor_(NULL),
+      thread_safe_(false),
+      shared_(false),
+      shared_lock_offset_(0),
+      counters_offset_(0),
+      redo_(NULL),
+      redo_replayed_(false),
+      live_map_(NULL),
+      flusher_running_(false),
+      flusher_stop_(false),
+      flush_interval_ms_(0),
+      flush_threads_(1) {
+    memset(octave_begin_, 0, sizeof(octave_begin_));
+    memset(octave_end_, 0, sizeof(octave_end_));
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_mutex_init(&flusher_mutex_, NULL);
+    pthread_cond_init(&flusher_cond_, NULL);
 }
 
 Arena::~Arena() {
+    stopFlusher();
+    pthread_cond_destroy(&flusher_cond_);
+    pthread_mutex_destroy(&flusher_mutex_);
+    if (thread_safe_) {
+        clearThreadCaches(false);
+        pthread_key_delete(cache_key_);
+    }
+    pthread_mutex_destroy(&mutex_);
+    delete epochs_;
+    delete redo_;
+    delete live_map_;
 }
 
 void Arena::close() {
+    stopFlusher();
+    flushThreadCaches();
     pool_->close();
+    delete live_map_;
+    live_map_ = NULL;
 }
 
 int32_t Arena::init(Mempool* pool,
@@ -48,6 +151,9 @@ int32_t Arena::init(Mempool* pool,
         minMemSize = 16;
     }
 
+    if (pool_->isShared()) {
+        return initShared(minMemSize, maxMemSize, rate, delayTime);
+    }
     if (pool_->getUsedSize() == 0) {
         return create(minMemSize, maxMemSize, rate, delayTime);
     } else {
@@ -55,87 +161,423 @@ int32_t Arena::init(Mempool* pool,
     }
 }
 
+int32_t Arena::initShared(uint32_t minMemSize,
+                          uint32_t maxMemSize,
+                          float    rate,
+                          uint32_t delayTime) {
+    // Every process would need its own log over the same metadata.
+    if (redo_ != NULL) {
+        return -1;
+    }
+    if (pool_->lockInit() != 0) {
+        return -1;
+    }
+    int32_t ret = 0;
+    if (pool_->getUsedSize() == 0) {
+        ret = create(minMemSize, maxMemSize, rate, delayTime);
+    } else {
+        ret = load();
+        // Whoever held the lock last is gone, start from a fresh mutex,
+        // after cleaning up if it died holding it.  Otherwise the live
+        // writers own the header, not the init lock.
+        if (ret == 0 && pool_->isSoleOwner()) {
+            if (pthread_mutex_trylock(sharedLock()) == EOWNERDEAD) {
+                recoverSharedState();
+            }
+            initSharedLock();
+            rebuildFreeBitmap();
+        }
+    }
+    if (ret == 0) {
+        ret = set_thread_safe(true);
+    }
+    if (ret == 0) {
+        shared_ = true;
+        // Other processes fill the free lists behind our back.
+        use_free_list_ = true;
+    }
+    pool_->unlockInit();
+    return ret;
+}
+
 int32_t Arena::dump() {
-    return pool_->dump();
+    if (live_map_ != NULL && live_map_->dump(pool_->getUsedSize()) != 0) {
+        return -1;
+    }
+    if (redo_ == NULL) {
+        return pool_->dump();
+    }
+    // Records up to here are covered once the pool is written back.
+    if (thread_safe_) {
+        lock();
+    }
+    int64_t lsn = appendRedo();
+    if (thread_safe_) {
+        unlock();
+    }
+    int32_t ret = pool_->dump();
+    if (ret == 0 && lsn != -1) {
+        ret = redo_->truncate(lsn);
+    }
+    return ret;
 }
 
-int64_t Arena::alloc(uint32_t size) {
-    if (size == 0 || size > max_mem_size_) {
+int32_t Arena::openRedoLog(const char* path) {
+    if (pool_ != NULL) {
         return -1;
     }
+    RedoLog* redo = new RedoLog;
+    if (redo->open(path) != 0) {
+        delete redo;
+        return -1;
+    }
+    redo->set_concurrent(thread_safe_);
+    delete redo_;
+    redo_ = redo;
+    return 0;
+}
 
-    int64_t key      = -1;
-    uint32_t level    = 0;
-    uint32_t realSize = size;
+int32_t Arena::commit() {
+    if (redo_ == NULL) {
+        return dump();
+    }
+    if (thread_safe_) {
+        lock();
+    }
+    int64_t lsn = appendRedo();
+    if (thread_safe_) {
+        unlock();
+    }
+    if (lsn == -1) {
+        return -1;
+    }
+    return redo_->sync(lsn);
+}
 
-    level = getLevel(realSize);
-    int64_t* freeList = NULL;
-    if (use_free_list_) {
-        freeList = (int64_t*)pool_->getAddress(free_list_offset_);
+int64_t Arena::appendRedo() {
+    // The header fields every operation may change.  Free block links,
+    // prefixes and slab pages were noted as they were written.
+    std::vector<DirtyRange> fixed(3);
+    fixed[0].offset = 0;
+    fixed[0].length = delay_queue_offset_ + sizeof(DelayQueue);
+    fixed[1].offset = user_define_offset_;
+    fixed[1].length = slab_offset_ + sizeof(SlabHeader) - user_define_offset_;
+    fixed[2].offset = counters_offset_;
+    fixed[2].length = header_size_ - counters_offset_;
+    return redo_->append(pool_, fixed, pool_->getUsedSize());
+}
+
+void Arena::repairFreeLists() {
+    int64_t* freeList = reinterpret_cast<int64_t*>
+      (pool_->getAddress(free_list_offset_));
+    int64_t end = pool_->getUsedSize();
+    // No list can be longer than the pool has minimum blocks.
+    int64_t limit = (end - header_size_)
+        / (sizeof(uint32_t) + min_mem_size_) + 1;
+    for (uint32_t i = 0; i < level_; i++) {
+        classCounters()[i].free_blocks = 0;
+        classCounters()[i].free_bytes = 0;
+        int64_t* link = freeList + i;
+        int64_t count = 0;
+        while (*link != -1) {
+            int64_t key = *link;
+            if (key < header_size_ || isSlabKey(key) || ++count > limit
+                || pool_->skipUnallocated(key) != key
+                || key + static_cast<int64_t>(sizeof(uint32_t))
+                   + static_cast<int64_t>(sizeof(int64_t)) > end
+                || key + static_cast<int64_t>(sizeof(uint32_t))
+                   + getSize(key) > end
+                || blockLevel(key) != i) {
+                *link = -1;
+                break;
+            }
+            countFree(i, key, 1);
+            link = reinterpret_cast<int64_t*>(getAddress(key));
+        }
+    }
+    rebuildFreeBitmap();
+}
+
+int32_t Arena::dumpDirty(uint32_t threads) {
+    std::vector<DirtyRange> ranges;
+    // Metadata is written under the lock, so taking the ranges under it
+    // never splits an update between two dumps.
+    if (thread_safe_) {
+        lock();
+    }
+    pool_->markDirty(0, header_size_);
+    int32_t ret = pool_->takeDirty(&ranges);
+    int64_t lsn = ret == 0 && redo_ != NULL ? appendRedo() : -1;
+    if (thread_safe_) {
+        unlock();
     }
+    if (ret != 0) {
+        return dump();
+    }
+    ret = pool_->syncRanges(ranges, threads);
+    if (ret == 0 && live_map_ != NULL) {
+        ret = live_map_->dump(pool_->getUsedSize());
+    }
+    if (ret == 0 && lsn != -1) {
+        ret = redo_->truncate(lsn);
+    }
+    return ret;
+}
 
-/*
-    if (freeList != NULL && freeList[level] != -1) {
-        key = freeList[level];
-        freeList[level] = *(int64_t*)getAddress(key);
+void Arena::markDirty(int64_t key) {
+    if (isSlabKey(key)) {
+        pool_->markDirty((key & kKeyOffsetMask) + sizeof(uint32_t),
+                         getSize(key));
     } else {
-        key = pool_->alloc(realSize + sizeof(uint32_t));
-        if (key == -1) {
-            return -1;
+        pool_->markDirty(key, sizeof(uint32_t) + getSize(key));
+    }
+}
+
+int32_t Arena::snapshot(const char* path) {
+    // Metadata only changes under the lock, so the image starts from a
+    // consistent state; every later write saves the old contents first.
+    if (thread_safe_) {
+        lock();
+    }
+    int32_t ret = pool_->beginSnapshot(path);
+    if (ret == 0) {
+        // List heads, the delay queue and the counters are written without
+        // markDirty, so save the header before anyone changes it.
+        pool_->markDirty(0, header_size_);
+    }
+    if (thread_safe_) {
+        unlock();
+    }
+    return ret;
+}
+
+int32_t Arena::waitSnapshot() {
+    return pool_->waitSnapshot();
+}
+
+int32_t Arena::set_flush_interval(uint32_t interval_ms, uint32_t threads) {
+    stopFlusher();
+    if (interval_ms == 0) {
+        return 0;
+    }
+    flush_interval_ms_ = interval_ms;
+    flush_threads_ = threads;
+    flusher_stop_ = false;
+    if (pthread_create(&flusher_thread_, NULL, &Arena::flusherMain,
+                       this) != 0) {
+        return -1;
+    }
+    flusher_running_ = true;
+    return 0;
+}
+
+void* Arena::flusherMain(void* data) {
+    Arena* arena = reinterpret_cast<Arena*>(data);
+    pthread_mutex_lock(&arena->flusher_mutex_);
+    while (!arena->flusher_stop_) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        int64_t nsec = deadline.tv_nsec
+            + static_cast<int64_t>(arena->flush_interval_ms_) * 1000000;
+        deadline.tv_sec += nsec / 1000000000;
+        deadline.tv_nsec = nsec % 1000000000;
+        pthread_cond_timedwait(&arena->flusher_cond_, &arena->flusher_mutex_,
+                               &deadline);
+        if (arena->flusher_stop_) {
+            break;
+        }
+        pthread_mutex_unlock(&arena->flusher_mutex_);
+        arena->dumpDirty(arena->flush_threads_);
+        pthread_mutex_lock(&arena->flusher_mutex_);
+    }
+    pthread_mutex_unlock(&arena->flusher_mutex_);
+    return NULL;
+}
+
+void Arena::stopFlusher() {
+    if (!flusher_running_) {
+        return;
+    }
+    pthread_mutex_lock(&flusher_mutex_);
+    flusher_stop_ = true;
+    pthread_cond_signal(&flusher_cond_);
+    pthread_mutex_unlock(&flusher_mutex_);
+    pthread_join(flusher_thread_, NULL);
+    flusher_running_ = false;
+}
+
+int64_t Arena::alloc(uint32_t size) {
+    int64_t key = allocKey(size);
+    if (key != -1) {
+        markDirty(key);
+        markLive(key, true);
+        countLive(key, 1, size);
+    }
+    return key;
+}
+
+int64_t Arena::allocKey(uint32_t size) {
+    if (size == 0 || size > max_mem_size_) {
+        return -1;
+    }
+    if (size <= slab_max_size_) {
+        if (!thread_safe_) {
+            return slabAlloc(size);
         }
-        *(uint32_t*)(pool_->getAddress(key)) = realSize;
+        LockGuard guard(this);
+        return slabAlloc(size);
     }
-*/
+
+    uint32_t level    = 0;
+    uint32_t realSize = size;
+
+    level = getLevel(realSize);
     uint32_t realSize_end = (uint32_t)(realSize * expand_factor_);
     if (realSize_end > max_mem_size_) {
         realSize_end = max_mem_size_;
     }
     uint32_t level_end = getLevel(realSize_end);
-    if (freeList != NULL) {
-        for (uint32_t i = level; i <= level_end; i++) {
-            if (freeList[i] != -1 && getAddress(freeList[i]) != NULL) {
+    if (!thread_safe_) {
+        return allocBlock(level, level_end, realSize);
+    }
+
+    ThreadCache* cache = NULL;
+    if (realSize <= kThreadCacheMaxSize) {
+        cache = getThreadCache();
+        int32_t i = findFreeLevel(&cache->bitmap[0], level, level_end);
+        if (i != -1) {
+            return cache->pop(i);
+        }
+    }
+    {
+        LockGuard guard(this);
+        if (cache != NULL && refillThreadCache(cache, level, level_end)) {
+            return cache->pop(
+                findFreeLevel(&cache->bitmap[0], level, level_end));
+        }
+        if (!pool_->isConcurrentAlloc()) {
+            return allocBlock(level, level_end, realSize);
+        }
+        int64_t key = popFreeBlock(level, level_end);
+        if (key != -1) {
+            return key;
+        }
+    }
+    // The pool bumps its tail atomically, no need to hold the lock.
+    return bumpBlock(realSize);
+}
+
+int64_t Arena::allocBlock(uint32_t level, uint32_t level_end,
+                          uint32_t realSize) {
+    int64_t key = popFreeBlock(level, level_end);
+    if (key == -1) {
+        key = bumpBlock(realSize);
+    }
+    return key;
+}
+
+int64_t Arena::popFreeBlock(uint32_t level, uint32_t level_end) {
+    int64_t key = -1;
+    if (use_free_list_) {
+        int64_t* freeList = reinterpret_cast<int64_t*>(
+            pool_->getAddress(free_list_offset_));
+        uint64_t* bitmap = reinterpret_cast<uint64_t*>(
+            pool_->getAddress(free_bitmap_offset_));
+        for (int32_t i = findFreeLevel(bitmap, level, level_end); i != -1;
+             i = findFreeLevel(bitmap, i + 1, level_end)) {
+            if (getAddress(freeList[i]) != NULL) {
                 key = freeList[i];
                 freeList[i] = *(int64_t*)getAddress(key);
+                countFree(i, key, -1);
+                if (freeList[i] == -1) {
+                    bitmap[i >> 6] &= ~(1ULL << (i & 63));
+                }
                 break;
             }
         }
     }
+    return key;
+}
+
+uint32_t Arena::popFreeRun(uint32_t level, const uint32_t* slots,
+                           uint32_t count, int64_t* keys) {
+    if (!use_free_list_) {
+        return 0;
+    }
+    int64_t* freeList = reinterpret_cast<int64_t*>(
+        pool_->getAddress(free_list_offset_));
+    uint64_t* bitmap = reinterpret_cast<uint64_t*>(
+        pool_->getAddress(free_bitmap_offset_));
+    int64_t key = freeList[level];
+    uint32_t taken = 0;
+    while (taken < count && key != -1 && getAddress(key) != NULL) {
+        keys[slots[taken++]] = key;
+        countFree(level, key, -1);
+        key = *reinterpret_cast<int64_t*>(getAddress(key));
+    }
+    freeList[level] = key;
     if (key == -1) {
-        key = pool_->alloc(realSize + sizeof(uint32_t));
-        if (key == -1) {
-            return -1;
-        }
-        *(uint32_t*)(pool_->getAddress(key)) = realSize;
+        bitmap[level >> 6] &= ~(1ULL << (level & 63));
+    }
+    return taken;
+}
+
+int64_t Arena::bumpBlock(uint32_t realSize) {
+    int64_t key = pool_->alloc(realSize + sizeof(uint32_t));
+    if (key == -1) {
+        return -1;
     }
+    touch(key, sizeof(uint32_t));
+    *(uint32_t*)(pool_->getAddress(key)) = realSize;
+    noteBlock(key);
     return key;
 }
 
 int64_t Arena::realloc(int64_t key, uint32_t new_size) {
-    if (key == -1) {
+    if (key == -1 || new_size == 0 || new_size > max_mem_size_) {
         return -1;
     }
 
     uint32_t size   = getSize(key);
-    if (new_size <= size) {
-        return -1;
+    uint32_t level  = blockLevel(key);
+    if (isSlabKey(key)) {
+        if (new_size <= size) {
+            return key;
+        }
+    } else {
+        if (thread_safe_) {
+            lock();
+        }
+        bool inPlace = compactor_ == NULL && resizeInPlace(key, size, new_size);
+        if (thread_safe_) {
+            unlock();
+        }
+        if (inPlace) {
+            countLive(level, size, -1, 0);
+            countLive(key, 1, new_size);
+            return key;
+        }
     }
     int64_t new_key = alloc(new_size);
     if (new_key == -1) {
         return -1;
     }
-    memcpy(getAddress(new_key), getAddress(key), size);
-
-    freeDelayQueue();
+    memcpy(getAddress(new_key), getAddress(key),
+           std::min(size, getSize(new_key)));
+    // A flush may have taken the mark alloc left before the copy landed.
+    markDirty(new_key);
 
-    DelayNode node = {key, getLevel(size), time(NULL)};
-    DelayQueue *delayQueue =
-      (DelayQueue*) pool_->getAddress(delay_queue_offset_);
-    if (!delayQueue->full()) {
-        delayQueue->push(node, pool_);
-    } else {
-        expandDelayQueue();
-        delayQueue = (DelayQueue*) pool_->getAddress(delay_queue_offset_);
-        delayQueue->push(node, pool_);
+    countLive(key, -1, 0);
+    if (thread_safe_) {
+        lock();
+    }
+    // A block the compactor moved is released by it.
+    if (compactor_ == NULL || !compactor_->retire(key)) {
+        freeDelayQueue();
+        delayFree(key, blockLevel(key), retireStamp());
+    }
+    if (thread_safe_) {
+        unlock();
     }
 
     return new_key;
@@ -146,123 +588,699 @@ int32_t Arena::free(int64_t key) {
         return -1;
     }
     uint32_t size   = getSize(key);
-    if (use_delay_queue) {
-        freeDelayQueue();
-        DelayNode node = {key, getLevel(size), time(NULL)};
-        DelayQueue *delayQueue =
-          (DelayQueue*) pool_->getAddress(delay_queue_offset_);
-        if (!delayQueue->full()) {
-            delayQueue->push(node, pool_);
+    uint32_t level  = blockLevel(key);
+    markLive(key, false);
+    countLive(key, -1, 0);
+    if (thread_safe_ && level != kSlabLevel && size <= kThreadCacheMaxSize
+        && compactor_ == NULL) {
+        ThreadCache* cache = getThreadCache();
+        if (use_delay_queue) {
+            DelayNode node = {key, level, retireStamp()};
+            cache->retired.push_back(node);
+            if (cache->retired.size() < kThreadCacheBatch) {
+                return 0;
+            }
         } else {
-            expandDelayQueue();
-            delayQueue = (DelayQueue*) pool_->getAddress(delay_queue_offset_);
-            delayQueue->push(node, pool_);
+            cache->push(level, key);
+            if (cache->bins[level].size() <= kThreadCacheBinLimit) {
+                return 0;
+            }
         }
+        LockGuard guard(this);
+        flushThreadCache(cache, false);
+        use_free_list_ = true;
+        return 0;
+    }
+
+    if (thread_safe_) {
+        lock();
+    }
+    if (compactor_ != NULL && compactor_->retire(key)) {
+        // Moved, the compactor releases it.
+    } else if (use_delay_queue) {
+        freeDelayQueue();
+        delayFree(key, level, retireStamp());
+    } else if (level == kSlabLevel) {
+        slabFree(key);
     } else {  // Safe update mode, not use delay queue
-        uint32_t level = getLevel(size);
-        int64_t* freeList = reinterpret_cast<int64_t*>(
-            pool_->getAddress(free_list_offset_));
-        int64_t* next_key = reinterpret_cast<int64_t*>(getAddress(key));
-        *next_key = freeList[level];
-        freeList[level] = key;
+        pushFreeList(key, level);
     }
 
     use_free_list_ = true;
+    if (thread_safe_) {
+        unlock();
+    }
     return 0;
 }
 
-int Arena::create(uint32_t minMemSize,
-                                   uint32_t maxMemSize,
-                                   float    rate,
-                                   uint32_t delayTime) {
-    do {
-        pool_->reset();
-
-        int64_t key = -1;
-        char* pData  = NULL;
-
-        key = pool_->alloc(sizeof(min_mem_size_));
-        if (key == -1) {
-            break;
-        }
-        pData = pool_->getAddress(key);
-        *(uint32_t*)pData = minMemSize;
-        min_mem_size_ = minMemSize;
-
-        key = pool_->alloc(sizeof(max_mem_size_));
-        if (key == -1) {
-            break;
+int32_t Arena::allocNBatch(const uint32_t* sizes, uint32_t n,
+                           int64_t* keys) {
+    if (n == 0) {
+        return 0;
+    }
+    std::vector<uint32_t> levels(n);
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> slab;
+    order.reserve(n);
+    for (uint32_t i = 0; i < n; i++) {
+        keys[i] = -1;
+        if (sizes[i] == 0 || sizes[i] > max_mem_size_) {
+            continue;
         }
-        pData = pool_->getAddress(key);
-        *(uint32_t*)pData = maxMemSize;
-        max_mem_size_ = maxMemSize;
-
-        key = pool_->alloc(sizeof(rate_));
-        if (key == -1) {
-            break;
+        if (sizes[i] <= slab_max_size_) {
+            slab.push_back(i);
+            continue;
         }
-        pData = pool_->getAddress(key);
-        *(float*)pData = rate;
-        rate_ = rate;
+        uint32_t realSize = sizes[i];
+        levels[i] = getLevel(realSize);
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), LevelLess(&levels[0]));
 
-        key = pool_->alloc(sizeof(level_));
-        if (key == -1) {
-            break;
+    if (thread_safe_) {
+        lock();
+    }
+    int32_t allocated = 0;
+    for (size_t j = 0; j < slab.size(); j++) {
+        keys[slab[j]] = slabAlloc(sizes[slab[j]]);
+        if (keys[slab[j]] != -1) {
+            allocated++;
         }
-        pData = pool_->getAddress(key);
-        uint32_t level = getLevel(max_mem_size_) + 1;
-        *(uint32_t*)pData = level;
-        level_ = level;
-
-        key = pool_->alloc(sizeof(int64_t) * level_);
-        if (key == -1) {
-            break;
+    }
+    // Same-class requests are adjacent, so each run is cut off its free
+    // list in one piece.  What the list cannot cover pops from the larger
+    // classes or is bumped from the pool.
+    std::vector<uint32_t> bump;
+    int64_t bumpSize = 0;
+    for (size_t j = 0; j < order.size();) {
+        uint32_t level = levels[order[j]];
+        size_t end = j + 1;
+        while (end < order.size() && levels[order[end]] == level) {
+            end++;
         }
-        free_list_offset_ = key;
-        int64_t *freeList = reinterpret_cast<int64_t*>(pool_->getAddress(key));
-        for (uint32_t i = 0; i < level_; i++) {
-            freeList[i] = -1;
+        uint32_t realSize_end = (uint32_t)(class_size_[level] * expand_factor_);
+        if (realSize_end > max_mem_size_) {
+            realSize_end = max_mem_size_;
         }
-
-        key = pool_->alloc(sizeof(delay_time_));
-        if (key == -1) {
-            break;
+        uint32_t level_end = getLevel(realSize_end);
+        j += popFreeRun(level, &order[j], end - j, keys);
+        for (; j < end; j++) {
+            uint32_t i = order[j];
+            keys[i] = popFreeBlock(level, level_end);
+            if (keys[i] == -1) {
+                bump.push_back(i);
+                bumpSize += class_size_[level] + sizeof(uint32_t);
+            }
         }
-        pData = pool_->getAddress(key);
-        *(uint32_t*)pData = delayTime;
-        delay_time_ = delayTime;
+    }
+    if (thread_safe_ && pool_->isConcurrentAlloc()) {
+        unlock();
+    }
 
-        key = pool_->alloc(sizeof(DelayQueue));
+    allocated += order.size() - bump.size();
+    int64_t key = bump.empty() ? -1 : pool_->alloc(bumpSize);
+    for (size_t j = 0; j < bump.size(); j++) {
+        uint32_t i = bump[j];
+        uint32_t realSize = class_size_[levels[i]];
         if (key == -1) {
-            break;
+            // The pool could not reserve the whole run, try one by one.
+            keys[i] = bumpBlock(realSize);
+        } else {
+            touch(key, sizeof(uint32_t));
+            *reinterpret_cast<uint32_t*>(pool_->getAddress(key)) = realSize;
+            noteBlock(key);
+            keys[i] = key;
+            key += realSize + sizeof(uint32_t);
         }
-        delay_queue_offset_ = key;
-        DelayQueue *delayQueue = reinterpret_cast<DelayQueue*>
-          (pool_->getAddress(key));
-
-        key = pool_->alloc(sizeof(DelayNode) * kDefaultDelayQueueSize);
-        if (key == -1) {
-            break;
+        if (keys[i] != -1) {
+            allocated++;
         }
-        delayQueue = new (delayQueue) DelayQueue(kDefaultDelayQueueSize, key);
+    }
 
-        // user_define, kept for user extension.
-        user_define_offset_ = pool_->alloc(sizeof(uint64_t));
-        if (user_define_offset_ == -1) {
-            break;
+    if (thread_safe_ && !pool_->isConcurrentAlloc()) {
+        unlock();
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (keys[i] != -1) {
+            markDirty(keys[i]);
+            markLive(keys[i], true);
+            countLive(keys[i], 1, sizes[i]);
         }
-        // header_size
-        header_size_ = pool_->getUsedSize();
+    }
+    return allocated;
+}
 
+int32_t Arena::freeBatch(const int64_t* keys, uint32_t n) {
+    if (n == 0) {
         return 0;
-    } while (0);
+    }
+    std::vector<uint32_t> levels(n);
+    std::vector<uint32_t> order;
+    order.reserve(n);
+    for (uint32_t i = 0; i < n; i++) {
+        if (keys[i] == -1) {
+            continue;
+        }
+        levels[i] = blockLevel(keys[i]);
+        order.push_back(i);
+        markLive(keys[i], false);
+        countLive(keys[i], -1, 0);
+    }
 
-    pool_->reset();
-    min_mem_size_ = 0;
-    max_mem_size_ = 0;
-    rate_       = 0.0;
+    if (thread_safe_) {
+        lock();
+    }
+    int32_t freed = order.size();
+    if (compactor_ != NULL) {
+        // Moved blocks are released by the compactor.
+        size_t kept = 0;
+        for (size_t j = 0; j < order.size(); j++) {
+            if (!compactor_->retire(keys[order[j]])) {
+                order[kept++] = order[j];
+            }
+        }
+        order.resize(kept);
+    }
+    if (use_delay_queue) {
+        int64_t now = retireStamp();
+        freeDelayQueue();
+        for (size_t j = 0; j < order.size(); j++) {
+            delayFree(keys[order[j]], levels[order[j]], now);
+        }
+    } else {
+        // Chain the keys of each class together and splice the chain onto
+        // the list head once.
+        std::stable_sort(order.begin(), order.end(), LevelLess(&levels[0]));
+        int64_t* freeList = reinterpret_cast<int64_t*>
+          (pool_->getAddress(free_list_offset_));
+        uint64_t* bitmap = reinterpret_cast<uint64_t*>
+          (pool_->getAddress(free_bitmap_offset_));
+        size_t first = 0;
+        for (size_t j = 0; j < order.size(); j++) {
+            uint32_t level = levels[order[j]];
+            if (level == kSlabLevel) {
+                slabFree(keys[order[j]]);
+                continue;
+            }
+            if (release_size_ != 0 && class_size_[level] >= release_size_) {
+                pushFreeList(keys[order[j]], level);
+                continue;
+            }
+            if (j > 0 && levels[order[j - 1]] != level) {
+                first = j;
+            }
+            countFree(level, keys[order[j]], 1);
+            touch(keys[order[j]], sizeof(uint32_t) + sizeof(int64_t));
+            bool last = j + 1 == order.size()
+                || levels[order[j + 1]] != level;
+            *reinterpret_cast<int64_t*>(getAddress(keys[order[j]])) =
+                last ? freeList[level] : keys[order[j + 1]];
+            if (last) {
+                freeList[level] = keys[order[first]];
+                bitmap[level >> 6] |= 1ULL << (level & 63);
+            }
+        }
+    }
+    use_free_list_ = true;
+    if (thread_safe_) {
+        unlock();
+    }
+    return freed;
+}
+
+void Arena::delayFree(int64_t key, uint32_t level, int64_t now) {
+    markLive(key, false);
+    DelayNode node = {key, level, now};
+    DelayQueue *delayQueue =
+      (DelayQueue*) pool_->getAddress(delay_queue_offset_);
+    if (delayQueue->full()) {
+        expandDelayQueue();
+        delayQueue = (DelayQueue*) pool_->getAddress(delay_queue_offset_);
+    }
+    beginQueueUpdate();
+    int32_t pushed = delayQueue->push(node, pool_, redo_);
+    endQueueUpdate();
+    if (pushed == 0) {
+        counters()->delay_blocks++;
+        counters()->delay_bytes += getSize(key);
+        return;
+    }
+    // The pool cannot grow the queue.  Releasing the block early beats
+    // losing it for good.
+    if (level == kSlabLevel) {
+        slabFree(key);
+    } else {
+        pushFreeList(key, level);
+    }
+}
+
+int32_t Arena::set_thread_safe(bool thread_safe) {
+    if (thread_safe == thread_safe_) {
+        return 0;
+    }
+    if (shared_) {
+        return -1;
+    }
+    if (thread_safe) {
+        if (pthread_key_create(&cache_key_, &Arena::releaseThreadCache) != 0) {
+            return -1;
+        }
+    } else {
+        clearThreadCaches(true);
+        pthread_key_delete(cache_key_);
+    }
+    if (redo_ != NULL) {
+        redo_->set_concurrent(thread_safe);
+    }
+    thread_safe_ = thread_safe;
+    return 0;
+}
+
+ThreadCache* Arena::getThreadCache() {
+    ThreadCache* cache =
+      reinterpret_cast<ThreadCache*>(pthread_getspecific(cache_key_));
+    if (cache == NULL) {
+        cache = new ThreadCache(this, level_);
+        pthread_setspecific(cache_key_, cache);
+        LockGuard guard(this);
+        caches_.push_back(cache);
+    }
+    return cache;
+}
+
+bool Arena::refillThreadCache(ThreadCache* cache, uint32_t level,
+                              uint32_t level_end) {
+    if (!use_free_list_) {
+        return false;
+    }
+    foldCounters(cache);
+    freeDelayQueue();
+    int64_t* freeList = reinterpret_cast<int64_t*>(
+        pool_->getAddress(free_list_offset_));
+    uint64_t* bitmap = reinterpret_cast<uint64_t*>(
+        pool_->getAddress(free_bitmap_offset_));
+    for (int32_t i = findFreeLevel(bitmap, level, level_end); i != -1;
+         i = findFreeLevel(bitmap, i + 1, level_end)) {
+        uint32_t n = 0;
+        while (n < kThreadCacheBatch && freeList[i] != -1
+               && getAddress(freeList[i]) != NULL) {
+            int64_t key = freeList[i];
+            freeList[i] = *(int64_t*)getAddress(key);
+            countFree(i, key, -1);
+            cache->push(i, key);
+            n++;
+        }
+        if (freeList[i] == -1) {
+            bitmap[i >> 6] &= ~(1ULL << (i & 63));
+        }
+        if (n > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Arena::flushThreadCache(ThreadCache* cache, bool drain) {
+    foldCounters(cache);
+    if (!cache->retired.empty()) {
+        freeDelayQueue();
+        for (size_t i = 0; i < cache->retired.size(); i++) {
+            const DelayNode& node = cache->retired[i];
+            delayFree(node.key, node.level, node.time);
+        }
+        cache->retired.clear();
+    }
+    for (uint32_t level = 0; level < cache->bins.size(); level++) {
+        std::vector<int64_t>& bin = cache->bins[level];
+        size_t keep = bin.size();
+        if (drain) {
+            keep = 0;
+        } else if (bin.size() > kThreadCacheBinLimit) {
+            keep = bin.size() - kThreadCacheBatch;
+        }
+        while (bin.size() > keep) {
+            pushFreeList(cache->pop(level), level);
+        }
+    }
+}
+
+void Arena::flushThreadCaches() {
+    if (!thread_safe_) {
+        return;
+    }
+    LockGuard guard(this);
+    for (size_t i = 0; i < caches_.size(); i++) {
+        flushThreadCache(caches_[i], true);
+    }
+    use_free_list_ = true;
+}
+
+void Arena::clearThreadCaches(bool flush) {
+    if (flush) {
+        flushThreadCaches();
+    }
+    LockGuard guard(this);
+    for (size_t i = 0; i < caches_.size(); i++) {
+        delete caches_[i];
+    }
+    caches_.clear();
+}
+
+void Arena::releaseThreadCache(void* data) {
+    ThreadCache* cache = reinterpret_cast<ThreadCache*>(data);
+    Arena* arena = cache->owner;
+    LockGuard guard(arena);
+    arena->flushThreadCache(cache, true);
+    arena->use_free_list_ = true;
+    for (size_t i = 0; i < arena->caches_.size(); i++) {
+        if (arena->caches_[i] == cache) {
+            arena->caches_.erase(arena->caches_.begin() + i);
+            break;
+        }
+    }
+    delete cache;
+}
+
+void Arena::lock() {
+    if (shared_) {
+        if (pthread_mutex_lock(sharedLock()) == EOWNERDEAD) {
+            recoverSharedState();
+            pthread_mutex_consistent(sharedLock());
+        }
+        return;
+    }
+    pthread_mutex_lock(&mutex_);
+}
+
+void Arena::unlock() {
+    if (shared_) {
+        pthread_mutex_unlock(sharedLock());
+        return;
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void Arena::initSharedLock() {
+    pthread_mutex_t* mutex = sharedLock();
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    memset(mutex, 0, sizeof(pthread_mutex_t));
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void Arena::beginQueueUpdate() {
+    if (!shared_) {
+        return;
+    }
+    QueueUndo* undo = queueUndo();
+    DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+      (pool_->getAddress(delay_queue_offset_));
+    memcpy(undo->queue, delayQueue, sizeof(DelayQueue));
+    delayQueue->getLinks(undo->links);
+    for (int i = 0; i < 3; i++) {
+        undo->nexts[i] = undo->links[i] == -1 ? -1
+            : reinterpret_cast<DelaySegment*>
+                (pool_->getAddress(undo->links[i]))->next;
+    }
+    __atomic_store_n(&undo->active, 1, __ATOMIC_RELEASE);
+}
+
+void Arena::endQueueUpdate() {
+    if (shared_) {
+        __atomic_store_n(&queueUndo()->active, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void Arena::recoverSharedState() {
+    QueueUndo* undo = queueUndo();
+    DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+      (pool_->getAddress(delay_queue_offset_));
+    if (undo->active) {
+        // A segment the update linked in is lost with it.
+        memcpy(static_cast<void*>(delayQueue), undo->queue,
+               sizeof(DelayQueue));
+        for (int i = 0; i < 3; i++) {
+            if (undo->links[i] != -1) {
+                reinterpret_cast<DelaySegment*>
+                  (pool_->getAddress(undo->links[i]))->next = undo->nexts[i];
+            }
+        }
+        undo->active = 0;
+    }
+    // Cuts every list at its first bad link and recounts what is left.
+    repairFreeLists();
+    rebuildSlabPages();
+
+    ArenaCounters* counter = counters();
+    counter->delay_blocks = 0;
+    counter->delay_bytes = 0;
+    DelayQueue::Cursor cursor = delayQueue->begin();
+    for (DelayNode* node = delayQueue->next(&cursor, pool_); node != NULL;
+         node = delayQueue->next(&cursor, pool_)) {
+        counter->delay_blocks++;
+        counter->delay_bytes += getSize(node->key);
+    }
+}
+
+void Arena::rebuildSlabPages() {
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>
+      (pool_->getAddress(slab_offset_));
+    touch(slab_offset_, sizeof(SlabHeader));
+    for (uint32_t cls = 0; cls < kSlabClassCount; cls++) {
+        slab->partial[cls] = -1;
+    }
+    slab->free_pages = -1;
+    int64_t end = pool_->getUsedSize();
+    int64_t offset = pool_->skipUnallocated(header_size_);
+    while (offset + static_cast<int64_t>(sizeof(uint32_t)) <= end) {
+        const uint32_t* prefix = reinterpret_cast<uint32_t*>
+          (pool_->getAddress(offset));
+        int64_t length = 0;
+        if (prefix[0] == kInternalBlockMark
+            || prefix[0] == kDeadSpanMark) {
+            length = 2 * sizeof(uint32_t) + prefix[1];
+        } else if (prefix[0] == 0) {
+            break;
+        } else {
+            length = sizeof(uint32_t) + prefix[0];
+        }
+        if (prefix[0] == kInternalBlockMark
+            && prefix[1] == kSlabChunkLength) {
+            int64_t first = (offset + 2 * sizeof(uint32_t)
+                             + kSlabPageSize - 1)
+                & ~static_cast<int64_t>(kSlabPageSize - 1);
+            for (uint32_t i = 0; i < kSlabChunkPages; i++) {
+                int64_t pageOffset = first + i * kSlabPageSize;
+                touch(pageOffset, sizeof(SlabPage));
+                SlabPage* page = reinterpret_cast<SlabPage*>
+                  (pool_->getAddress(pageOffset));
+                // Pages nothing was taken from keep a stale bitmap.
+                if (page->used != 0) {
+                    page->used = 0;
+                    for (uint32_t w = 0; w < kSlabBitmapWords; w++) {
+                        page->used += __builtin_popcountll(page->bitmap[w]);
+                    }
+                }
+                page->prev = -1;
+                page->next = -1;
+                if (page->used == 0) {
+                    page->next = slab->free_pages;
+                    slab->free_pages = pageOffset;
+                    continue;
+                }
+                if (page->used < page->capacity) {
+                    uint32_t cls = page->object_size / kSlabGranularity - 1;
+                    page->next = slab->partial[cls];
+                    if (page->next != -1) {
+                        reinterpret_cast<SlabPage*>
+                          (pool_->getAddress(page->next))->prev = pageOffset;
+                    }
+                    slab->partial[cls] = pageOffset;
+                }
+            }
+        }
+        offset = pool_->skipUnallocated(offset + length);
+    }
+}
+
+void Arena::rebuildFreeBitmap() {
+    int64_t* freeList = reinterpret_cast<int64_t*>
+      (pool_->getAddress(free_list_offset_));
+    uint64_t* bitmap = reinterpret_cast<uint64_t*>
+      (pool_->getAddress(free_bitmap_offset_));
+    memset(bitmap, 0, sizeof(uint64_t) * ((level_ + 63) / 64));
+    for (uint32_t i = 0; i < level_; i++) {
+        if (freeList[i] != -1) {
+            bitmap[i >> 6] |= 1ULL << (i & 63);
+        }
+    }
+}
+
+int Arena::create(uint32_t minMemSize,
+                                   uint32_t maxMemSize,
+                                   float    rate,
+                                   uint32_t delayTime) {
+    do {
+        pool_->reset();
+
+        int64_t key = -1;
+        char* pData  = NULL;
+
+        key = pool_->alloc(2 * sizeof(uint32_t));
+        if (key == -1) {
+            break;
+        }
+        pData = pool_->getAddress(key);
+        reinterpret_cast<uint32_t*>(pData)[0] = kArenaMagic;
+        reinterpret_cast<uint32_t*>(pData)[1] = kArenaFormatVersion;
+
+        key = pool_->alloc(sizeof(min_mem_size_));
+        if (key == -1) {
+            break;
+        }
+        pData = pool_->getAddress(key);
+        *(uint32_t*)pData = minMemSize;
+        min_mem_size_ = minMemSize;
+
+        key = pool_->alloc(sizeof(max_mem_size_));
+        if (key == -1) {
+            break;
+        }
+        pData = pool_->getAddress(key);
+        *(uint32_t*)pData = maxMemSize;
+        max_mem_size_ = maxMemSize;
+
+        key = pool_->alloc(sizeof(rate_));
+        if (key == -1) {
+            break;
+        }
+        pData = pool_->getAddress(key);
+        *(float*)pData = rate;
+        rate_ = rate;
+
+        key = pool_->alloc(sizeof(level_));
+        if (key == -1) {
+            break;
+        }
+        pData = pool_->getAddress(key);
+        buildSizeClasses();
+        uint32_t level = class_size_.size();
+        *(uint32_t*)pData = level;
+        level_ = level;
+
+        key = pool_->alloc(sizeof(int64_t) * level_);
+        if (key == -1) {
+            break;
+        }
+        free_list_offset_ = key;
+        int64_t *freeList = reinterpret_cast<int64_t*>(pool_->getAddress(key));
+        for (uint32_t i = 0; i < level_; i++) {
+            freeList[i] = -1;
+        }
+
+        key = pool_->alloc(sizeof(delay_time_));
+        if (key == -1) {
+            break;
+        }
+        pData = pool_->getAddress(key);
+        *(uint32_t*)pData = delayTime;
+        delay_time_ = delayTime;
+
+        key = pool_->alloc(sizeof(DelayQueue));
+        if (key == -1) {
+            break;
+        }
+        delay_queue_offset_ = key;
+        DelayQueue *delayQueue = reinterpret_cast<DelayQueue*>
+          (pool_->getAddress(key));
+
+        key = pool_->alloc(sizeof(DelaySegment));
+        if (key == -1) {
+            break;
+        }
+        reinterpret_cast<DelaySegment*>(pool_->getAddress(key))->next = -1;
+        delayQueue = new (delayQueue) DelayQueue(key);
+
+        // user_define, kept for user extension.
+        user_define_offset_ = pool_->alloc(sizeof(uint64_t));
+        if (user_define_offset_ == -1) {
+            break;
+        }
+        key = pool_->alloc(sizeof(uint64_t) * ((level_ + 63) / 64));
+        if (key == -1) {
+            break;
+        }
+        free_bitmap_offset_ = key;
+        memset(pool_->getAddress(key), 0, sizeof(uint64_t) * ((level_ + 63) / 64));
+
+        key = pool_->alloc(sizeof(uint32_t) * level_);
+        if (key == -1) {
+            break;
+        }
+        size_class_offset_ = key;
+        memcpy(pool_->getAddress(key), &class_size_[0],
+          sizeof(uint32_t) * level_);
+        buildLevelIndex();
+
+        key = pool_->alloc(sizeof(SlabHeader));
+        if (key == -1) {
+            break;
+        }
+        slab_offset_ = key;
+        SlabHeader* slab = reinterpret_cast<SlabHeader*>
+          (pool_->getAddress(key));
+        for (uint32_t i = 0; i < kSlabClassCount; i++) {
+            slab->partial[i] = -1;
+        }
+        slab->free_pages = -1;
+
+        // Process-shared lock, used when several processes write the pool,
+        // and the delay queue undo record behind it.
+        key = pool_->alloc(sizeof(pthread_mutex_t) + sizeof(int64_t)
+                           + sizeof(QueueUndo));
+        if (key == -1) {
+            break;
+        }
+        shared_lock_offset_ = (key + 7) & ~static_cast<int64_t>(7);
+        initSharedLock();
+        queueUndo()->active = 0;
+
+        int64_t countersSize = sizeof(ArenaCounters)
+            + sizeof(ClassCounters) * (level_ + 1);
+        key = pool_->alloc(countersSize);
+        if (key == -1) {
+            break;
+        }
+        counters_offset_ = key;
+        memset(pool_->getAddress(key), 0, countersSize);
+
+        // header_size
+        header_size_ = pool_->getUsedSize();
+        // Records of an earlier arena in this pool mean nothing now.
+        if (redo_ != NULL) {
+            redo_->reset();
+        }
+        // Free lists, delay queue and counters are touched by every call.
+        pool_->lockResident(0, header_size_);
+
+        return 0;
+    } while (0);
+
+    pool_->reset();
+    min_mem_size_ = 0;
+    max_mem_size_ = 0;
+    rate_       = 0.0;
     level_      = 0;
     free_list_offset_   = 0;
+    free_bitmap_offset_ = 0;
+    size_class_offset_  = 0;
+    slab_offset_        = 0;
+    shared_lock_offset_ = 0;
+    counters_offset_    = 0;
+    class_size_.clear();
     delay_time_  = 0;
     delay_queue_offset_ = 0;
     user_define_offset_ = 0;
@@ -293,6 +1311,14 @@ int32_t Arena::load() {
     char *pBase = pool_->getBase();
     char *pData = pBase;
 
+    // Older layouts would be parsed as garbage.
+    if (pool_->getUsedSize() < static_cast<int64_t>(2 * sizeof(uint32_t))
+        || reinterpret_cast<uint32_t*>(pData)[0] != kArenaMagic
+        || reinterpret_cast<uint32_t*>(pData)[1] != kArenaFormatVersion) {
+        return -1;
+    }
+    pData += 2 * sizeof(uint32_t);
+
     min_mem_size_ = *(reinterpret_cast<uint32_t*>(pData));
     pData += sizeof(min_mem_size_);
 
@@ -315,75 +1341,610 @@ int32_t Arena::load() {
 //  _delayQueue = (DelayQueue*)pData;
     delay_queue_offset_ = pData - pool_->getBase();
     pData += sizeof(DelayQueue);
-    pData += sizeof(DelayNode) * kDefaultDelayQueueSize;
+    pData += sizeof(DelaySegment);
 
     // user_define, kept for user extension.
     user_define_offset_ = pData - pool_->getBase();
     pData += sizeof(uint64_t);
 
+    free_bitmap_offset_ = pData - pool_->getBase();
+    pData += sizeof(uint64_t) * ((level_ + 63) / 64);
+
+    size_class_offset_ = pData - pool_->getBase();
+    const uint32_t* classSize = reinterpret_cast<const uint32_t*>(pData);
+    class_size_.assign(classSize, classSize + level_);
+    pData += sizeof(uint32_t) * level_;
+    buildLevelIndex();
+
+    slab_offset_ = pData - pool_->getBase();
+    pData += sizeof(SlabHeader);
+
+    // Process-shared lock and undo record, aligned as create placed them.
+    shared_lock_offset_ = (pData - pBase + 7) & ~static_cast<int64_t>(7);
+    pData += sizeof(pthread_mutex_t) + sizeof(int64_t) + sizeof(QueueUndo);
+
+    counters_offset_ = pData - pBase;
+    pData += sizeof(ArenaCounters) + sizeof(ClassCounters) * (level_ + 1);
+
+    // The bitmap is derived state, rebuild it from the list heads.  A
+    // shared pool's is kept by the processes still attached, initShared
+    // rebuilds it only when there are none.
+    if (!pool_->isShared()) {
+        rebuildFreeBitmap();
+    }
+
     header_size_ = pData - pBase;
+    pool_->lockResident(0, header_size_);
     use_free_list_ = true;
+    if (redo_ != NULL) {
+        // Bring the metadata back to the last commit, cut whatever the crash
+        // left half written, and start a fresh log from the repaired state.
+        int32_t applied = redo_->replay(pool_);
+        if (applied < 0) {
+            return -1;
+        }
+        redo_replayed_ = applied > 0;
+        // An empty log proves nothing either: dump() empties it while
+        // writers go on, and any of their pages may have reached the disk.
+        repairFreeLists();
+        if (pool_->dump() != 0 || redo_->reset() != 0) {
+            return -1;
+        }
+    }
+    // Epoch stamps mean nothing to a new process, and its readers are gone.
+    if (epochs_ != NULL) {
+        drainDelayQueue();
+    }
+    // Segments the delay queue grew by are as hot as the header.
+    std::vector<int64_t> segments;
+    reinterpret_cast<DelayQueue*>(pool_->getAddress(delay_queue_offset_))
+        ->getSegments(pool_, &segments);
+    for (size_t i = 0; i < segments.size(); i++) {
+        pool_->lockResident(segments[i], sizeof(DelaySegment));
+    }
     return 0;
 }
 
 uint32_t Arena::getLevel(uint32_t& size) {
-    uint32_t level    = 0;
+    if (size <= class_size_[0]) {
+        size = class_size_[0];
+        return 0;
+    }
+    // size lies in the octave (2^(b-1), 2^b], only a handful of classes
+    // can cover it.
+    uint32_t b = 32 - __builtin_clz(size - 1);
+    const uint32_t* first = &class_size_[0] + octave_begin_[b];
+    const uint32_t* last = &class_size_[0] + octave_end_[b];
+    uint32_t level = std::lower_bound(first, last, size) - &class_size_[0];
+    if (level >= level_) {
+        level = level_ - 1;
+    }
+    size = class_size_[level];
+    return level;
+}
+
+void Arena::buildSizeClasses() {
+    class_size_.clear();
     uint32_t realSize = min_mem_size_;
-    while (size > realSize) {
-        uint32_t t = static_cast<uint32_t>(realSize * rate_);
+    while (true) {
+        if (realSize >= max_mem_size_) {
+            class_size_.push_back(max_mem_size_);
+            break;
+        }
+        class_size_.push_back(realSize);
+        uint64_t t = static_cast<uint64_t>(realSize * rate_);
         if (t <= realSize) {
             t = realSize + 1;
         }
-        realSize = t;
-        level++;
+        realSize = t > max_mem_size_ ? max_mem_size_ : t;
+    }
+}
+
+void Arena::buildLevelIndex() {
+    const uint32_t* begin = &class_size_[0];
+    const uint32_t* end = begin + class_size_.size();
+    for (uint32_t b = 1; b < 33; b++) {
+        uint64_t low = (1ULL << (b - 1)) + 1;
+        uint64_t high = 1ULL << b;
+        octave_begin_[b] = std::lower_bound(begin, end,
+          static_cast<uint32_t>(std::min<uint64_t>(low, UINT32_MAX))) - begin;
+        octave_end_[b] = std::lower_bound(begin, end,
+          static_cast<uint32_t>(std::min<uint64_t>(high, UINT32_MAX))) - begin
+          + 1;
+        if (octave_end_[b] > class_size_.size()) {
+            octave_end_[b] = class_size_.size();
+        }
     }
-    size = realSize;
-    return level;
+}
+
+int32_t Arena::findFreeLevel(const uint64_t* bitmap,
+                             uint32_t from, uint32_t to) {
+    if (to >= level_) {
+        to = level_ - 1;
+    }
+    if (from > to) {
+        return -1;
+    }
+    uint32_t word = from >> 6;
+    uint64_t bits = bitmap[word] & (~0ULL << (from & 63));
+    while (true) {
+        if (bits != 0) {
+            uint32_t level = (word << 6) + __builtin_ctzll(bits);
+            return level <= to ? static_cast<int32_t>(level) : -1;
+        }
+        if (++word > (to >> 6)) {
+            return -1;
+        }
+        bits = bitmap[word];
+    }
+}
+
+void Arena::pushFreeList(int64_t key, uint32_t level) {
+    markLive(key, false);
+    if (releaseBlock(key)) {
+        return;
+    }
+    int64_t* freeList = reinterpret_cast<int64_t*>
+      (pool_->getAddress(free_list_offset_));
+    uint64_t* bitmap = reinterpret_cast<uint64_t*>
+      (pool_->getAddress(free_bitmap_offset_));
+    touch(key, sizeof(uint32_t) + sizeof(int64_t));
+    int64_t* pNextKey = reinterpret_cast<int64_t*>(getAddress(key));
+    *pNextKey = freeList[level];
+    freeList[level] = key;
+    bitmap[level >> 6] |= 1ULL << (level & 63);
+    countFree(level, key, 1);
 }
 
 void Arena::freeDelayQueue() {
     use_free_list_ = true;
-    uint32_t nowTime = time(NULL);
-    int64_t *freeList = reinterpret_cast<int64_t*>
-      (pool_->getAddress(free_list_offset_));
 
     DelayQueue *delayQueue = reinterpret_cast<DelayQueue*>
       (pool_->getAddress(delay_queue_offset_));
+    if (delayQueue->empty()) {
+        return;
+    }
+    // Nodes stamped before safeStamp are released.
+    int64_t safeStamp;
+    if (epochs_ != NULL) {
+        safeStamp = epochs_->safeEpoch();
+    } else {
+        safeStamp = static_cast<int64_t>(time(NULL)) - delay_time_;
+    }
     while (!delayQueue->empty()) {
-        DelayNode *pNode = delayQueue->front(pool_);
-        if (pNode->time + delay_time_ < nowTime) {
-            int64_t* pNextKey = reinterpret_cast<int64_t*>
-              (getAddress(pNode->key));
-            *pNextKey = freeList[pNode->level];
-            freeList[pNode->level] = pNode->key;
-
-            delayQueue->pop();
-        } else {
+        DelayNode node = *delayQueue->front(pool_);
+        if (node.time >= safeStamp) {
             return;
         }
+        // Off the queue first: a crash in between leaks the block instead
+        // of releasing it twice.
+        beginQueueUpdate();
+        delayQueue->pop(pool_, redo_);
+        endQueueUpdate();
+        releaseDelayed(node);
     }
 }
 
-void Arena::expandDelayQueue() {
-    DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+void Arena::drainDelayQueue() {
+    use_free_list_ = true;
+    DelayQueue *delayQueue = reinterpret_cast<DelayQueue*>
       (pool_->getAddress(delay_queue_offset_));
+    while (!delayQueue->empty()) {
+        DelayNode node = *delayQueue->front(pool_);
+        beginQueueUpdate();
+        delayQueue->pop(pool_, redo_);
+        endQueueUpdate();
+        releaseDelayed(node);
+    }
+}
 
-    uint32_t newSize   = delayQueue->size() + kDefaultDelayQueueSize;
-    int64_t key       = pool_->alloc(newSize * sizeof(DelayNode));
-    DelayQueue newQueue(newSize, key);
+void Arena::releaseDelayed(const DelayNode& node) {
+    counters()->delay_blocks--;
+    counters()->delay_bytes -= getSize(node.key);
+    if (node.level == kSlabLevel) {
+        slabFree(node.key);
+    } else {
+        pushFreeList(node.key, node.level);
+    }
+}
 
-    delayQueue = reinterpret_cast<DelayQueue*>
+void Arena::countLive(uint32_t level, int64_t bytes, int32_t sign,
+                      uint32_t requested) {
+    ClassCounters* counter = NULL;
+    ThreadCache* cache = NULL;
+    if (thread_safe_) {
+        cache = getThreadCache();
+        counter = &cache->counters[level];
+    } else {
+        counter = classCounters() + level;
+    }
+    if (sign > 0) {
+        counter->requested_estimate += requested;
+    } else {
+        counter->requested_estimate -= requestedShare(level, bytes,
+            cache != NULL ? counter : NULL);
+    }
+    counter->live_blocks += sign;
+    counter->live_bytes += sign * bytes;
+    if (cache != NULL && ++cache->pending >= kThreadCacheCountLimit) {
+        LockGuard guard(this);
+        foldCounters(cache);
+    }
+}
+
+int64_t Arena::requestedShare(uint32_t level, int64_t bytes,
+                              const ClassCounters* pending) {
+    // Other threads fold their counters under the lock, a torn read only
+    // skews the estimate.
+    const ClassCounters* counter = classCounters() + level;
+    int64_t liveBytes = __atomic_load_n(&counter->live_bytes,
+                                        __ATOMIC_RELAXED);
+    int64_t liveRequested = __atomic_load_n(&counter->requested_estimate,
+                                            __ATOMIC_RELAXED);
+    if (pending != NULL) {
+        liveBytes += pending->live_bytes;
+        liveRequested += pending->requested_estimate;
+    }
+    if (liveBytes <= bytes) {
+        return liveRequested;
+    }
+    return static_cast<int64_t>(static_cast<double>(liveRequested)
+                                * bytes / liveBytes);
+}
+
+void Arena::foldCounters(ThreadCache* cache) {
+    if (cache->pending == 0) {
+        return;
+    }
+    ClassCounters* counter = classCounters();
+    for (uint32_t i = 0; i < cache->counters.size(); i++) {
+        counter[i].live_blocks += cache->counters[i].live_blocks;
+        counter[i].live_bytes += cache->counters[i].live_bytes;
+        counter[i].requested_estimate += cache->counters[i].requested_estimate;
+        cache->counters[i].live_blocks = 0;
+        cache->counters[i].live_bytes = 0;
+        cache->counters[i].requested_estimate = 0;
+    }
+    cache->pending = 0;
+}
+
+int32_t Arena::getStats(ArenaStats* stats) {
+    if (stats == NULL || pool_ == NULL || counters_offset_ == 0) {
+        return -1;
+    }
+    if (thread_safe_) {
+        lock();
+    }
+    const ClassCounters* counter = classCounters();
+    int64_t freeBytes = 0;
+    stats->classes.resize(level_);
+    for (uint32_t i = 0; i < level_; i++) {
+        ClassStats& c = stats->classes[i];
+        c.size = class_size_[i];
+        c.live_blocks = counter[i].live_blocks;
+        c.live_bytes = counter[i].live_bytes;
+        c.free_blocks = counter[i].free_blocks;
+        c.free_bytes = counter[i].free_bytes;
+        freeBytes += c.free_bytes;
+    }
+    stats->slab_objects = counter[level_].live_blocks;
+    stats->slab_bytes = counter[level_].live_bytes;
+    stats->delay_blocks = counters()->delay_blocks;
+    stats->delay_bytes = counters()->delay_bytes;
+    stats->delay_age = 0;
+    DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
       (pool_->getAddress(delay_queue_offset_));
-    while (!delayQueue->empty()) {
-       newQueue.push(*(delayQueue->front(pool_)), pool_);
-       delayQueue->pop();
+    if (!delayQueue->empty()) {
+        int64_t now = epochs_ != NULL
+            ? static_cast<int64_t>(epochs_->current())
+            : static_cast<int64_t>(time(NULL));
+        stats->delay_age = now - delayQueue->front(pool_)->time;
+    }
+    stats->header_size = header_size_;
+    stats->data_size = getDataSize();
+    stats->headroom = pool_->getCapacity() - pool_->getUsedSize();
+    stats->expand_count = pool_->getExpandCount();
+    int64_t requested = 0;
+    int64_t allocated = 0;
+    for (uint32_t i = 0; i <= level_; i++) {
+        requested += counter[i].requested_estimate;
+        allocated += counter[i].live_bytes;
+    }
+    stats->internal_fragmentation = allocated > 0
+        ? 1.0 - static_cast<double>(requested) / allocated
+        : 0.0;
+    stats->external_fragmentation = stats->data_size > 0
+        ? static_cast<double>(freeBytes + stats->delay_bytes)
+          / stats->data_size
+        : 0.0;
+    if (thread_safe_) {
+        unlock();
+    }
+    return 0;
+}
+
+int64_t Arena::retireStamp() {
+    if (epochs_ != NULL) {
+        return epochs_->retire();
+    }
+    return time(NULL);
+}
+
+int32_t Arena::set_epoch_reclaim(bool enable) {
+    if (enable == (epochs_ != NULL)) {
+        return 0;
+    }
+    if (shared_) {
+        return -1;
+    }
+    // Queued stamps are times in one mode and epochs in the other.
+    flushThreadCaches();
+    LockGuard guard(this);
+    drainDelayQueue();
+    if (enable) {
+        epochs_ = new EpochManager();
+    } else {
+        delete epochs_;
+        epochs_ = NULL;
     }
+    return 0;
+}
 
-    memcpy(delayQueue, &newQueue, sizeof(DelayQueue));
+bool Arena::releaseBlock(int64_t key) {
+    if (release_size_ == 0) {
+        return false;
+    }
+    uint32_t size = getSize(key);
+    if (size < release_size_) {
+        return false;
+    }
+    int64_t end = key + sizeof(uint32_t) + size;
+    if (end == pool_->getUsedSize() && shrinkPool(end, key) == 0) {
+        return true;
+    }
+    // Keep the prefix and the next pointer, drop the pages after them.
+    int64_t data = key + sizeof(uint32_t) + sizeof(int64_t);
+    pool_->release(data, end - data);
+    return false;
+}
+
+bool Arena::resizeInPlace(int64_t key, uint32_t size, uint32_t new_size) {
+    uint32_t realSize = new_size;
+    getLevel(realSize);
+    uint32_t* prefix = reinterpret_cast<uint32_t*>(pool_->getAddress(key));
+    int64_t end = key + sizeof(uint32_t) + size;
+    int64_t newEnd = key + sizeof(uint32_t) + realSize;
+    bool tail = end == pool_->getUsedSize();
+    touch(key, sizeof(uint32_t));
+
+    if (realSize > size) {
+        // Only the last block can grow, by moving the pool tail.
+        if (tail && pool_->extend(end, newEnd) == 0) {
+            *prefix = realSize;
+            return true;
+        }
+        return false;
+    }
+    if (realSize == size) {
+        return true;
+    }
+    if (tail && shrinkPool(end, newEnd) == 0) {
+        *prefix = realSize;
+        return true;
+    }
+    int64_t rest = splitBlock(key, size, realSize);
+    if (rest != -1) {
+        freeDelayQueue();
+        delayFree(rest, blockLevel(rest), retireStamp());
+        use_free_list_ = true;
+    }
+    return true;
+}
+
+int64_t Arena::splitBlock(int64_t key, uint32_t size, uint32_t realSize) {
+    // The rest's length need not be a class size, blockLevel lists it under
+    // the largest class it covers.
+    uint32_t remainder = size - realSize;
+    if (remainder < sizeof(uint32_t) + min_mem_size_) {
+        return -1;
+    }
+    int64_t rest = key + sizeof(uint32_t) + realSize;
+    touch(key, sizeof(uint32_t));
+    touch(rest, sizeof(uint32_t));
+    *reinterpret_cast<uint32_t*>(pool_->getAddress(rest)) =
+        remainder - sizeof(uint32_t);
+    *reinterpret_cast<uint32_t*>(pool_->getAddress(key)) = realSize;
+    noteBlock(rest);
+    return rest;
+}
+
+uint32_t Arena::blockLevel(int64_t key) {
+    if (isSlabKey(key)) {
+        return kSlabLevel;
+    }
+    uint32_t size = getSize(key);
+    uint32_t realSize = size;
+    uint32_t level = getLevel(realSize);
+    if (realSize > size && level > 0) {
+        level--;
+    }
+    return level;
+}
+
+int64_t Arena::slabAlloc(uint32_t size) {
+    uint32_t cls = (size + kSlabGranularity - 1) / kSlabGranularity - 1;
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>
+      (pool_->getAddress(slab_offset_));
+    int64_t pageOffset = slab->partial[cls];
+    SlabPage* page = NULL;
+    if (pageOffset == -1) {
+        pageOffset = slabNewPage();
+        if (pageOffset == -1) {
+            return -1;
+        }
+        slab = reinterpret_cast<SlabHeader*>(pool_->getAddress(slab_offset_));
+        page = reinterpret_cast<SlabPage*>(pool_->getAddress(pageOffset));
+        touch(pageOffset, sizeof(SlabPage));
+        page->object_size = (cls + 1) * kSlabGranularity;
+        page->capacity = (kSlabPageSize - sizeof(SlabPage))
+            / page->object_size;
+        page->used = 0;
+        page->prev = -1;
+        page->next = -1;
+        memset(page->bitmap, 0, sizeof(page->bitmap));
+        slab->partial[cls] = pageOffset;
+    } else {
+        page = reinterpret_cast<SlabPage*>(pool_->getAddress(pageOffset));
+        touch(pageOffset, sizeof(SlabPage));
+    }
+
+    uint32_t index = 0;
+    for (uint32_t i = 0; i < kSlabBitmapWords; i++) {
+        if (~page->bitmap[i] != 0) {
+            index = i * 64 + __builtin_ctzll(~page->bitmap[i]);
+            page->bitmap[i] |= 1ULL << (index & 63);
+            break;
+        }
+    }
+    if (++page->used == page->capacity) {
+        // Full pages leave the partial list until an object is freed.
+        slab->partial[cls] = page->next;
+        if (page->next != -1) {
+            touch(page->next, sizeof(SlabPage));
+            reinterpret_cast<SlabPage*>
+              (pool_->getAddress(page->next))->prev = -1;
+        }
+        page->next = -1;
+    }
+    int64_t offset = pageOffset + sizeof(SlabPage)
+        + static_cast<int64_t>(index) * page->object_size;
+    return kSlabKeyTag | (offset - sizeof(uint32_t));
+}
+
+void Arena::slabFree(int64_t key) {
+    SlabPage* page = slabPage(key);
+    int64_t offset = (key & kKeyOffsetMask) + sizeof(uint32_t);
+    int64_t pageOffset = offset & ~static_cast<int64_t>(kSlabPageSize - 1);
+    uint32_t index = (offset - pageOffset - sizeof(SlabPage))
+        / page->object_size;
+    uint32_t cls = page->object_size / kSlabGranularity - 1;
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>
+      (pool_->getAddress(slab_offset_));
+
+    touch(pageOffset, sizeof(SlabPage));
+    page->bitmap[index >> 6] &= ~(1ULL << (index & 63));
+    if (page->used-- == page->capacity) {
+        page->prev = -1;
+        page->next = slab->partial[cls];
+        if (page->next != -1) {
+            touch(page->next, sizeof(SlabPage));
+            reinterpret_cast<SlabPage*>
+              (pool_->getAddress(page->next))->prev = pageOffset;
+        }
+        slab->partial[cls] = pageOffset;
+    }
+    if (page->used == 0) {
+        // Unlink the empty page so that any class can reuse it.
+        if (page->prev != -1) {
+            touch(page->prev, sizeof(SlabPage));
+            reinterpret_cast<SlabPage*>
+              (pool_->getAddress(page->prev))->next = page->next;
+        } else {
+            slab->partial[cls] = page->next;
+        }
+        if (page->next != -1) {
+            touch(page->next, sizeof(SlabPage));
+            reinterpret_cast<SlabPage*>
+              (pool_->getAddress(page->next))->prev = page->prev;
+        }
+        page->next = slab->free_pages;
+        slab->free_pages = pageOffset;
+    }
+}
+
+int64_t Arena::slabNewPage() {
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>
+      (pool_->getAddress(slab_offset_));
+    if (slab->free_pages == -1) {
+        int64_t key = allocInternal(kSlabChunkLength);
+        if (key == -1) {
+            return -1;
+        }
+        int64_t first = (key + kSlabPageSize - 1)
+            & ~static_cast<int64_t>(kSlabPageSize - 1);
+        slab = reinterpret_cast<SlabHeader*>(pool_->getAddress(slab_offset_));
+        for (int64_t i = kSlabChunkPages - 1; i >= 0; i--) {
+            int64_t pageOffset = first + i * kSlabPageSize;
+            touch(pageOffset, sizeof(SlabPage));
+            SlabPage* page = reinterpret_cast<SlabPage*>
+              (pool_->getAddress(pageOffset));
+            // The space may have held blocks before, scans skip pages
+            // nothing was taken from.
+            page->used = 0;
+            page->next = slab->free_pages;
+            slab->free_pages = pageOffset;
+        }
+    }
+    int64_t pageOffset = slab->free_pages;
+    slab->free_pages = reinterpret_cast<SlabPage*>
+      (pool_->getAddress(pageOffset))->next;
+    return pageOffset;
+}
+
+int64_t Arena::allocInternal(uint32_t length) {
+    int64_t key = pool_->alloc(2 * sizeof(uint32_t) + length);
+    if (key == -1) {
+        return -1;
+    }
+    pool_->markDirty(key, 2 * sizeof(uint32_t) + length);
+    touch(key, 2 * sizeof(uint32_t));
+    uint32_t* prefix = reinterpret_cast<uint32_t*>(pool_->getAddress(key));
+    prefix[0] = kInternalBlockMark;
+    prefix[1] = length;
+    noteBlock(key);
+    return key + 2 * sizeof(uint32_t);
+}
+
+int32_t Arena::shrinkPool(int64_t end, int64_t new_end) {
+    if (pool_->shrink(end, new_end) != 0) {
+        return -1;
+    }
+    if (live_map_ != NULL) {
+        live_map_->dropStarts(new_end);
+    }
+    return 0;
+}
+
+void Arena::expandDelayQueue() {
+    int64_t key = allocInternal(sizeof(DelaySegment));
+    if (key == -1) {
+        return;
+    }
+    pool_->lockResident(key, sizeof(DelaySegment));
+    beginQueueUpdate();
+    reinterpret_cast<DelayQueue*>(pool_->getAddress(delay_queue_offset_))
+        ->addSegment(key, pool_, redo_);
+    endQueueUpdate();
 }
 
 int32_t Arena::reset() {
-    return create(min_mem_size_, max_mem_size_, rate_, delay_time_);
+    if (thread_safe_) {
+        // Cached blocks belong to the old layout.
+        LockGuard guard(this);
+        for (size_t i = 0; i < caches_.size(); i++) {
+            ThreadCache* cache = caches_[i];
+            for (uint32_t level = 0; level < cache->bins.size(); level++) {
+                cache->bins[level].clear();
+            }
+            std::fill(cache->bitmap.begin(), cache->bitmap.end(), 0);
+            cache->retired.clear();
+        }
+    }
+    int32_t ret = create(min_mem_size_, max_mem_size_, rate_, delay_time_);
+    if (ret == 0 && live_map_ != NULL) {
+        live_map_->reset();
+    }
+    return ret;
 }
 
 int64_t Arena::getDataSize() {
@@ -400,34 +1961,413 @@ int64_t Arena::append(Arena *pSrc) {
 
     const int64_t blockSize = (1024*1024);
 
+    // The data region moves as one range, keys only shift by a constant
+    // when neither side has a gap in it.
+    if (!pSrc->isContiguous()) {
+        return -1;
+    }
+    if (nDataSize <= 0) {
+        return 0;
+    }
+    int64_t begin = pool_->getUsedSize();
+    int64_t dstKey = pool_->alloc(nDataSize);
+    if (dstKey == -1 || dstKey != begin) {
+        return -1;
+    }
+    pool_->markDirty(dstKey, nDataSize);
+
     int64_t copySize = 0;
-    int64_t offset = nHeaderSize;
+    int64_t offset = 0;
     int64_t remain = 0;
-    int64_t dstKey = 0;
     char *pSrcBuf = NULL;
     char *pDstBuf = NULL;
-    while (1) {
-        if (offset >= nHeaderSize + nDataSize) {
-            break;
-        }
-        remain = (nHeaderSize + nDataSize) - offset;
+    while (offset < nDataSize) {
+        remain = nDataSize - offset;
         copySize = (remain > blockSize) ? blockSize : remain;
-        pSrcBuf = pSrc->pool_->getAddress(offset, copySize);
-        if (!pSrcBuf) {
-            return -1;
-        }
-        dstKey = pool_->alloc(copySize);
-        if (dstKey == -1) {
-            return -1;
-        }
-        pDstBuf = pool_->getAddress(dstKey);
-        if (!pDstBuf) {
+        pSrcBuf = pSrc->pool_->getAddress(nHeaderSize + offset);
+        pDstBuf = pool_->getAddress(dstKey + offset);
+        if (!pSrcBuf || !pDstBuf) {
             return -1;
         }
         memcpy(pDstBuf, pSrcBuf, copySize);
         offset += copySize;
     }
+    if (live_map_ != NULL) {
+        mapBlocks(begin, pool_->getUsedSize());
+    }
     return nDataSize;
 }
 
+bool Arena::isContiguous() {
+    int64_t end = pool_->getUsedSize();
+    int64_t offset = header_size_;
+    while (offset + static_cast<int64_t>(sizeof(uint32_t)) <= end) {
+        if (pool_->skipUnallocated(offset) != offset) {
+            return false;
+        }
+        const uint32_t* prefix = reinterpret_cast<uint32_t*>
+          (pool_->getAddress(offset));
+        if (prefix[0] == kInternalBlockMark
+            || prefix[0] == kDeadSpanMark) {
+            offset += 2 * sizeof(uint32_t) + prefix[1];
+        } else if (prefix[0] == 0) {
+            // Space reserved but not written yet, the blocks past it
+            // cannot be found.
+            return false;
+        } else {
+            offset += sizeof(uint32_t) + prefix[0];
+        }
+    }
+    return true;
+}
+
+int64_t Arena::merge(Arena* src, int64_t* delta, uint32_t threads) {
+    if (src == this || src->pool_ == NULL || pool_ == NULL
+        || src->class_size_ != class_size_) {
+        return -1;
+    }
+    src->flushThreadCaches();
+    LockGuard guard(this);
+    LockGuard srcGuard(src);
+    if (!src->isContiguous()) {
+        return -1;
+    }
+
+    int64_t srcStart = src->header_size_;
+    int64_t size = src->pool_->getUsedSize() - srcStart;
+    // Slab pages stay page aligned when the data lands at the same offset
+    // within a page as in src.  The gap in front becomes an internal block.
+    int64_t end = pool_->getUsedSize();
+    int64_t pad = (srcStart - end) & static_cast<int64_t>(kSlabPageSize - 1);
+    if (pad != 0 && pad < static_cast<int64_t>(2 * sizeof(uint32_t))) {
+        pad += kSlabPageSize;
+    }
+    if (size <= 0) {
+        *delta = end - srcStart;
+        return 0;
+    }
+    int64_t key = pool_->alloc(pad + size);
+    if (key == -1 || key != end) {
+        return -1;
+    }
+    if (pad != 0) {
+        touch(key, 2 * sizeof(uint32_t));
+        uint32_t* prefix = reinterpret_cast<uint32_t*>(pool_->getAddress(key));
+        prefix[0] = kInternalBlockMark;
+        prefix[1] = pad - 2 * sizeof(uint32_t);
+        noteBlock(key);
+    }
+    int64_t start = key + pad;
+    *delta = start - srcStart;
+
+    pool_->markDirty(start, size);
+    if (pool_->copyFrom(start, src->pool_, srcStart, size) != 0) {
+        parallelCopy(pool_->getAddress(start),
+                     src->pool_->getAddress(srcStart), size, threads);
+    }
+    // Everything is live until the free lists and delay queue below say
+    // otherwise.
+    if (live_map_ != NULL) {
+        mapBlocks(start, start + size);
+    }
+
+    // Free blocks, their links still hold src keys.
+    const int64_t* srcFreeList = reinterpret_cast<int64_t*>
+      (src->pool_->getAddress(src->free_list_offset_));
+    for (uint32_t level = 0; level < level_; level++) {
+        for (int64_t freeKey = srcFreeList[level]; freeKey != -1;
+             freeKey = *reinterpret_cast<int64_t*>
+               (src->getAddress(freeKey))) {
+            pushFreeList(freeKey + *delta, level);
+        }
+    }
+
+    // Pending frees keep their time stamps; epochs do not carry over
+    // between arenas, so those wait a full grace period here.
+    DelayQueue* srcQueue = reinterpret_cast<DelayQueue*>
+      (src->pool_->getAddress(src->delay_queue_offset_));
+    DelayQueue::Cursor cursor = srcQueue->begin();
+    int64_t now = retireStamp();
+    for (DelayNode* node = srcQueue->next(&cursor, src->pool_); node != NULL;
+         node = srcQueue->next(&cursor, src->pool_)) {
+        int64_t stamp = epochs_ == NULL && src->epochs_ == NULL
+            ? node->time : now;
+        delayFree(translateKey(node->key, *delta), node->level, stamp);
+    }
+
+    // The segments src's delay queue grew by belong to no one here, they
+    // become free blocks.  The first one lives in src's header.
+    std::vector<int64_t> segments;
+    srcQueue->getSegments(src->pool_, &segments);
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (segments[i] < srcStart) {
+            continue;
+        }
+        int64_t block = segments[i] - 2 * sizeof(uint32_t) + *delta;
+        touch(block, sizeof(uint32_t));
+        *reinterpret_cast<uint32_t*>(pool_->getAddress(block)) =
+            sizeof(uint32_t) + sizeof(DelaySegment);
+        pushFreeList(block, blockLevel(block));
+    }
+
+    // Partial slab pages and free pages go in front of ours.
+    const SlabHeader* srcSlab = reinterpret_cast<SlabHeader*>
+      (src->pool_->getAddress(src->slab_offset_));
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>
+      (pool_->getAddress(slab_offset_));
+    touch(slab_offset_, sizeof(SlabHeader));
+    for (uint32_t cls = 0; cls <= kSlabClassCount; cls++) {
+        bool partial = cls < kSlabClassCount;
+        int64_t first = partial ? srcSlab->partial[cls] : srcSlab->free_pages;
+        int64_t* head = partial ? &slab->partial[cls] : &slab->free_pages;
+        if (first == -1) {
+            continue;
+        }
+        int64_t last = -1;
+        for (int64_t page = first + *delta; page != -1;) {
+            touch(page, sizeof(SlabPage));
+            SlabPage* p = reinterpret_cast<SlabPage*>
+              (pool_->getAddress(page));
+            if (partial && p->prev != -1) {
+                p->prev += *delta;
+            }
+            last = page;
+            page = p->next == -1 ? -1 : p->next + *delta;
+            p->next = page;
+        }
+        SlabPage* tail = reinterpret_cast<SlabPage*>(pool_->getAddress(last));
+        tail->next = *head;
+        if (partial && *head != -1) {
+            touch(*head, sizeof(SlabPage));
+            reinterpret_cast<SlabPage*>(pool_->getAddress(*head))->prev = last;
+        }
+        *head = first + *delta;
+    }
+
+    touch(counters_offset_, header_size_ - counters_offset_);
+    for (uint32_t level = 0; level <= level_; level++) {
+        classCounters()[level].live_blocks +=
+            src->classCounters()[level].live_blocks;
+        classCounters()[level].live_bytes +=
+            src->classCounters()[level].live_bytes;
+        classCounters()[level].requested_estimate +=
+            src->classCounters()[level].requested_estimate;
+    }
+    use_free_list_ = true;
+    return size;
+}
+
+void Arena::translateKeys(int64_t* keys, size_t n, int64_t delta) {
+    for (size_t i = 0; i < n; i++) {
+        if (keys[i] != -1) {
+            keys[i] = translateKey(keys[i], delta);
+        }
+    }
+}
+
+int32_t Arena::openLiveMap(const char* path) {
+    if (pool_ == NULL || shared_) {
+        return -1;
+    }
+    // Blocks start at least a prefix and a minimum block apart.
+    uint32_t granularity = 64;
+    while (granularity > sizeof(uint32_t) + min_mem_size_) {
+        granularity /= 2;
+    }
+    LiveMap* map = new LiveMap;
+    int32_t ret = map->open(path, granularity, pool_->getUsedSize());
+    if (ret < 0) {
+        delete map;
+        return -1;
+    }
+    delete live_map_;
+    live_map_ = map;
+    if (ret == 1 && !redo_replayed_) {
+        return 0;
+    }
+    return rebuildLiveMap();
+}
+
+int32_t Arena::rebuildLiveMap() {
+    if (live_map_ == NULL) {
+        return -1;
+    }
+    flushThreadCaches();
+    LockGuard guard(this);
+    live_map_->reset();
+    mapBlocks(header_size_, pool_->getUsedSize());
+
+    const int64_t* freeList = reinterpret_cast<int64_t*>
+      (pool_->getAddress(free_list_offset_));
+    for (uint32_t level = 0; level < level_; level++) {
+        for (int64_t key = freeList[level]; key != -1;
+             key = *reinterpret_cast<int64_t*>(getAddress(key))) {
+            live_map_->setLive(key, false);
+        }
+    }
+    DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+      (pool_->getAddress(delay_queue_offset_));
+    DelayQueue::Cursor cursor = delayQueue->begin();
+    for (DelayNode* node = delayQueue->next(&cursor, pool_); node != NULL;
+         node = delayQueue->next(&cursor, pool_)) {
+        markLive(node->key, false);
+    }
+    return live_map_->isValid() ? 0 : -1;
+}
+
+void Arena::mapBlocks(int64_t begin, int64_t end) {
+    int64_t offset = pool_->skipUnallocated(begin);
+    while (offset + static_cast<int64_t>(sizeof(uint32_t)) <= end) {
+        const uint32_t* prefix = reinterpret_cast<uint32_t*>
+          (pool_->getAddress(offset));
+        int64_t length = 0;
+        if (prefix[0] == kInternalBlockMark
+            || prefix[0] == kDeadSpanMark) {
+            length = 2 * sizeof(uint32_t) + prefix[1];
+        } else if (prefix[0] == 0) {
+            // Space reserved but not written yet, nothing is found past it.
+            break;
+        } else {
+            live_map_->setLive(offset, true);
+            length = sizeof(uint32_t) + prefix[0];
+        }
+        live_map_->noteStart(offset);
+        offset = pool_->skipUnallocated(offset + length);
+    }
+}
+
+struct Arena::ScanTask {
+    Arena* arena;
+    ScanFunc func;
+    void* arg;
+    // Slab objects in the delay queue, sorted.  They keep their slots
+    // until they leave it.
+    std::vector<int64_t> delayed;
+    int64_t next_region;
+    int64_t end_region;
+    int64_t end;
+    int64_t visited;
+};
+
+int64_t Arena::scan(ScanFunc func, void* arg, uint32_t threads) {
+    if (live_map_ == NULL || !live_map_->isValid() || func == NULL) {
+        return -1;
+    }
+    ScanTask task;
+    task.arena = this;
+    task.func = func;
+    task.arg = arg;
+    {
+        LockGuard guard(this);
+        DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+          (pool_->getAddress(delay_queue_offset_));
+        DelayQueue::Cursor cursor = delayQueue->begin();
+        for (DelayNode* node = delayQueue->next(&cursor, pool_); node != NULL;
+             node = delayQueue->next(&cursor, pool_)) {
+            if (isSlabKey(node->key)) {
+                task.delayed.push_back(node->key);
+            }
+        }
+    }
+    std::sort(task.delayed.begin(), task.delayed.end());
+    task.end = pool_->getUsedSize();
+    task.next_region = header_size_ / kLiveRegionSize;
+    task.end_region = (task.end + kLiveRegionSize - 1) / kLiveRegionSize;
+    task.visited = 0;
+
+    int64_t count = std::min<int64_t>(std::max<uint32_t>(threads, 1),
+                                      task.end_region - task.next_region);
+    std::vector<pthread_t> workers(std::max<int64_t>(count, 1));
+    std::vector<bool> started(workers.size(), false);
+    for (int64_t i = 1; i < count; i++) {
+        started[i] = pthread_create(&workers[i], NULL, &scanMain, &task) == 0;
+    }
+    scanMain(&task);
+    for (int64_t i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        }
+    }
+    return task.visited;
+}
+
+void* Arena::scanMain(void* data) {
+    ScanTask* task = reinterpret_cast<ScanTask*>(data);
+    int64_t visited = 0;
+    for (int64_t region = __atomic_fetch_add(&task->next_region, 1,
+                                             __ATOMIC_RELAXED);
+         region < task->end_region;
+         region = __atomic_fetch_add(&task->next_region, 1,
+                                     __ATOMIC_RELAXED)) {
+        visited += task->arena->scanRegion(region, task);
+    }
+    __atomic_fetch_add(&task->visited, visited, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int64_t Arena::scanRegion(int64_t region, ScanTask* task) {
+    int64_t offset = live_map_->firstStart(region);
+    if (offset == -1) {
+        return 0;
+    }
+    // Blocks starting in the region are its own, wherever they end.
+    int64_t limit = std::min((region + 1) * kLiveRegionSize, task->end);
+    int64_t visited = 0;
+    while (offset < limit
+           && offset + static_cast<int64_t>(sizeof(uint32_t)) <= task->end) {
+        const uint32_t* prefix = reinterpret_cast<uint32_t*>
+          (pool_->getAddress(offset));
+        int64_t length = 0;
+        if (prefix[0] == kInternalBlockMark
+            || prefix[0] == kDeadSpanMark) {
+            length = 2 * sizeof(uint32_t) + prefix[1];
+            if (prefix[1] == kSlabChunkLength) {
+                visited += scanSlabChunk(offset + 2 * sizeof(uint32_t), task);
+            }
+        } else if (prefix[0] == 0) {
+            break;
+        } else {
+            length = sizeof(uint32_t) + prefix[0];
+            if (live_map_->isLive(offset)) {
+                task->func(offset, pool_->getAddress(offset + sizeof(uint32_t)),
+                           prefix[0], task->arg);
+                visited++;
+            }
+        }
+        offset = pool_->skipUnallocated(offset + length);
+    }
+    return visited;
+}
+
+int64_t Arena::scanSlabChunk(int64_t offset, ScanTask* task) {
+    int64_t first = (offset + kSlabPageSize - 1)
+        & ~static_cast<int64_t>(kSlabPageSize - 1);
+    int64_t visited = 0;
+    for (uint32_t i = 0; i < kSlabChunkPages; i++) {
+        int64_t pageOffset = first + static_cast<int64_t>(i) * kSlabPageSize;
+        const SlabPage* page = reinterpret_cast<SlabPage*>
+          (pool_->getAddress(pageOffset));
+        if (page->used == 0) {
+            continue;
+        }
+        for (uint32_t w = 0; w < kSlabBitmapWords; w++) {
+            for (uint64_t bits = page->bitmap[w]; bits != 0;
+                 bits &= bits - 1) {
+                uint32_t index = w * 64 + __builtin_ctzll(bits);
+                int64_t data = pageOffset + sizeof(SlabPage)
+                    + static_cast<int64_t>(index) * page->object_size;
+                int64_t key = kSlabKeyTag | (data - sizeof(uint32_t));
+                if (std::binary_search(task->delayed.begin(),
+                                       task->delayed.end(), key)) {
+                    continue;
+                }
+                task->func(key, pool_->getAddress(data), page->object_size,
+                           task->arg);
+                visited++;
+            }
+        }
+    }
+    return visited;
+}
+
 }  // namespace base
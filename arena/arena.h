@@ -1,14 +1,29 @@
-
 #ifndef BASE_ARENA_H_
 #define BASE_ARENA_H_
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <vector>
+#include "arena/arena_stats.h"
 #include "arena/delay_queue.h"
+#include "arena/epoch.h"
+#include "arena/live_map.h"
 #include "arena/mempool.h"
+#include "arena/redo_log.h"
+#include "arena/slab.h"
+#include "arena/thread_cache.h"
 
 namespace base {
 
+class Compactor;
+
+// First two words of an arena header.  Bump kArenaFormatVersion with every
+// change to the header layout; load() refuses a pool of any other format,
+// including the unversioned ones from before the magic word.
+const uint32_t kArenaMagic = 0x414e5241;  // "ARNA"
+const uint32_t kArenaFormatVersion = 3;
+
 class Arena {
  public:
   Arena();
@@ -22,14 +37,68 @@ class Arena {
 
   int32_t dump();
 
+  // Keeps a redo log of the allocator metadata (pool used size, list
+  // heads, block prefixes and links, delay queue, slab pages, counters) at
+  // path.  After a crash init() replays it, so the arena comes back as of
+  // its last commit() without a full dump().  Block contents are not
+  // logged.  init() also checks the free lists whatever the log holds,
+  // since pages written after a checkpoint may have reached the disk
+  // torn.  Call before init, not available on shared pools.
+  int32_t openRedoLog(const char* path);
+
+  // Makes every allocator change so far durable through the redo log;
+  // concurrent callers share one log sync.  Same as dump() without a log.
+  // dump() and dumpDirty() checkpoint the log.
+  int32_t commit();
+
+  // Writes back only the chunks changed since the last dumpDirty, split
+  // over threads.  Needs a pool tracking dirty ranges (see
+  // MMapMempool::setDirtyTracking), falls back to dump() otherwise.  The
+  // dirty bitmap belongs to this process: on a MFILE_MODE_WRITE_SHARED
+  // pool, writes made by other processes are missed, use dump() there.
+  int32_t dumpDirty(uint32_t threads = 1);
+
+  // Tells dumpDirty and a running snapshot that the caller writes into
+  // key's block.  Call before writing through getAddress(); a block fresh
+  // from alloc is already marked.
+  void markDirty(int64_t key);
+
+  // Starts writing a consistent image of the pool to path (plus
+  // path.header) while the arena stays in use, see
+  // Mempool::beginSnapshot.  Blocks parked in thread caches show as
+  // allocated in the image.  The image opens like any pool file.
+  int32_t snapshot(const char* path);
+
+  // Waits for the snapshot started by snapshot().  Returns 0 once the
+  // image is complete and durable.
+  int32_t waitSnapshot();
+
+  // Runs dumpDirty every interval_ms from a background thread, 0 stops it.
+  int32_t set_flush_interval(uint32_t interval_ms, uint32_t threads = 1);
+
   void close();
 
   int64_t alloc(uint32_t size);
 
+  // Resizes key to hold new_size bytes.  The block stays in place when
+  // new_size fits its class, when it is the last block of the pool, or when
+  // it shrinks (the remainder is freed); otherwise the data is copied to a
+  // new block and the old one is freed.  Returns the key to use from now on.
   int64_t realloc(int64_t key, uint32_t new_size);
 
   int32_t free(int64_t key);
 
+  // Allocates n blocks, keys[i] receiving a block of at least sizes[i]
+  // bytes or -1.  Requests are grouped by size class, served from the free
+  // lists under one lock and the rest carved from a single pool reservation.
+  // Returns the number of blocks allocated.
+  int32_t allocNBatch(const uint32_t* sizes, uint32_t n, int64_t* keys);
+
+  // Frees n keys with one delay queue pass, or one splice per size class
+  // when the delay queue is off.  -1 entries are skipped.  Returns the
+  // number of keys freed.
+  int32_t freeBatch(const int64_t* keys, uint32_t n);
+
   inline uint32_t getSize(int64_t key);
 
   inline char* getAddress(int64_t key);
@@ -40,17 +109,104 @@ class Arena {
     return pool_;
   }
 
+  // Copies pSrc's data region behind this arena's, raw.  Fails when
+  // pSrc's pool has gaps in it (see Mempool::skipUnallocated) or this pool
+  // cannot take the region in one piece.  Returns the bytes appended, or
+  // -1.
   int64_t append(Arena* pSrc);
 
+  // Copies src's data region behind this arena's and takes over its free
+  // lists, delay queue, slab pages and counters, so that every block of
+  // src lives on here under its key plus *delta (see translateKeys).  Both
+  // arenas need the same size classes, and no other thread may use either
+  // of them meanwhile; src is left as it was.  The copy goes file to file
+  // where the pools allow it (Mempool::copyFrom), otherwise it is a
+  // memcpy split over threads.  Segments src's delay queue grew by become
+  // free blocks.  Fails when src's pool has gaps in its data region (see
+  // Mempool::skipUnallocated).  Returns the bytes merged, or -1.
+  int64_t merge(Arena* src, int64_t* delta, uint32_t threads = 1);
+
+  // Rewrites n keys handed out by a merged arena into keys of the arena it
+  // was merged into, -1 entries stay.
+  static void translateKeys(int64_t* keys, size_t n, int64_t delta);
+
+  // Keeps a LiveMap of the data region at path (plus path.header), or in
+  // memory when path is NULL, for scan().  Call after init.  The map is
+  // rebuilt unless the last dump() left it matching the pool.  Not
+  // available on shared pools.
+  int32_t openLiveMap(const char* path);
+
+  // Rebuilds the live map by walking the pool: every block not on a free
+  // list or in the delay queue is live.  No other thread may use the arena
+  // meanwhile.
+  int32_t rebuildLiveMap();
+
+  typedef void (*ScanFunc)(int64_t key, char* data, uint32_t size,
+                           void* arg);
+
+  // Calls func for every block and slab object handed out, i.e. not on a
+  // free list, in the delay queue or in a thread cache.  The data region is
+  // split into kLiveRegionSize regions that up to threads threads take in
+  // turn, so func must be thread safe.  No other thread may alloc or free
+  // meanwhile.  Returns the number of blocks visited, or -1 without a live
+  // map.
+  int64_t scan(ScanFunc func, void* arg, uint32_t threads = 1);
+
   int64_t getDataSize();
 
   int64_t getHeaderSize();
 
+  // Fills stats from counters maintained as blocks change hands, in
+  // O(classes).  Blocks handed out or freed through a thread cache are
+  // counted once the cache next exchanges with the shared lists.
+  int32_t getStats(ArenaStats* stats);
+
 
   void set_expand_factor(double expand_factor) {
     expand_factor_ = expand_factor;
   }
 
+  // In thread safe mode alloc/free/realloc may be called concurrently.
+  // Small blocks go through per-thread caches that exchange blocks with the
+  // shared free lists and delay queue in batches.  Must be switched while
+  // no other thread uses the arena.  An arena over a shared pool (see
+  // Mempool::isShared) is always thread safe; its lock is a robust,
+  // process-shared mutex in the arena header.  When a process dies holding
+  // it, the next one to lock repairs the free lists, delay queue and slab
+  // pages (see recoverSharedState).  A block the dead process was moving
+  // may leak; none is handed out twice.
+  int32_t set_thread_safe(bool thread_safe);
+
+  // Requests up to size bytes (at most kSlabMaxObjectSize) are served from
+  // slab pages without a length prefix, 0 turns slab allocation off.  Slab
+  // keys stay valid whatever the setting.
+  void set_slab_max_size(uint32_t size) {
+    slab_max_size_ = size < kSlabMaxObjectSize ? size : kSlabMaxObjectSize;
+  }
+
+  // Free blocks of at least size bytes give their pages back to the pool
+  // (hole punching) when they reach a free list, and a block at the pool
+  // tail is cut off instead.  0, the default, keeps every page.
+  void set_release_size(uint32_t size) {
+    release_size_ = size;
+  }
+
+  // Hands every block parked in a thread cache back to the shared free
+  // lists and delay queue, e.g. before dump().  Callers must make sure no
+  // other thread is using the arena.
+  void flushThreadCaches();
+
+  // With epoch reclamation on, freed blocks wait in the delay queue until
+  // every reader registered with getEpochManager() has announced a
+  // quiescent state after the free, instead of for delayTime seconds.
+  // Switching releases the whole queue, so no reader may hold a freed key.
+  // Epochs are per process, shared pools cannot use them.
+  int32_t set_epoch_reclaim(bool enable);
+
+  EpochManager* getEpochManager() {
+    return epochs_;
+  }
+
   // keep 64-bit for user define.
   uint64_t* GetUserDefine();
   bool SetUserDefine(const uint64_t* user_define);
@@ -61,13 +217,262 @@ class Arena {
 
   int32_t load();
 
+  // Marks metadata the arena is about to write for dumpDirty and the redo
+  // log.
+  void touch(int64_t offset, int64_t length) {
+    pool_->markDirty(offset, length);
+    if (redo_ != NULL) {
+      redo_->note(offset, length);
+    }
+  }
+
+  // Appends a redo record of every metadata change since the last one.
+  // Called with the lock held.  Returns the log position to sync to.
+  int64_t appendRedo();
+
+  // Cuts free list chains left inconsistent by a crash and recounts the
+  // free counters.
+  void repairFreeLists();
+
+  static void* flusherMain(void* arena);
+
+  void stopFlusher();
+
+  // init for a pool mapped by several processes: create or load under the
+  // pool's init lock and switch to the shared lock.
+  int32_t initShared(uint32_t minMemSize, uint32_t maxMemSize, float rate,
+    uint32_t delayTime);
+
+  // Sets the free bitmap from the free list heads.
+  void rebuildFreeBitmap();
+
   uint32_t getLevel(uint32_t &size);
 
+  // alloc without the stats bookkeeping.
+  int64_t allocKey(uint32_t size);
+
+  ArenaCounters* counters() {
+    return reinterpret_cast<ArenaCounters*>
+      (pool_->getAddress(counters_offset_));
+  }
+
+  // level_ + 1 entries, the last one for slab objects.
+  ClassCounters* classCounters() {
+    return reinterpret_cast<ClassCounters*>
+      (pool_->getAddress(counters_offset_ + sizeof(ArenaCounters)));
+  }
+
+  // Books a block of level and bytes as handed out (sign 1) or given back
+  // (sign -1).  requested is what was asked for, ignored when giving back.
+  // Goes through the thread cache in thread safe mode, so must not be
+  // called with the lock held.
+  void countLive(uint32_t level, int64_t bytes, int32_t sign,
+                 uint32_t requested);
+
+  void countLive(int64_t key, int32_t sign, uint32_t requested) {
+    uint32_t level = blockLevel(key);
+    countLive(level == kSlabLevel ? level_ : level, getSize(key), sign,
+              requested);
+  }
+
+  // Bytes asked for by a live block of level and bytes.  Blocks do not
+  // keep the size they were asked for, so it is taken at the class
+  // average, counting pending changes not folded in yet.
+  int64_t requestedShare(uint32_t level, int64_t bytes,
+                         const ClassCounters* pending = NULL);
+
+  void countFree(uint32_t level, int64_t key, int32_t sign) {
+    ClassCounters* counter = classCounters() + level;
+    counter->free_blocks += sign;
+    counter->free_bytes += sign * static_cast<int64_t>(getSize(key));
+  }
+
+  // Adds the cache's pending counts to the header.  Called with the lock
+  // held.
+  void foldCounters(ThreadCache* cache);
+
+  // Fills class_size_ from min_mem_size_/max_mem_size_/rate_, used by create.
+  void buildSizeClasses();
+
+  // Derives the per-octave search ranges from class_size_.
+  void buildLevelIndex();
+
+  // Returns the first level in [from, to] with a non-empty free list, or -1.
+  int32_t findFreeLevel(const uint64_t* bitmap, uint32_t from, uint32_t to);
+
+  void pushFreeList(int64_t key, uint32_t level);
+
+  // Releases the pages of a large free block.  Returns true when the block
+  // sat at the pool tail and was cut off, so it must not be listed.
+  bool releaseBlock(int64_t key);
+
+  int64_t allocBlock(uint32_t level, uint32_t level_end, uint32_t realSize);
+
+  // Pops a block from the first usable free list in [level, level_end].
+  int64_t popFreeBlock(uint32_t level, uint32_t level_end);
+
+  // Cuts up to count blocks off the front of level's free list with one
+  // head update, storing them in keys[slots[0]], keys[slots[1]]...
+  // Returns how many it took.
+  uint32_t popFreeRun(uint32_t level, const uint32_t* slots, uint32_t count,
+                      int64_t* keys);
+
+  // Carves a fresh block of realSize from the pool tail.
+  int64_t bumpBlock(uint32_t realSize);
+
+  // Pushes key onto the delay queue, growing it when full.  When the pool
+  // has no room for another segment the block is released at once.
+  void delayFree(int64_t key, uint32_t level, int64_t now);
+
+  ThreadCache* getThreadCache();
+
+  // Moves up to kThreadCacheBatch blocks of the first non-empty shared
+  // level in [level, level_end] into cache.  Called with the lock held.
+  bool refillThreadCache(ThreadCache* cache, uint32_t level,
+                         uint32_t level_end);
+
+  // Hands the cache's retired blocks to the delay queue and trims its bins
+  // back to the limit, or empties them when drain is set.  Called with the
+  // lock held.
+  void flushThreadCache(ThreadCache* cache, bool drain);
+
+  void clearThreadCaches(bool flush);
+
+  static void releaseThreadCache(void* cache);
+
+  void lock();
+
+  void unlock();
+
+  pthread_mutex_t* sharedLock() {
+    return reinterpret_cast<pthread_mutex_t*>
+      (pool_->getAddress(shared_lock_offset_));
+  }
+
+  void initSharedLock();
+
+  // Undo record of the delay queue update in progress on a shared pool,
+  // kept behind the shared mutex.  A process dying in the middle leaves
+  // active set, and the next one to lock rolls the queue back.
+  struct QueueUndo {
+    int64_t active;
+    char queue[sizeof(DelayQueue)];
+    int64_t links[3];
+    int64_t nexts[3];
+  };
+
+  QueueUndo* queueUndo() {
+    return reinterpret_cast<QueueUndo*>
+      (pool_->getAddress(shared_lock_offset_ + sizeof(pthread_mutex_t)));
+  }
+
+  // Bracket every delay queue push, pop and addSegment.  No-ops unless the
+  // pool is shared.
+  void beginQueueUpdate();
+  void endQueueUpdate();
+
+  // Repairs what a process that died holding the shared lock may have left
+  // behind: rolls back its delay queue update, cuts bad free list links,
+  // rebuilds the slab page lists and recounts the free and delay counters.
+  // Live counters are only touched outside the lock.  What it was moving
+  // between them may leak.
+  void recoverSharedState();
+
+  // Relinks every slab page by the objects its bitmap holds.  Walks the
+  // data region.
+  void rebuildSlabPages();
+
+  class LockGuard {
+   public:
+    explicit LockGuard(Arena* arena) : arena_(arena) {
+      arena_->lock();
+    }
+    ~LockGuard() {
+      arena_->unlock();
+    }
+   private:
+    Arena* arena_;
+  };
+
   void freeDelayQueue();
 
+  // Releases every queued block whatever its stamp.
+  void drainDelayQueue();
+
+  // Moves a block leaving the delay queue to its free list.
+  void releaseDelayed(const DelayNode& node);
+
+  // Stamp recorded for a block freed now: the current epoch or time.
+  int64_t retireStamp();
+
   void expandDelayQueue();
 
+  int64_t slabAlloc(uint32_t size);
+
+  void slabFree(int64_t key);
+
+  // Returns an empty page from the free page list, carving a new chunk of
+  // pages when it is empty.
+  int64_t slabNewPage();
+
+  inline SlabPage* slabPage(int64_t key);
+
+  // Free list level of key: the largest class its length covers, or
+  // kSlabLevel for slab objects.
+  uint32_t blockLevel(int64_t key);
+
+  // Grows or shrinks the block without moving it: within its class, by
+  // moving the pool tail when it is the last block, or by splitting off the
+  // remainder.  Returns false when the block has to move.
+  bool resizeInPlace(int64_t key, uint32_t size, uint32_t new_size);
+
+  // Cuts the block of size bytes at key down to realSize and makes the
+  // rest a block of its own, left for the caller to list.  Returns its key,
+  // or -1 when the rest is too short to hold a block.
+  int64_t splitBlock(int64_t key, uint32_t size, uint32_t realSize);
+
+  // Carves a block for the arena's own use, prefixed with
+  // kInternalBlockMark.  Returns the payload offset.
+  int64_t allocInternal(uint32_t length);
+
+  // Whether the blocks from header_size_ to the pool's end follow each
+  // other without gaps, so the data region can be copied as one range.
+  // Walks every block.
+  bool isContiguous();
+
+  // pool_->shrink, telling the live map the blocks past new_end are gone.
+  int32_t shrinkPool(int64_t end, int64_t new_end);
+
+  // Records a block starting at offset in the live map.
+  void noteBlock(int64_t offset) {
+    if (live_map_ != NULL) {
+      live_map_->noteStart(offset);
+    }
+  }
+
+  void markLive(int64_t key, bool live) {
+    if (live_map_ != NULL && !isSlabKey(key)) {
+      live_map_->setLive(key, live);
+    }
+  }
+
+  // Notes every block in [begin, end) in the live map, user blocks as
+  // live.
+  void mapBlocks(int64_t begin, int64_t end);
+
+  struct ScanTask;
+
+  static void* scanMain(void* task);
+
+  // Visits the blocks starting in region.  Returns how many were live.
+  int64_t scanRegion(int64_t region, ScanTask* task);
+
+  // Visits the taken objects of the slab pages in the chunk at offset.
+  int64_t scanSlabChunk(int64_t offset, ScanTask* task);
+
  private:
+  friend class Compactor;
+
   Mempool* pool_;
 
   uint32_t min_mem_size_;
@@ -76,8 +481,19 @@ class Arena {
   uint32_t level_;
   int64_t free_list_offset_;
 
+  // One bit per level, set while freeList[level] is non-empty.
+  int64_t free_bitmap_offset_;
+  int64_t size_class_offset_;
+  // In-memory copy of the persisted size-class table and, for every
+  // power-of-two octave (2^(b-1), 2^b], the range of levels covering it.
+  std::vector<uint32_t> class_size_;
+  uint32_t octave_begin_[33];
+  uint32_t octave_end_[33];
+
   uint32_t delay_time_;
   int64_t delay_queue_offset_;
+  // Non-NULL in epoch reclamation mode.
+  EpochManager* epochs_;
 
   int64_t header_size_;
 
@@ -85,13 +501,57 @@ class Arena {
   double expand_factor_;
 
   int64_t user_define_offset_;  // offset, keep 64-bit for user define.
+
+  int64_t slab_offset_;
+  uint32_t slab_max_size_;
+
+  uint32_t release_size_;
+
+  // Running compaction session, told about every free.
+  Compactor* compactor_;
+
+  bool thread_safe_;
+  pthread_mutex_t mutex_;
+  // Locking goes through the process-shared mutex at shared_lock_offset_.
+  bool shared_;
+  int64_t shared_lock_offset_;
+
+  int64_t counters_offset_;
+  RedoLog* redo_;
+  // load() replayed the redo log, so a live map written back before the
+  // crash no longer matches.
+  bool redo_replayed_;
+  LiveMap* live_map_;
+
+  // Background dumpDirty, see set_flush_interval.
+  bool flusher_running_;
+  bool flusher_stop_;
+  uint32_t flush_interval_ms_;
+  uint32_t flush_threads_;
+  pthread_t flusher_thread_;
+  pthread_mutex_t flusher_mutex_;
+  pthread_cond_t flusher_cond_;
+  pthread_key_t cache_key_;
+  std::vector<ThreadCache*> caches_;
 };
 
+SlabPage* Arena::slabPage(int64_t key) {
+  int64_t offset = (key & kKeyOffsetMask) + sizeof(uint32_t);
+  return reinterpret_cast<SlabPage*>(
+      pool_->getAddress(offset & ~static_cast<int64_t>(kSlabPageSize - 1)));
+}
+
 uint32_t Arena::getSize(int64_t key) {
+  if (isSlabKey(key)) {
+    return slabPage(key)->object_size;
+  }
   return *(reinterpret_cast<uint32_t*>((pool_->getAddress(key))));
 }
 
 inline char* Arena::getAddress(const int64_t key) {
+  if (isSlabKey(key)) {
+    return pool_->getAddressSafe((key & kKeyOffsetMask) + sizeof(uint32_t));
+  }
   uint32_t* pLength = reinterpret_cast<uint32_t*>
     (pool_->getAddress(key, sizeof(uint32_t)));
   if (!pLength) {
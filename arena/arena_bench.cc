@@ -0,0 +1,532 @@
+// Allocator benchmarks.  Every result is printed as one JSON object per line
+// so that runs can be collected and compared by scripts.
+//
+//   arena_bench [dir=/tmp] [ops=1000000] [live=100000] [pool_gb=1]
+//               [seed=1] [only=<bench>]
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "arena/arena.h"
+#include "arena/mmap_mempool.h"
+#include "arena/typed_arena.h"
+
+namespace base {
+extern bool use_delay_queue;
+}  // namespace base
+
+using base::Arena;
+using base::MMapMempool;
+
+typedef base::TypedArena<MMapMempool> MMapArena;
+
+namespace {
+
+struct Options {
+  std::string dir;
+  uint64_t ops;
+  uint64_t live;
+  uint64_t pool_gb;
+  uint64_t seed;
+  std::string only;
+};
+
+inline int64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Bytes of the file at path in the page cache, -1 if it cannot be told.
+int64_t residentBytes(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  int64_t resident = -1;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      const int64_t page = sysconf(_SC_PAGESIZE);
+      std::vector<unsigned char> pages((st.st_size + page - 1) / page);
+      if (mincore(map, st.st_size, &pages[0]) == 0) {
+        resident = 0;
+        for (size_t i = 0; i < pages.size(); i++) {
+          resident += (pages[i] & 1) * page;
+        }
+      }
+      munmap(map, st.st_size);
+    }
+  }
+  ::close(fd);
+  return resident;
+}
+
+// xorshift64*, cheap enough not to show up in the timings.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed ? seed : 1) {}
+
+  uint64_t next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 2685821657736338717ULL;
+  }
+
+  double uniform() {
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+ private:
+  uint64_t state_;
+};
+
+// Size generators, all precomputed so that drawing is a table lookup.
+class SizeDistribution {
+ public:
+  virtual ~SizeDistribution() {}
+  virtual const char* name() const = 0;
+  virtual uint32_t next(Random* random) = 0;
+};
+
+class UniformSizes : public SizeDistribution {
+ public:
+  UniformSizes(uint32_t min, uint32_t max) : min_(min), max_(max) {}
+
+  virtual const char* name() const {
+    return "uniform";
+  }
+
+  virtual uint32_t next(Random* random) {
+    return min_ + random->next() % (max_ - min_ + 1);
+  }
+
+ private:
+  uint32_t min_;
+  uint32_t max_;
+};
+
+// A few popular sizes take most requests: rank r of n sizes spread
+// geometrically between min and max has weight 1 / r^s.
+class ZipfSizes : public SizeDistribution {
+ public:
+  ZipfSizes(uint32_t min, uint32_t max, uint32_t n, double s) {
+    double sum = 0.0;
+    for (uint32_t r = 1; r <= n; r++) {
+      sum += 1.0 / pow(r, s);
+      cdf_.push_back(sum);
+      sizes_.push_back(static_cast<uint32_t>(
+          min * pow(static_cast<double>(max) / min, (r - 1.0) / (n - 1.0))));
+    }
+    for (size_t i = 0; i < cdf_.size(); i++) {
+      cdf_[i] /= sum;
+    }
+    // Popular sizes should not all be the small ones.
+    Random shuffle(n);
+    for (size_t i = sizes_.size() - 1; i > 0; i--) {
+      std::swap(sizes_[i], sizes_[shuffle.next() % (i + 1)]);
+    }
+  }
+
+  virtual const char* name() const {
+    return "zipf";
+  }
+
+  virtual uint32_t next(Random* random) {
+    size_t i = std::lower_bound(cdf_.begin(), cdf_.end(), random->uniform())
+        - cdf_.begin();
+    return sizes_[std::min(i, sizes_.size() - 1)];
+  }
+
+ private:
+  std::vector<double> cdf_;
+  std::vector<uint32_t> sizes_;
+};
+
+// Shaped after the value sizes of our key-value services: mostly small
+// records, a tail of large ones.
+class ProductionSizes : public SizeDistribution {
+ public:
+  virtual const char* name() const {
+    return "production";
+  }
+
+  virtual uint32_t next(Random* random) {
+    static const struct {
+      double share;
+      uint32_t min;
+      uint32_t max;
+    } kBuckets[] = {
+      {0.40, 16, 64},
+      {0.30, 65, 256},
+      {0.20, 257, 4096},
+      {0.09, 4097, 65536},
+      {0.01, 65537, 1 << 20},
+    };
+    double u = random->uniform();
+    size_t i = 0;
+    while (i + 1 < sizeof(kBuckets) / sizeof(kBuckets[0])
+           && u >= kBuckets[i].share) {
+      u -= kBuckets[i].share;
+      i++;
+    }
+    return kBuckets[i].min
+        + random->next() % (kBuckets[i].max - kBuckets[i].min + 1);
+  }
+};
+
+// Collects per-operation latencies of one benchmark.
+class Recorder {
+ public:
+  explicit Recorder(uint64_t ops) : begin_(nowNs()) {
+    samples_.reserve(ops);
+  }
+
+  void add(int64_t ns) {
+    samples_.push_back(static_cast<uint32_t>(std::min<int64_t>(ns,
+        0xFFFFFFFFLL)));
+  }
+
+  // Prints the JSON line, extra holds further "key":value pairs.
+  void print(const char* bench, const char* dist, bool delay_queue,
+             const std::string& extra) {
+    int64_t elapsed = nowNs() - begin_;
+    std::sort(samples_.begin(), samples_.end());
+    printf("{\"bench\":\"%s\",\"dist\":\"%s\",\"delay_queue\":%s,"
+           "\"ops\":%zu,\"ops_per_sec\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,"
+           "\"p999_ns\":%u,\"max_ns\":%u%s}\n",
+           bench, dist, delay_queue ? "true" : "false", samples_.size(),
+           samples_.size() * 1e9 / std::max<int64_t>(elapsed, 1),
+           percentile(0.5), percentile(0.99), percentile(0.999),
+           samples_.empty() ? 0 : samples_.back(), extra.c_str());
+    fflush(stdout);
+  }
+
+ private:
+  uint32_t percentile(double p) {
+    if (samples_.empty()) {
+      return 0;
+    }
+    return samples_[std::min(samples_.size() - 1,
+        static_cast<size_t>(p * samples_.size()))];
+  }
+
+  int64_t begin_;
+  std::vector<uint32_t> samples_;
+};
+
+std::string field(const char* key, int64_t value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), ",\"%s\":%lld", key,
+           static_cast<long long>(value));
+  return buf;
+}
+
+class Pool {
+ public:
+  Pool(const Options& options, const char* name)
+      : path_(options.dir + "/" + name) {
+    remove();
+  }
+
+  ~Pool() {
+    delete arena_;
+    delete pool_;
+    remove();
+  }
+
+  int32_t open() {
+    pool_ = new MMapMempool;
+    arena_ = new MMapArena;
+    if (pool_->init(path_.c_str(), base::MFILE_MODE_WRITE) != 0
+        || arena_->init(pool_) != 0) {
+      fprintf(stderr, "cannot open pool %s\n", path_.c_str());
+      return -1;
+    }
+    return 0;
+  }
+
+  void close() {
+    delete arena_;
+    delete pool_;
+    arena_ = NULL;
+    pool_ = NULL;
+  }
+
+  void remove() {
+    unlink(path_.c_str());
+    unlink((path_ + ".header").c_str());
+  }
+
+  const std::string& path() const {
+    return path_;
+  }
+
+  MMapArena* arena() {
+    return arena_;
+  }
+
+ private:
+  std::string path_;
+  MMapMempool* pool_ = NULL;
+  MMapArena* arena_ = NULL;
+};
+
+// alloc, getAddress, realloc and free of ops blocks, in that order.
+void benchOperations(const Options& options, SizeDistribution* sizes) {
+  Pool pool(options, "arena_bench_ops.mmap");
+  if (pool.open() != 0) {
+    return;
+  }
+  MMapArena* arena = pool.arena();
+  Random random(options.seed);
+  std::vector<int64_t> keys(options.ops);
+
+  Recorder alloc(options.ops);
+  for (uint64_t i = 0; i < options.ops; i++) {
+    uint32_t size = sizes->next(&random);
+    int64_t begin = nowNs();
+    keys[i] = arena->alloc(size);
+    alloc.add(nowNs() - begin);
+  }
+  alloc.print("alloc", sizes->name(), base::use_delay_queue,
+              field("used_bytes", arena->getDataSize()));
+
+  Recorder address(options.ops);
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < options.ops; i++) {
+    int64_t key = keys[random.next() % options.ops];
+    int64_t begin = nowNs();
+    char* data = arena->Arena::getAddress(key);
+    address.add(nowNs() - begin);
+    sum += data != NULL ? static_cast<uint8_t>(data[0]) : 0;
+  }
+  address.print("getAddress", sizes->name(), base::use_delay_queue,
+                field("checksum", sum & 1));
+
+  Recorder typed(options.ops);
+  for (uint64_t i = 0; i < options.ops; i++) {
+    int64_t key = keys[random.next() % options.ops];
+    int64_t begin = nowNs();
+    char* data = arena->getAddress(key);
+    typed.add(nowNs() - begin);
+    sum += data != NULL ? static_cast<uint8_t>(data[0]) : 0;
+  }
+  typed.print("typed_getAddress", sizes->name(), base::use_delay_queue,
+              field("checksum", sum & 1));
+
+  Recorder unchecked(options.ops);
+  for (uint64_t i = 0; i < options.ops; i++) {
+    int64_t key = keys[random.next() % options.ops];
+    if (key == -1) {
+      continue;
+    }
+    int64_t begin = nowNs();
+    char* data = arena->getAddressUnchecked(key);
+    unchecked.add(nowNs() - begin);
+    sum += static_cast<uint8_t>(data[0]);
+  }
+  unchecked.print("getAddressUnchecked", sizes->name(),
+                  base::use_delay_queue, field("checksum", sum & 1));
+
+  Recorder realloc(options.ops);
+  for (uint64_t i = 0; i < options.ops; i++) {
+    uint32_t size = sizes->next(&random);
+    int64_t begin = nowNs();
+    int64_t key = arena->realloc(keys[i], size);
+    realloc.add(nowNs() - begin);
+    if (key != -1) {
+      keys[i] = key;
+    }
+  }
+  realloc.print("realloc", sizes->name(), base::use_delay_queue,
+                field("used_bytes", arena->getDataSize()));
+
+  Recorder release(options.ops);
+  for (uint64_t i = 0; i < options.ops; i++) {
+    int64_t begin = nowNs();
+    arena->free(keys[i]);
+    release.add(nowNs() - begin);
+  }
+  release.print("free", sizes->name(), base::use_delay_queue, "");
+}
+
+// Steady state: a live set of options.live blocks in which every operation
+// frees a random block and allocates a replacement.
+void benchChurn(const Options& options, SizeDistribution* sizes) {
+  Pool pool(options, "arena_bench_churn.mmap");
+  if (pool.open() != 0) {
+    return;
+  }
+  Arena* arena = pool.arena();
+  Random random(options.seed);
+  std::vector<int64_t> keys(options.live);
+  for (uint64_t i = 0; i < options.live; i++) {
+    keys[i] = arena->alloc(sizes->next(&random));
+  }
+  int64_t warm = arena->getDataSize();
+
+  Recorder churn(options.ops);
+  for (uint64_t i = 0; i < options.ops; i++) {
+    uint64_t slot = random.next() % options.live;
+    uint32_t size = sizes->next(&random);
+    int64_t begin = nowNs();
+    arena->free(keys[slot]);
+    keys[slot] = arena->alloc(size);
+    churn.add(nowNs() - begin);
+  }
+  churn.print("churn", sizes->name(), base::use_delay_queue,
+              field("live_blocks", options.live)
+              + field("warm_bytes", warm)
+              + field("used_bytes", arena->getDataSize()));
+}
+
+// Builds a pool of options.pool_gb GB, then times dump() after dirtying a
+// tenth of it and a cold restart with the page cache dropped for the file.
+void benchRestart(const Options& options) {
+  Pool pool(options, "arena_bench_restart.mmap");
+  if (pool.open() != 0) {
+    return;
+  }
+  Arena* arena = pool.arena();
+  const uint32_t kBlockSize = 64 * 1024;
+  int64_t blocks = (options.pool_gb << 30) / kBlockSize;
+  std::vector<int64_t> keys;
+  keys.reserve(blocks);
+  for (int64_t i = 0; i < blocks; i++) {
+    int64_t key = arena->alloc(kBlockSize);
+    if (key == -1) {
+      break;
+    }
+    memset(arena->getAddress(key), static_cast<int>(i), kBlockSize);
+    keys.push_back(key);
+  }
+  int64_t begin = nowNs();
+  arena->dump();
+  int64_t fullDump = nowNs() - begin;
+
+  for (size_t i = 0; i < keys.size(); i += 10) {
+    arena->getAddress(keys[i])[0]++;
+  }
+  begin = nowNs();
+  arena->dump();
+  int64_t partialDump = nowNs() - begin;
+  pool.close();
+
+  // DONTNEED skips dirty pages, write them back first.
+  int fd = ::open(pool.path().c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+  }
+  // Whatever stayed cached makes the cold figures look warmer.
+  int64_t resident = residentBytes(pool.path());
+  begin = nowNs();
+  if (pool.open() != 0) {
+    return;
+  }
+  int64_t load = nowNs() - begin;
+  // Fault every page back in.
+  uint64_t sum = 0;
+  arena = pool.arena();
+  begin = nowNs();
+  for (size_t i = 0; i < keys.size(); i++) {
+    const char* data = arena->getAddress(keys[i]);
+    for (uint32_t off = 0; off < kBlockSize; off += 4096) {
+      sum += static_cast<uint8_t>(data[off]);
+    }
+  }
+  int64_t touch = nowNs() - begin;
+
+  printf("{\"bench\":\"restart\",\"pool_bytes\":%lld,\"dump_ns\":%lld,"
+         "\"dump_dirty_tenth_ns\":%lld,\"cold_load_ns\":%lld,"
+         "\"cold_touch_ns\":%lld,\"cold_resident_bytes\":%lld,"
+         "\"checksum\":%llu}\n",
+         static_cast<long long>(arena->getDataSize()),
+         static_cast<long long>(fullDump),
+         static_cast<long long>(partialDump),
+         static_cast<long long>(load), static_cast<long long>(touch),
+         static_cast<long long>(resident),
+         static_cast<unsigned long long>(sum & 1));
+  fflush(stdout);
+}
+
+bool parseOption(const char* arg, const char* key, std::string* value) {
+  size_t length = strlen(key);
+  if (strncmp(arg, key, length) != 0 || arg[length] != '=') {
+    return false;
+  }
+  *value = arg + length + 1;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.dir = "/tmp";
+  options.ops = 1000000;
+  options.live = 100000;
+  options.pool_gb = 1;
+  options.seed = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string value;
+    if (parseOption(argv[i], "dir", &value)) {
+      options.dir = value;
+    } else if (parseOption(argv[i], "ops", &value)) {
+      options.ops = strtoull(value.c_str(), NULL, 10);
+    } else if (parseOption(argv[i], "live", &value)) {
+      options.live = strtoull(value.c_str(), NULL, 10);
+    } else if (parseOption(argv[i], "pool_gb", &value)) {
+      options.pool_gb = strtoull(value.c_str(), NULL, 10);
+    } else if (parseOption(argv[i], "seed", &value)) {
+      options.seed = strtoull(value.c_str(), NULL, 10);
+    } else if (parseOption(argv[i], "only", &value)) {
+      options.only = value;
+    } else {
+      fprintf(stderr, "usage: %s [dir=] [ops=] [live=] [pool_gb=] [seed=] "
+              "[only=ops|churn|restart]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (options.ops == 0 || options.live == 0) {
+    return 1;
+  }
+
+  UniformSizes uniform(16, 4096);
+  ZipfSizes zipf(16, 64 * 1024, 64, 1.1);
+  ProductionSizes production;
+  SizeDistribution* distributions[] = {&uniform, &zipf, &production};
+
+  for (size_t d = 0; d < 3; d++) {
+    if (options.only.empty() || options.only == "ops") {
+      base::use_delay_queue = false;
+      benchOperations(options, distributions[d]);
+    }
+    if (options.only.empty() || options.only == "churn") {
+      for (int delay = 1; delay >= 0; delay--) {
+        base::use_delay_queue = delay == 1;
+        benchChurn(options, distributions[d]);
+      }
+    }
+  }
+  base::use_delay_queue = true;
+  if (options.only.empty() || options.only == "restart") {
+    benchRestart(options);
+  }
+  return 0;
+}
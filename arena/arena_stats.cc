@@ -0,0 +1,58 @@
+#include <stdio.h>
+
+#include "arena/arena_stats.h"
+
+namespace base {
+
+namespace {
+
+void appendSample(std::string* out, const char* prefix, const char* name,
+                  const char* labels, double value) {
+  char line[256];
+  snprintf(line, sizeof(line), "%s_%s%s %.17g\n", prefix, name, labels,
+           value);
+  out->append(line);
+}
+
+}  // namespace
+
+ArenaStats::ArenaStats()
+    : slab_objects(0),
+      slab_bytes(0),
+      delay_blocks(0),
+      delay_bytes(0),
+      delay_age(0),
+      header_size(0),
+      data_size(0),
+      headroom(0),
+      expand_count(0),
+      internal_fragmentation(0.0),
+      external_fragmentation(0.0) {
+}
+
+void ArenaStats::toText(std::string* out, const char* prefix) const {
+  char labels[32];
+  for (size_t i = 0; i < classes.size(); i++) {
+    const ClassStats& c = classes[i];
+    snprintf(labels, sizeof(labels), "{class=\"%u\"}", c.size);
+    appendSample(out, prefix, "live_blocks", labels, c.live_blocks);
+    appendSample(out, prefix, "live_bytes", labels, c.live_bytes);
+    appendSample(out, prefix, "free_blocks", labels, c.free_blocks);
+    appendSample(out, prefix, "free_bytes", labels, c.free_bytes);
+  }
+  appendSample(out, prefix, "slab_objects", "", slab_objects);
+  appendSample(out, prefix, "slab_bytes", "", slab_bytes);
+  appendSample(out, prefix, "delay_blocks", "", delay_blocks);
+  appendSample(out, prefix, "delay_bytes", "", delay_bytes);
+  appendSample(out, prefix, "delay_age", "", delay_age);
+  appendSample(out, prefix, "header_bytes", "", header_size);
+  appendSample(out, prefix, "data_bytes", "", data_size);
+  appendSample(out, prefix, "headroom_bytes", "", headroom);
+  appendSample(out, prefix, "expand_count", "", expand_count);
+  appendSample(out, prefix, "internal_fragmentation", "",
+               internal_fragmentation);
+  appendSample(out, prefix, "external_fragmentation", "",
+               external_fragmentation);
+}
+
+}  // namespace base
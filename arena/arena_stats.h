@@ -0,0 +1,68 @@
+#ifndef BASE_ARENA_STATS_H_
+#define BASE_ARENA_STATS_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace base {
+
+// Running totals of one size class, kept in the arena header.
+struct ClassCounters {
+  int64_t live_blocks;
+  int64_t live_bytes;
+  // Estimate of the bytes asked for by the live blocks.  Blocks do not keep
+  // the size they were asked for, so a freed block takes the class average
+  // with it: the figure drifts when sizes within a class vary, and is
+  // exact again once the class empties.
+  int64_t requested_estimate;
+  int64_t free_blocks;  // on the free list
+  int64_t free_bytes;
+};
+
+// Arena-wide running totals, kept in the arena header and followed there by
+// one ClassCounters per level plus one for slab objects.
+struct ArenaCounters {
+  int64_t delay_blocks;
+  int64_t delay_bytes;
+};
+
+struct ClassStats {
+  uint32_t size;
+  int64_t live_blocks;
+  int64_t live_bytes;
+  int64_t free_blocks;
+  int64_t free_bytes;
+};
+
+// Snapshot returned by Arena::getStats.
+struct ArenaStats {
+  ArenaStats();
+
+  std::vector<ClassStats> classes;
+  int64_t slab_objects;
+  int64_t slab_bytes;
+  int64_t delay_blocks;
+  int64_t delay_bytes;
+  // How long the oldest queued block has waited: seconds, or epochs in
+  // epoch reclamation mode.
+  int64_t delay_age;
+  int64_t header_size;
+  int64_t data_size;
+  // Bytes the pool can still hand out before it has to grow.
+  int64_t headroom;
+  int64_t expand_count;
+  // Share of the live blocks' bytes lost to size-class rounding, taken
+  // from ClassCounters::requested_estimate.
+  double internal_fragmentation;
+  // Share of the data region sitting on free lists or in the delay queue.
+  double external_fragmentation;
+
+  // Appends the snapshot in the Prometheus text format, metric names
+  // starting with prefix.
+  void toText(std::string* out, const char* prefix = "arena") const;
+};
+
+}  // namespace base
+
+#endif  // BASE_ARENA_STATS_H_
@@ -1,33 +1,60 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <gtest/gtest.h>
 
+// Opens up the arena's internals to the tests.  Every system header the
+// arena headers use is included above, so the switch only reaches ours.
 #define private public
 #define protected public
 
-#include <time.h>
-#include <gtest/gtest.h>
-
+#include "arena/anon_mempool.h"
+#include "arena/memfd_mempool.h"
 #include "arena/mmap_mempool.h"
 #include "arena/mempool.h"
 #include "arena/arena.h"
+#include "arena/compactor.h"
+#include "arena/numa_arena.h"
+#include "arena/segmented_mempool.h"
+#include "arena/typed_arena.h"
 
 using namespace base;
 
-const uint32_t kDefaultDelayQueueSize = 100000;
 
 class ArenaTest : public testing::Test {
  public:
   Arena* pool_;
 
   virtual void SetUp() {
+    unlink("testArena.mmap");
+    unlink("testArena.mmap.header");
     pool_ = new Arena();
-    char name[128] = "testArena.mmap";
     MMapMempool* pool64 = new MMapMempool;
-    pool64->init(name, MFILE_MODE_READ);
-    pool64->reset();
-    pool_->init((MempoolInterface*)pool64);
+    ASSERT_EQ(0, pool64->init("testArena.mmap", MFILE_MODE_WRITE));
+    ASSERT_EQ(0, pool_->init(pool64));
   }
   virtual void TearDown() {
-    delete pool_->pool_;
+    Mempool* pool64 = pool_->pool_;
     delete pool_;
+    delete pool64;
     pool_ = NULL;
   }
 };
@@ -37,41 +64,56 @@ public:
   Arena *poolSrc_, *poolDst_;
 
   virtual void SetUp() {
+    unlink("testArenaSrc.mmap");
+    unlink("testArenaSrc.mmap.header");
+    unlink("testArenaDst.mmap");
+    unlink("testArenaDst.mmap.header");
     poolSrc_ = new Arena();
     poolDst_ = new Arena();
-    char name[128] = "testArena.mmap";
-    if (g_use_mmap) {
-      MMapMempool *pool64 = new MMapMempool;
-      pool64->init(name, MFILE_MODE_READ);
-      pool64->reset();
-      poolSrc_->init((MempoolInterface*)pool64);
-
-      MMapMempool *pool64Dst = new MMapMempool;
-      pool64Dst->init(name, MFILE_MODE_READ);
-      pool64Dst->reset();
-      poolDst_->init((MempoolInterface*)pool64Dst);
-    }
-    else {
-      FixFileMempool *pool64 = new FixFileMempool();
-      pool64->init(name, MFILE_MODE_WRITE);
-      pool64->reset();
-      poolSrc_->init((MempoolInterface*)pool64);
-      FixFileMempool *pool64Dst = new FixFileMempool();
-      pool64Dst->init(name, MFILE_MODE_WRITE);
-      pool64Dst->reset();
-      poolDst_->init((MempoolInterface*)pool64Dst);
-    }
+    MMapMempool *pool64 = new MMapMempool;
+    ASSERT_EQ(0, pool64->init("testArenaSrc.mmap", MFILE_MODE_WRITE));
+    ASSERT_EQ(0, poolSrc_->init(pool64));
+
+    MMapMempool *pool64Dst = new MMapMempool;
+    ASSERT_EQ(0, pool64Dst->init("testArenaDst.mmap", MFILE_MODE_WRITE));
+    ASSERT_EQ(0, poolDst_->init(pool64Dst));
   }
   virtual void TearDown() {
-    delete poolSrc_->pool_;
+    Mempool* pool64 = poolSrc_->pool_;
     delete poolSrc_;
+    delete pool64;
     poolSrc_ = NULL;
-    delete poolDst_->pool_;
+    pool64 = poolDst_->pool_;
     delete poolDst_;
+    delete pool64;
     poolDst_ = NULL;
   }
 };
 
+namespace base {
+extern bool use_delay_queue;
+}
+
+class ArenaWriteTest : public testing::Test {
+ public:
+  Arena* arena_;
+  MMapMempool* pool_;
+
+  virtual void SetUp() {
+    unlink("testArenaWrite.mmap");
+    unlink("testArenaWrite.mmap.header");
+    pool_ = new MMapMempool;
+    ASSERT_EQ(0, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE));
+    arena_ = new Arena();
+    ASSERT_EQ(0, arena_->init(pool_));
+  }
+  virtual void TearDown() {
+    use_delay_queue = true;
+    delete arena_;
+    delete pool_;
+  }
+};
+
 TEST_F(ArenaTest, init) {
   Arena* pool = NULL;
   pool = new Arena();
@@ -79,7 +121,7 @@ TEST_F(ArenaTest, init) {
   MMapMempool *pool64 = new MMapMempool;
   pool64->init(name, MFILE_MODE_WRITE);
   pool64->reset();
-  int ret = pool->init((MempoolInterface*)pool64);
+  int ret = pool->init(pool64);
   EXPECT_EQ(ret, 0);
   pool->pool_->alloc(1);
   MMapMempool *pool64_1 = new MMapMempool;
@@ -97,7 +139,8 @@ TEST_F(ArenaTest, create) {
   int ret = pool_->create(10, 20, 2.0, 10);
   EXPECT_EQ(ret, 0);
   EXPECT_EQ(pool_->min_mem_size_, static_cast<uint32_t>(10));
-  char *base = pool_->pool_->getBase();
+  // Past the magic and format version.
+  char *base = pool_->pool_->getBase() + 2 * sizeof(uint32_t);
   uint32_t min = *(uint32_t*)base;
   EXPECT_EQ(min, static_cast<uint32_t>(10));
   EXPECT_EQ(pool_->max_mem_size_, static_cast<uint32_t>(20));
@@ -129,8 +172,7 @@ TEST_F(ArenaTest, load) {
 }
 
 TEST_F(ArenaTest, getLevel) {
-  pool_->rate_ = 2.0;
-  pool_->min_mem_size_ = 10;
+  ASSERT_EQ(0, pool_->create(10, 1000, 2.0, 10));
   uint32_t size = 1;
   uint32_t l = pool_->getLevel(size);
   EXPECT_EQ(l, 0u);
@@ -144,9 +186,14 @@ TEST_F(ArenaTest, getLevel) {
 }
 
 TEST_F(ArenaTest, freeDelayQueue) {
+  // Released nodes go back to the free lists, so they must be real blocks.
+  int64_t first = pool_->alloc(100);
+  int64_t second = pool_->alloc(200);
+  ASSERT_NE(-1, first);
+  ASSERT_NE(-1, second);
   DelayNode node;
-  node.key = 1;
-  node.level = 0;
+  node.key = first;
+  node.level = pool_->blockLevel(first);
   uint32_t nowTime = time(NULL);
   node.time = nowTime + 100;
   DelayQueue *delayQueue = NULL;
@@ -158,11 +205,12 @@ TEST_F(ArenaTest, freeDelayQueue) {
   EXPECT_EQ(node1->key, node.key);
   EXPECT_EQ(node1->time, node.time);
   delayQueue = (DelayQueue*)pool_->pool_->getAddress(pool_->delay_queue_offset_);
-  delayQueue->pop();
+  delayQueue->pop(pool_->pool_);
   node.time = nowTime - 100;
   delayQueue = (DelayQueue*)pool_->pool_->getAddress(pool_->delay_queue_offset_);
   delayQueue->push(node, pool_->pool_);
-  node.key = 2;
+  node.key = second;
+  node.level = pool_->blockLevel(second);
   node.time = nowTime + 100;
   delayQueue = (DelayQueue*)pool_->pool_->getAddress(pool_->delay_queue_offset_);
   delayQueue->push(node, pool_->pool_);
@@ -187,7 +235,7 @@ TEST_F(ArenaTest, expandDelayQueue) {
   pool_->expandDelayQueue();
   delayQueue = (DelayQueue*)pool_->pool_->getAddress(pool_->delay_queue_offset_);
   uint32_t newSize = delayQueue->size();
-  EXPECT_EQ(newSize, oldSize+kDefaultDelayQueueSize);
+  EXPECT_EQ(newSize, oldSize + kDelayQueueSegmentSize);
   delayQueue = (DelayQueue*)pool_->pool_->getAddress(pool_->delay_queue_offset_);
   DelayNode node1 = *(delayQueue->front(pool_->pool_));
   EXPECT_EQ(node1.key, node.key);
@@ -260,9 +308,10 @@ TEST_F(ArenaTest, getDataSize) {
 }
 
 TEST_F(ArenaTest, getHeaderSize) {
-  EXPECT_EQ(1603092, pool_->getHeaderSize());
+  int64_t headerSize = pool_->pool_->getUsedSize();
+  EXPECT_EQ(headerSize, pool_->getHeaderSize());
   pool_->alloc(100);
-  EXPECT_EQ(1603092, pool_->getHeaderSize());
+  EXPECT_EQ(headerSize, pool_->getHeaderSize());
 }
 
 TEST_F(ArenaTest2, append) {
@@ -305,3 +354,1589 @@ TEST_F(ArenaTest2, append) {
   pDstBuf = poolDst_->getAddress(dstKey);
   EXPECT_EQ(0, strcmp(pDstBuf, dstString));
 }
+
+TEST_F(ArenaWriteTest, getLevelMatchesGeometricClasses) {
+  uint32_t level = 0;
+  uint32_t classSize = arena_->min_mem_size_;
+  for (uint32_t size = 1; size < (1U << 20); size += 1 + size / 64) {
+    while (size > classSize) {
+      uint32_t t = static_cast<uint32_t>(classSize * arena_->rate_);
+      classSize = t <= classSize ? classSize + 1 : t;
+      level++;
+    }
+    uint32_t realSize = size;
+    EXPECT_EQ(level, arena_->getLevel(realSize));
+    EXPECT_EQ(classSize, realSize);
+  }
+  uint32_t maxSize = arena_->max_mem_size_;
+  EXPECT_EQ(arena_->level_ - 1, arena_->getLevel(maxSize));
+  EXPECT_EQ(arena_->max_mem_size_, maxSize);
+}
+
+TEST_F(ArenaWriteTest, freeBitmapTracksFreeLists) {
+  use_delay_queue = false;
+  uint64_t* bitmap = reinterpret_cast<uint64_t*>(
+      pool_->getAddress(arena_->free_bitmap_offset_));
+  int64_t key = arena_->alloc(100);
+  uint32_t size = 100;
+  uint32_t level = arena_->getLevel(size);
+  EXPECT_EQ(0u, bitmap[level >> 6] & (1ULL << (level & 63)));
+  EXPECT_EQ(0, arena_->free(key));
+  EXPECT_NE(0u, bitmap[level >> 6] & (1ULL << (level & 63)));
+  EXPECT_EQ(key, arena_->alloc(90));
+  EXPECT_EQ(0u, bitmap[level >> 6] & (1ULL << (level & 63)));
+
+  arena_->free(arena_->alloc(100));
+  ASSERT_EQ(0, arena_->load());
+  EXPECT_NE(0u, bitmap[level >> 6] & (1ULL << (level & 63)));
+}
+
+TEST_F(ArenaWriteTest, threadSafeAllocFree) {
+  use_delay_queue = false;
+  ASSERT_EQ(0, arena_->set_thread_safe(true));
+  const int kThreads = 4;
+  const int kRounds = 20000;
+  std::vector<std::thread> threads;
+  std::vector<int> errors(kThreads, 0);
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([this, t, &errors]() {
+      std::vector<int64_t> keys;
+      for (int i = 0; i < kRounds; i++) {
+        int64_t key = arena_->alloc(16 + (i % 200));
+        ASSERT_NE(-1, key);
+        memset(arena_->getAddress(key), t, 16);
+        keys.push_back(key);
+        if (keys.size() > 100) {
+          for (size_t j = 0; j < keys.size(); j++) {
+            char* data = arena_->getAddress(keys[j]);
+            if (data[8] != t || data[15] != t) {
+              errors[t]++;
+            }
+            arena_->free(keys[j]);
+          }
+          keys.clear();
+        }
+      }
+    }));
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  for (int t = 0; t < kThreads; t++) {
+    EXPECT_EQ(0, errors[t]);
+  }
+  EXPECT_TRUE(arena_->caches_.empty());
+  ASSERT_EQ(0, arena_->set_thread_safe(false));
+}
+
+TEST_F(ArenaWriteTest, concurrentPoolAlloc) {
+  pool_->setExpandSize(1 << 20);
+  pool_->setConcurrentAlloc(true);
+  const int kThreads = 4;
+  const int kRounds = 50000;
+  int64_t start = pool_->getUsedSize();
+  std::vector<std::thread> threads;
+  std::vector<std::vector<int64_t> > offsets(kThreads);
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([this, t, &offsets]() {
+      for (int i = 0; i < kRounds; i++) {
+        int64_t offset = pool_->alloc(64);
+        ASSERT_NE(-1, offset);
+        memset(pool_->getAddress(offset), t, 64);
+        offsets[t].push_back(offset);
+      }
+    }));
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  EXPECT_EQ(start + 64L * kThreads * kRounds, pool_->getUsedSize());
+  EXPECT_GE(pool_->header_file_->max_size, pool_->getUsedSize());
+  for (int t = 0; t < kThreads; t++) {
+    for (size_t i = 0; i < offsets[t].size(); i++) {
+      ASSERT_EQ(t, pool_->getAddress(offsets[t][i])[63]);
+    }
+  }
+
+  // A reservation the file cannot grow to is given back.
+  int64_t used = pool_->getUsedSize();
+  EXPECT_EQ(-1, pool_->alloc(1LL << 61));
+  EXPECT_EQ(used, pool_->getUsedSize());
+  EXPECT_EQ(used, pool_->alloc(64));
+}
+
+TEST_F(ArenaWriteTest, deadSpanKeepsBlocksReachable) {
+  use_delay_queue = false;
+  ASSERT_NE(-1, arena_->alloc(100));
+  // A reservation given up after another one was made behind it.
+  int64_t span = pool_->alloc(4096);
+  int64_t behind = arena_->alloc(100);
+  ASSERT_NE(-1, behind);
+  EXPECT_FALSE(arena_->isContiguous());
+  pool_->markDeadSpan(span, 4096);
+  EXPECT_EQ(kDeadSpanMark,
+            *reinterpret_cast<uint32_t*>(pool_->getAddress(span)));
+  EXPECT_TRUE(arena_->isContiguous());
+  Compactor compactor(arena_);
+  ASSERT_EQ(0, compactor.begin());
+  EXPECT_NE(-1, compactor.find(behind));
+  compactor.finish();
+}
+
+TEST_F(ArenaWriteTest, allocNBatchAndFreeBatch) {
+  use_delay_queue = false;
+  const uint32_t kCount = 1000;
+  std::vector<uint32_t> sizes(kCount);
+  std::vector<int64_t> keys(kCount);
+  for (uint32_t i = 0; i < kCount; i++) {
+    sizes[i] = 16 + (i * 7) % 300;
+  }
+  sizes[3] = 0;
+  int64_t used = pool_->getUsedSize();
+  EXPECT_EQ(static_cast<int32_t>(kCount - 1),
+            arena_->allocNBatch(&sizes[0], kCount, &keys[0]));
+  EXPECT_EQ(-1, keys[3]);
+  int64_t expected = 0;
+  for (uint32_t i = 0; i < kCount; i++) {
+    if (i == 3) {
+      continue;
+    }
+    uint32_t realSize = sizes[i];
+    arena_->getLevel(realSize);
+    expected += realSize + sizeof(uint32_t);
+    ASSERT_EQ(realSize, arena_->getSize(keys[i]));
+    memset(arena_->getAddress(keys[i]), i & 0xff, sizes[i]);
+  }
+  EXPECT_EQ(used + expected, pool_->getUsedSize());
+  for (uint32_t i = 0; i < kCount; i++) {
+    if (i != 3) {
+      ASSERT_EQ(static_cast<char>(i & 0xff),
+                arena_->getAddress(keys[i])[sizes[i] - 1]);
+    }
+  }
+
+  EXPECT_EQ(static_cast<int32_t>(kCount - 1),
+            arena_->freeBatch(&keys[0], kCount));
+  std::vector<int64_t> again(kCount);
+  EXPECT_EQ(static_cast<int32_t>(kCount - 1),
+            arena_->allocNBatch(&sizes[0], kCount, &again[0]));
+  EXPECT_EQ(used + expected, pool_->getUsedSize());
+  std::sort(keys.begin(), keys.end());
+  std::sort(again.begin(), again.end());
+  EXPECT_EQ(keys, again);
+
+  // Runs longer than their free lists take the whole list and bump the
+  // rest.
+  EXPECT_EQ(static_cast<int32_t>(kCount - 1),
+            arena_->freeBatch(&again[0], kCount));
+  std::vector<uint32_t> twice(sizes);
+  twice.insert(twice.end(), sizes.begin(), sizes.end());
+  std::vector<int64_t> more(twice.size());
+  EXPECT_EQ(static_cast<int32_t>(2 * (kCount - 1)),
+            arena_->allocNBatch(&twice[0], twice.size(), &more[0]));
+  int64_t* freeList = reinterpret_cast<int64_t*>(
+      pool_->getAddress(arena_->free_list_offset_));
+  uint64_t* bitmap = reinterpret_cast<uint64_t*>(
+      pool_->getAddress(arena_->free_bitmap_offset_));
+  for (uint32_t level = 0; level < arena_->level_; level++) {
+    EXPECT_EQ(freeList[level] != -1,
+              (bitmap[level >> 6] >> (level & 63)) & 1);
+  }
+  std::sort(more.begin(), more.end());
+  EXPECT_TRUE(std::adjacent_find(more.begin() + 2, more.end()) == more.end());
+
+  EXPECT_EQ(0, arena_->allocNBatch(NULL, 0, NULL));
+  EXPECT_EQ(0, arena_->freeBatch(NULL, 0));
+}
+
+TEST_F(ArenaWriteTest, slabAllocFree) {
+  use_delay_queue = false;
+  arena_->set_slab_max_size(64);
+  const int kCount = 100000;
+  std::vector<int64_t> keys;
+  int64_t used = pool_->getUsedSize();
+  int64_t blockBytes = 0;
+  for (int i = 0; i < kCount; i++) {
+    uint32_t size = 16 + i % 7 * 8;
+    uint32_t realSize = size;
+    arena_->getLevel(realSize);
+    blockBytes += realSize + sizeof(uint32_t);
+    int64_t key = arena_->alloc(size);
+    ASSERT_TRUE(isSlabKey(key));
+    EXPECT_EQ(size, arena_->getSize(key));
+    memset(arena_->getAddress(key), i & 0xff, size);
+    keys.push_back(key);
+  }
+  // No prefix and no geometric rounding.
+  EXPECT_LT(pool_->getUsedSize() - used, blockBytes);
+  for (int i = 0; i < kCount; i++) {
+    ASSERT_EQ(static_cast<char>(i & 0xff),
+              arena_->getAddress(keys[i])[15]);
+  }
+  for (int i = 0; i < kCount; i++) {
+    EXPECT_EQ(0, arena_->free(keys[i]));
+  }
+  int64_t grown = pool_->getUsedSize();
+  for (int i = 0; i < kCount; i++) {
+    ASSERT_TRUE(isSlabKey(arena_->alloc(40)));
+  }
+  EXPECT_EQ(grown, pool_->getUsedSize());
+  EXPECT_FALSE(isSlabKey(arena_->alloc(65)));
+}
+
+TEST_F(ArenaWriteTest, compactMovesTailIntoHoles) {
+  use_delay_queue = false;
+  const int kCount = 2000;
+  std::vector<int64_t> keys;
+  for (int i = 0; i < kCount; i++) {
+    keys.push_back(arena_->alloc(100));
+    snprintf(arena_->getAddress(keys[i]), 100, "block-%d", i);
+  }
+  for (int i = 0; i < kCount; i += 2) {
+    arena_->free(keys[i]);
+    keys[i] = -1;
+  }
+  int64_t used = pool_->getUsedSize();
+
+  Compactor compactor(arena_);
+  ASSERT_EQ(0, compactor.begin());
+  std::vector<Relocation> relocations;
+  while (compactor.step(100, &relocations) > 0) {
+  }
+  EXPECT_EQ(static_cast<size_t>(kCount / 4), relocations.size());
+  // Two moved blocks are freed by their old keys before the switch over,
+  // which frees their new copies.
+  std::set<int64_t> copies;
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_EQ(0, arena_->free(relocations[i].old_key));
+    std::replace(keys.begin(), keys.end(), relocations[i].old_key,
+                 static_cast<int64_t>(-1));
+    copies.insert(relocations[i].new_key);
+  }
+  for (size_t i = 0; i < relocations.size(); i++) {
+    EXPECT_LT(relocations[i].new_key, relocations[i].old_key);
+    std::replace(keys.begin(), keys.end(), relocations[i].old_key,
+                 relocations[i].new_key);
+  }
+  int64_t released = compactor.finish();
+  EXPECT_GT(released, 0);
+  EXPECT_EQ(used - released, pool_->getUsedSize());
+  for (int i = 1; i < kCount; i += 2) {
+    if (keys[i] == -1) {
+      continue;
+    }
+    char expected[100];
+    snprintf(expected, sizeof(expected), "block-%d", i);
+    ASSERT_STREQ(expected, arena_->getAddress(keys[i]));
+  }
+  // The arena is usable again: the freed copies come back once each, then
+  // new blocks come from the tail.
+  std::set<int64_t> reused;
+  for (int i = 0; i < 2; i++) {
+    reused.insert(arena_->alloc(100));
+  }
+  EXPECT_TRUE(copies == reused);
+  EXPECT_EQ(used - released, arena_->alloc(100));
+}
+
+TEST_F(ArenaWriteTest, compactStepsOverPinnedBlocks) {
+  arena_->set_slab_max_size(64);
+  // A large hole at the head, five small ones above it.
+  int64_t big = arena_->alloc(16000);
+  std::vector<int64_t> low;
+  for (int i = 0; i < 40; i++) {
+    low.push_back(arena_->alloc(1000));
+  }
+  // A slab chunk and a delayed block near the tail, live blocks past them.
+  ASSERT_NE(-1, arena_->alloc(32));
+  int64_t delayed = arena_->alloc(1000);
+  std::vector<int64_t> high;
+  for (int i = 0; i < 10; i++) {
+    high.push_back(arena_->alloc(1000));
+    memset(arena_->getAddress(high[i]), 'a' + i, 1000);
+  }
+  ASSERT_EQ(0, arena_->free(big));
+  for (int i = 0; i < 5; i++) {
+    ASSERT_EQ(0, arena_->free(low[i]));
+  }
+  arena_->drainDelayQueue();
+  ASSERT_EQ(0, arena_->free(delayed));
+  int64_t used = pool_->getUsedSize();
+
+  Compactor compactor(arena_);
+  ASSERT_EQ(0, compactor.begin());
+  std::vector<Relocation> relocations;
+  while (compactor.step(4, &relocations) > 0) {
+  }
+  // Every block past the delayed one moves, five into the small holes and
+  // the rest into pieces of the large one.  Blocks below the slab chunk
+  // move on into what is left of it.
+  std::map<int64_t, int64_t> moved;
+  for (size_t i = 0; i < relocations.size(); i++) {
+    EXPECT_LT(relocations[i].new_key, relocations[i].old_key);
+    moved[relocations[i].old_key] = relocations[i].new_key;
+  }
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(moved.count(high[i])) << i;
+    char expected[1000];
+    memset(expected, 'a' + i, sizeof(expected));
+    EXPECT_EQ(0, memcmp(expected, arena_->getAddress(moved[high[i]]),
+                        sizeof(expected)));
+  }
+  EXPECT_TRUE(moved.count(low[39]));
+  EXPECT_FALSE(moved.count(delayed));
+  EXPECT_EQ(used - high[0], compactor.finish());
+  EXPECT_EQ(high[0], pool_->getUsedSize());
+}
+
+TEST_F(ArenaWriteTest, releaseLargeFreeBlocks) {
+  use_delay_queue = false;
+  arena_->set_release_size(64 * 1024);
+  int64_t first = arena_->alloc(1 << 20);
+  int64_t second = arena_->alloc(1 << 20);
+  memset(arena_->getAddress(first), 'x', 1 << 20);
+  memset(arena_->getAddress(second), 'x', 1 << 20);
+  int64_t used = pool_->getUsedSize();
+
+  EXPECT_EQ(0, arena_->free(first));
+  EXPECT_EQ(used, pool_->getUsedSize());
+  char* data = arena_->getAddress(first);
+  EXPECT_EQ(0, data[8192]);
+  EXPECT_EQ(0, data[(1 << 20) - 1]);
+
+  // The tail block is cut off instead of being listed.
+  EXPECT_EQ(0, arena_->free(second));
+  EXPECT_EQ(second, pool_->getUsedSize());
+  EXPECT_EQ(first, arena_->alloc(1 << 20));
+}
+
+TEST_F(ArenaWriteTest, reallocInPlace) {
+  use_delay_queue = false;
+  int64_t first = arena_->alloc(1000);
+  int64_t key = arena_->alloc(1000);
+  strcpy(arena_->getAddress(key), "payload");
+
+  // Within the class.
+  uint32_t size = arena_->getSize(key);
+  EXPECT_EQ(key, arena_->realloc(key, size));
+
+  // The last block grows by moving the tail.
+  EXPECT_EQ(key, arena_->realloc(key, 100000));
+  EXPECT_GE(arena_->getSize(key), 100000u);
+  EXPECT_EQ(key + static_cast<int64_t>(sizeof(uint32_t) + arena_->getSize(key)),
+            pool_->getUsedSize());
+  EXPECT_STREQ("payload", arena_->getAddress(key));
+
+  // ... and shrinks by moving it back.
+  EXPECT_EQ(key, arena_->realloc(key, 1000));
+  EXPECT_EQ(key + static_cast<int64_t>(sizeof(uint32_t) + arena_->getSize(key)),
+            pool_->getUsedSize());
+
+  // Other blocks split their remainder off.
+  strcpy(arena_->getAddress(first), "first");
+  EXPECT_EQ(first, arena_->realloc(first, 100));
+  uint32_t small = arena_->getSize(first);
+  EXPECT_LT(small, 1000u);
+  int64_t remainder = first + sizeof(uint32_t) + small;
+  EXPECT_EQ(size - small - sizeof(uint32_t), arena_->getSize(remainder));
+  EXPECT_STREQ("first", arena_->getAddress(first));
+
+  // A block that cannot grow in place moves.
+  int64_t moved = arena_->realloc(first, 5000);
+  EXPECT_NE(first, moved);
+  EXPECT_STREQ("first", arena_->getAddress(moved));
+}
+
+TEST_F(ArenaWriteTest, epochReclaim) {
+  ASSERT_EQ(0, arena_->set_epoch_reclaim(true));
+  EpochManager* epochs = arena_->getEpochManager();
+  int32_t reader = epochs->registerReader();
+  ASSERT_GE(reader, 0);
+
+  int64_t key = arena_->alloc(1000);
+  EXPECT_EQ(0, arena_->free(key));
+  // The reader has not passed a quiescent state since the free.
+  EXPECT_NE(key, arena_->alloc(1000));
+
+  epochs->quiescent(reader);
+  arena_->free(arena_->alloc(50000));
+  EXPECT_EQ(key, arena_->alloc(1000));
+
+  // An offline reader does not hold reclamation back.
+  key = arena_->alloc(1000);
+  arena_->free(key);
+  epochs->offline(reader);
+  arena_->free(arena_->alloc(50000));
+  EXPECT_EQ(key, arena_->alloc(1000));
+
+  epochs->unregisterReader(reader);
+  key = arena_->alloc(1000);
+  arena_->free(key);
+  arena_->free(arena_->alloc(50000));
+  EXPECT_EQ(key, arena_->alloc(1000));
+
+  // Back on the clock, blocks wait delayTime seconds again.
+  ASSERT_EQ(0, arena_->set_epoch_reclaim(false));
+  key = arena_->alloc(1000);
+  arena_->free(key);
+  arena_->free(arena_->alloc(50000));
+  EXPECT_NE(key, arena_->alloc(1000));
+}
+
+TEST_F(ArenaWriteTest, delayQueueGrowsBySegments) {
+  DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+    (pool_->getAddress(arena_->delay_queue_offset_));
+  std::vector<int64_t> keys;
+  for (uint32_t i = 0; i < 3 * kDelayQueueSegmentSize; i++) {
+    keys.push_back(arena_->alloc(100));
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    arena_->free(keys[i]);
+  }
+  EXPECT_EQ(keys.size(), delayQueue->usedSize());
+  EXPECT_EQ(3 * kDelayQueueSegmentSize, delayQueue->size());
+
+  // Pending nodes stay where they were pushed, in order.
+  DelayQueue::Cursor cursor = delayQueue->begin();
+  for (size_t i = 0; i < keys.size(); i++) {
+    DelayNode* node = delayQueue->next(&cursor, pool_);
+    ASSERT_TRUE(node != NULL);
+    EXPECT_EQ(keys[i], node->key);
+  }
+  EXPECT_TRUE(delayQueue->next(&cursor, pool_) == NULL);
+
+  // Drained segments are reused instead of allocating new ones.
+  for (int round = 0; round < 3; round++) {
+    arena_->drainDelayQueue();
+    EXPECT_TRUE(delayQueue->empty());
+    int64_t used = pool_->getUsedSize();
+    for (size_t i = 0; i < keys.size(); i++) {
+      arena_->free(keys[i]);
+    }
+    EXPECT_EQ(used, pool_->getUsedSize());
+    EXPECT_EQ(3 * kDelayQueueSegmentSize, delayQueue->size());
+  }
+}
+
+TEST_F(ArenaWriteTest, delayFreeWithoutRoomReleasesAtOnce) {
+  std::vector<int64_t> keys;
+  for (uint32_t i = 0; i <= kDelayQueueSegmentSize; i++) {
+    keys.push_back(arena_->alloc(100));
+  }
+  for (uint32_t i = 0; i < kDelayQueueSegmentSize; i++) {
+    arena_->free(keys[i]);
+  }
+  DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+    (pool_->getAddress(arena_->delay_queue_offset_));
+  ASSERT_TRUE(delayQueue->full());
+
+  // No room left for another segment.
+  int64_t used = pool_->header_file_->used_size;
+  pool_->header_file_->used_size = MMapMempool::kMmapSize_;
+  int64_t last = keys[kDelayQueueSegmentSize];
+  EXPECT_EQ(0, arena_->free(last));
+  pool_->header_file_->used_size = used;
+  EXPECT_EQ(kDelayQueueSegmentSize, delayQueue->usedSize());
+  int64_t* freeList = reinterpret_cast<int64_t*>
+    (pool_->getAddress(arena_->free_list_offset_));
+  EXPECT_EQ(last, freeList[arena_->blockLevel(last)]);
+  EXPECT_EQ(last, arena_->alloc(100));
+}
+
+TEST_F(ArenaWriteTest, loadChecksFormat) {
+  ASSERT_NE(-1, arena_->alloc(100));
+  uint32_t* format = reinterpret_cast<uint32_t*>(pool_->getBase());
+  EXPECT_EQ(kArenaMagic, format[0]);
+  EXPECT_EQ(kArenaFormatVersion, format[1]);
+  Arena reloaded;
+  EXPECT_EQ(0, reloaded.init(pool_));
+  // An older version, and a pool from before the magic word, which
+  // starts with min_mem_size.
+  format[1] = kArenaFormatVersion - 1;
+  Arena older;
+  EXPECT_EQ(-1, older.init(pool_));
+  format[1] = kArenaFormatVersion;
+  format[0] = 32;
+  Arena unversioned;
+  EXPECT_EQ(-1, unversioned.init(pool_));
+  format[0] = kArenaMagic;
+}
+
+TEST_F(ArenaWriteTest, sharedPoolAcrossProcesses) {
+  unlink("testArenaShared.mmap");
+  unlink("testArenaShared.mmap.header");
+  if (fork() == 0) {
+    // Probing leaves the prober attached, so later probes still see it.
+    MMapMempool second;
+    MMapMempool third;
+    if (second.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED) != 0
+        || third.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED) != 0
+        || second.isSoleOwner() || second.isSoleOwner()
+        || third.isSoleOwner()) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  int probe = 0;
+  wait(&probe);
+  EXPECT_TRUE(WIFEXITED(probe) && WEXITSTATUS(probe) == 0);
+  unlink("testArenaShared.mmap");
+  unlink("testArenaShared.mmap.header");
+  const int kProcesses = 4;
+  const int kBlocks = 2000;
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  for (int p = 0; p < kProcesses; p++) {
+    if (fork() == 0) {
+      MMapMempool pool;
+      Arena arena;
+      if (pool.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED) != 0
+          || arena.init(&pool) != 0) {
+        _exit(1);
+      }
+      for (int i = 0; i < kBlocks; i++) {
+        int64_t key = arena.alloc(64 + (i % 7) * 40);
+        if (key == -1) {
+          _exit(1);
+        }
+        memset(arena.getAddress(key), 'a' + p, arena.getSize(key));
+        if (write(fds[1], &key, sizeof(key)) != sizeof(key)) {
+          _exit(1);
+        }
+        if (i % 3 == 0) {
+          arena.free(key);
+        }
+      }
+      // Die holding the lock, the next process to lock recovers.
+      if (p == 0) {
+        arena.lock();
+      }
+      _exit(0);
+    }
+  }
+  close(fds[1]);
+  for (int p = 0; p < kProcesses; p++) {
+    int status = 0;
+    wait(&status);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  std::vector<int64_t> keys;
+  int64_t key;
+  while (read(fds[0], &key, sizeof(key)) == sizeof(key)) {
+    keys.push_back(key);
+  }
+  close(fds[0]);
+  EXPECT_EQ(static_cast<size_t>(kProcesses * kBlocks), keys.size());
+
+  MMapMempool pool;
+  Arena arena;
+  ASSERT_EQ(0, pool.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED));
+  ASSERT_EQ(0, arena.init(&pool));
+  // No two live blocks overlap.
+  std::sort(keys.begin(), keys.end());
+  for (size_t i = 1; i < keys.size(); i++) {
+    EXPECT_LE(keys[i - 1] + 4 + static_cast<int64_t>(arena.getSize(keys[i - 1])),
+              keys[i]);
+  }
+
+  // A sibling dies holding the lock while we stay attached, halfway
+  // through linking a free block.
+  ASSERT_EQ(0, pipe(fds));
+  if (fork() == 0) {
+    MMapMempool crashPool;
+    Arena crashArena;
+    if (crashPool.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED) != 0
+        || crashArena.init(&crashPool) != 0) {
+      _exit(1);
+    }
+    use_delay_queue = false;
+    // Past the thread caches, so the free reaches the shared list.
+    int64_t torn = crashArena.alloc(64 * 1024);
+    if (torn == -1 || crashArena.free(torn) != 0
+        || write(fds[1], &torn, sizeof(torn)) != sizeof(torn)) {
+      _exit(1);
+    }
+    crashArena.lock();
+    *reinterpret_cast<int64_t*>(crashArena.getAddress(torn)) = 8;
+    _exit(0);
+  }
+  close(fds[1]);
+  int64_t torn = -1;
+  EXPECT_EQ(static_cast<ssize_t>(sizeof(torn)),
+            read(fds[0], &torn, sizeof(torn)));
+  close(fds[0]);
+  int status = 0;
+  wait(&status);
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  EXPECT_NE(-1, arena.alloc(100));
+  EXPECT_EQ(0, arena.free(arena.alloc(100)));
+  ASSERT_NE(-1, torn);
+  EXPECT_EQ(-1, *reinterpret_cast<int64_t*>(arena.getAddress(torn)));
+  unlink("testArenaShared.mmap");
+  unlink("testArenaShared.mmap.header");
+}
+
+TEST_F(ArenaWriteTest, sharedPoolRecoversQueueAndSlabs) {
+  unlink("testArenaShared.mmap");
+  unlink("testArenaShared.mmap.header");
+  MMapMempool pool;
+  Arena arena;
+  ASSERT_EQ(0, pool.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED));
+  ASSERT_EQ(0, arena.init(&pool));
+  arena.set_slab_max_size(64);
+  int64_t object = arena.alloc(32);
+  ASSERT_NE(-1, object);
+  DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+    (pool.getAddress(arena.delay_queue_offset_));
+
+  // A sibling dies between popping a delayed block and releasing it.
+  int64_t queued = -1;
+  if (fork() == 0) {
+    MMapMempool crashPool;
+    Arena crashArena;
+    if (crashPool.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED) != 0
+        || crashArena.init(&crashPool) != 0) {
+      _exit(1);
+    }
+    int64_t key = crashArena.alloc(64 * 1024);
+    if (key == -1 || crashArena.free(key) != 0) {
+      _exit(1);
+    }
+    crashArena.lock();
+    DelayQueue* crashQueue = reinterpret_cast<DelayQueue*>
+      (crashPool.getAddress(crashArena.delay_queue_offset_));
+    if (crashQueue->empty()) {
+      _exit(2);
+    }
+    crashArena.beginQueueUpdate();
+    crashQueue->pop(&crashPool, crashArena.redo_);
+    _exit(0);
+  }
+  int status = 0;
+  wait(&status);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  arena.lock();
+  EXPECT_EQ(0, arena.queueUndo()->active);
+  ASSERT_FALSE(delayQueue->empty());
+  queued = delayQueue->front(&pool)->key;
+  EXPECT_EQ(static_cast<int64_t>(delayQueue->usedSize()),
+            arena.counters()->delay_blocks);
+  arena.unlock();
+  // Still parked, so no free list holds it too.
+  int64_t* freeList = reinterpret_cast<int64_t*>
+    (pool.getAddress(arena.free_list_offset_));
+  for (uint32_t level = 0; level < arena.level_; level++) {
+    for (int64_t key = freeList[level]; key != -1;
+         key = *reinterpret_cast<int64_t*>(pool.getAddress(key))) {
+      EXPECT_NE(queued, key);
+    }
+  }
+
+  // A sibling dies with a partial slab page off its list.
+  if (fork() == 0) {
+    MMapMempool crashPool;
+    Arena crashArena;
+    if (crashPool.init("testArenaShared.mmap", MFILE_MODE_WRITE_SHARED) != 0
+        || crashArena.init(&crashPool) != 0) {
+      _exit(1);
+    }
+    crashArena.set_slab_max_size(64);
+    crashArena.lock();
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>
+      (crashPool.getAddress(crashArena.slab_offset_));
+    if (slab->partial[32 / kSlabGranularity - 1] == -1) {
+      _exit(2);
+    }
+    slab->partial[32 / kSlabGranularity - 1] = -1;
+    _exit(0);
+  }
+  wait(&status);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  // The page is relinked and filled before a fresh one is taken.
+  EXPECT_EQ(arena.slabPage(object), arena.slabPage(arena.alloc(32)));
+  unlink("testArenaShared.mmap");
+  unlink("testArenaShared.mmap.header");
+}
+
+TEST_F(ArenaWriteTest, requestedEstimateDriftsWithinClass) {
+  use_delay_queue = false;
+  uint32_t high = 1000;
+  uint32_t level = arena_->getLevel(high);
+  ASSERT_GT(level, 0u);
+  uint32_t low = arena_->class_size_[level - 1] + 1;
+  ASSERT_LT(low, high);
+  const int kPairs = 50;
+  std::vector<int64_t> lows;
+  std::vector<int64_t> highs;
+  for (int i = 0; i < kPairs; i++) {
+    lows.push_back(arena_->alloc(low));
+    highs.push_back(arena_->alloc(high));
+  }
+  ClassCounters* counter = arena_->classCounters() + level;
+  // Exact while nothing was freed.
+  EXPECT_EQ(kPairs * static_cast<int64_t>(low + high),
+            counter->requested_estimate);
+  // Each freed block takes the class average, not its own size.
+  for (int i = 0; i < kPairs; i++) {
+    ASSERT_EQ(0, arena_->free(lows[i]));
+  }
+  EXPECT_NEAR(kPairs * (low + high) / 2.0, counter->requested_estimate,
+              kPairs);
+  EXPECT_LT(counter->requested_estimate, kPairs * static_cast<int64_t>(high));
+  // The last block of the class takes whatever is left.
+  for (int i = 0; i < kPairs; i++) {
+    ASSERT_EQ(0, arena_->free(highs[i]));
+  }
+  EXPECT_EQ(0, counter->requested_estimate);
+}
+
+TEST_F(ArenaWriteTest, statsFollowBlocks) {
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 1000; i++) {
+    keys.push_back(arena_->alloc(100 + i));
+  }
+  ArenaStats stats;
+  ASSERT_EQ(0, arena_->getStats(&stats));
+  int64_t live = 0;
+  int64_t liveBytes = 0;
+  for (size_t i = 0; i < stats.classes.size(); i++) {
+    live += stats.classes[i].live_blocks;
+    liveBytes += stats.classes[i].live_bytes;
+  }
+  EXPECT_EQ(1000, live);
+  EXPECT_GT(stats.internal_fragmentation, 0.0);
+  EXPECT_LT(stats.internal_fragmentation, 0.05);
+  EXPECT_EQ(stats.data_size, liveBytes + 1000 * 4);
+
+  // Half go to the delay queue, the rest straight to the free lists.
+  for (int i = 0; i < 500; i++) {
+    arena_->free(keys[i]);
+  }
+  use_delay_queue = false;
+  int64_t freed = 0;
+  for (int i = 500; i < 1000; i++) {
+    freed += arena_->getSize(keys[i]);
+    arena_->free(keys[i]);
+  }
+  ASSERT_EQ(0, arena_->getStats(&stats));
+  int64_t freeBlocks = 0;
+  int64_t freeBytes = 0;
+  live = 0;
+  for (size_t i = 0; i < stats.classes.size(); i++) {
+    live += stats.classes[i].live_blocks;
+    freeBlocks += stats.classes[i].free_blocks;
+    freeBytes += stats.classes[i].free_bytes;
+  }
+  EXPECT_EQ(0, live);
+  EXPECT_EQ(500, stats.delay_blocks);
+  EXPECT_EQ(500, freeBlocks);
+  EXPECT_EQ(freed, freeBytes);
+  EXPECT_GT(stats.external_fragmentation, 0.9);
+  // Only live blocks count.
+  EXPECT_EQ(0.0, stats.internal_fragmentation);
+
+  // A block growing in place at the tail is booked at its new size once.
+  uint32_t exact = 100000;
+  arena_->getLevel(exact);
+  int64_t tail = arena_->alloc(5000);
+  ASSERT_EQ(tail, arena_->realloc(tail, exact));
+  ASSERT_EQ(exact, arena_->getSize(tail));
+  ArenaStats grown;
+  ASSERT_EQ(0, arena_->getStats(&grown));
+  EXPECT_EQ(0.0, grown.internal_fragmentation);
+
+  std::string text;
+  stats.toText(&text);
+  EXPECT_NE(std::string::npos, text.find("arena_delay_blocks 500\n"));
+  EXPECT_NE(std::string::npos, text.find("arena_free_blocks{class="));
+}
+
+TEST_F(ArenaWriteTest, statsWithThreadCaches) {
+  ASSERT_EQ(0, arena_->set_thread_safe(true));
+  arena_->set_slab_max_size(64);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([this]() {
+      std::vector<int64_t> keys;
+      for (int i = 0; i < 3000; i++) {
+        keys.push_back(arena_->alloc(16 + (i % 50) * 24));
+      }
+      for (int i = 0; i < 3000; i += 2) {
+        arena_->free(keys[i]);
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  arena_->flushThreadCaches();
+  ArenaStats stats;
+  ASSERT_EQ(0, arena_->getStats(&stats));
+  int64_t live = stats.slab_objects;
+  for (size_t i = 0; i < stats.classes.size(); i++) {
+    live += stats.classes[i].live_blocks;
+  }
+  EXPECT_EQ(4 * 1500, live);
+}
+
+// Dirty kB of the mappings starting in [addr, addr + length), from
+// /proc/self/smaps.
+int64_t dirtyKb(const char* addr, int64_t length) {
+  FILE* smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == NULL) {
+    return -1;
+  }
+  char line[512];
+  bool inside = false;
+  int64_t dirty = 0;
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    unsigned long start = 0;
+    unsigned long end = 0;
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, ':')
+        && line[0] != ' ' && strstr(line, "kB") == NULL) {
+      inside = start >= reinterpret_cast<unsigned long>(addr)
+          && start < reinterpret_cast<unsigned long>(addr + length);
+      continue;
+    }
+    long kb = 0;
+    if (inside && (sscanf(line, "Shared_Dirty: %ld kB", &kb) == 1
+                   || sscanf(line, "Private_Dirty: %ld kB", &kb) == 1)) {
+      dirty += kb;
+    }
+  }
+  fclose(smaps);
+  return dirty;
+}
+
+TEST_F(ArenaWriteTest, mapPolicyPopulatesUsedRange) {
+  for (int i = 0; i < 1000; i++) {
+    memset(arena_->getAddress(arena_->alloc(8000)), 1, 8000);
+  }
+  arena_->dump();
+  int64_t used = pool_->getUsedSize();
+  delete arena_;
+  delete pool_;
+  int fd = open("testArenaWrite.mmap", O_RDONLY);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  pool_ = new MMapMempool;
+  ASSERT_EQ(0, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE,
+    MMAP_POLICY_HUGEPAGE | MMAP_POLICY_POPULATE | MMAP_POLICY_MLOCK));
+  arena_ = new Arena();
+  ASSERT_EQ(0, arena_->init(pool_));
+  const int64_t page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> resident((used + page - 1) / page);
+  ASSERT_EQ(0, mincore(pool_->getBase(), used, &resident[0]));
+  for (size_t i = 0; i < resident.size(); i++) {
+    ASSERT_TRUE(resident[i] & 1) << "page " << i;
+  }
+  // Populating does not dirty the pages, only the header was written.
+  EXPECT_LT(dirtyKb(pool_->getBase(), used) * 1024, used / 4);
+  EXPECT_EQ(0, arena_->free(arena_->alloc(100)));
+}
+
+TEST_F(ArenaWriteTest, backgroundGrowthKeepsHeadroom) {
+  const int64_t kHeadroom = 64 << 20;
+  pool_->setExpandSize(1 << 20);
+  ASSERT_EQ(0, pool_->setGrowthHeadroom(kHeadroom));
+  for (int i = 0; i < 200; i++) {
+    EXPECT_NE(-1, arena_->alloc(1 << 20));
+    usleep(1000);
+  }
+  EXPECT_GT(pool_->getExpandCount(), 0);
+  // Give the thread a moment to catch up with the last alloc.
+  for (int i = 0; i < 1000
+       && pool_->getCapacity() - pool_->getUsedSize() < kHeadroom / 2; i++) {
+    usleep(1000);
+  }
+  EXPECT_GE(pool_->getCapacity() - pool_->getUsedSize(), kHeadroom / 2);
+
+  // The file is preallocated, not sparse.
+  struct stat st;
+  ASSERT_EQ(0, stat("testArenaWrite.mmap", &st));
+  EXPECT_GE(st.st_size, pool_->getCapacity());
+  EXPECT_GE(st.st_blocks * 512, pool_->getCapacity());
+  pool_->close();
+  EXPECT_FALSE(pool_->growth_running_);
+}
+
+TEST_F(ArenaWriteTest, dumpDirtySyncsChangedChunks) {
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 1000; i++) {
+    keys.push_back(arena_->alloc(8000));
+  }
+  ASSERT_EQ(0, pool_->setDirtyTracking(true));
+  EXPECT_EQ(0, arena_->dumpDirty(4));
+  std::vector<DirtyRange> ranges;
+  ASSERT_EQ(0, pool_->takeDirty(&ranges));
+  EXPECT_TRUE(ranges.empty());
+
+  int64_t key = keys[500];
+  memset(arena_->getAddress(key), 7, 8000);
+  arena_->markDirty(key);
+  ASSERT_EQ(0, pool_->takeDirty(&ranges));
+  ASSERT_FALSE(ranges.empty());
+  EXPECT_LE(ranges[0].offset, key);
+  EXPECT_GE(ranges.back().offset + ranges.back().length, key + 8004);
+  EXPECT_LE(ranges.size(), 2U);
+
+  // A free writes the block's next pointer besides the header.
+  ranges.clear();
+  use_delay_queue = false;
+  EXPECT_EQ(0, arena_->free(keys[900]));
+  ASSERT_EQ(0, pool_->takeDirty(&ranges));
+  bool found = false;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    found |= ranges[i].offset <= keys[900]
+        && keys[900] < ranges[i].offset + ranges[i].length;
+  }
+  EXPECT_TRUE(found);
+
+  // A realloc that moves leaves the copy marked.
+  ranges.clear();
+  int64_t moved = arena_->realloc(keys[600], 20000);
+  ASSERT_NE(-1, moved);
+  ASSERT_EQ(0, pool_->takeDirty(&ranges));
+  found = false;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    found |= ranges[i].offset <= moved
+        && moved + 20004 <= ranges[i].offset + ranges[i].length;
+  }
+  EXPECT_TRUE(found);
+
+  ASSERT_EQ(0, arena_->set_flush_interval(5, 2));
+  memset(arena_->getAddress(keys[10]), 9, 8000);
+  arena_->markDirty(keys[10]);
+  usleep(50000);
+  EXPECT_EQ(0, arena_->set_flush_interval(0));
+  ranges.clear();
+  ASSERT_EQ(0, pool_->takeDirty(&ranges));
+  EXPECT_TRUE(ranges.empty());
+}
+
+TEST_F(ArenaWriteTest, redoLogNotesRangesOnce) {
+  RedoLog log;
+  // Without set_concurrent the log never takes its mutex, so note() must
+  // not block while another thread holds it.
+  pthread_mutex_lock(&log.mutex_);
+  for (int i = 0; i < 100000; i++) {
+    log.note((i * 7919 % 100) * 16, 8);
+  }
+  pthread_mutex_unlock(&log.mutex_);
+  // Repeated ranges are folded together rather than piling up.
+  EXPECT_GE(1024u, log.noted_.size());
+  std::set<int64_t> offsets;
+  for (size_t i = 0; i < log.noted_.size(); i++) {
+    offsets.insert(log.noted_[i].offset);
+  }
+  EXPECT_EQ(100u, offsets.size());
+}
+
+TEST_F(ArenaWriteTest, redoLogRestoresLastCommit) {
+  delete arena_;
+  delete pool_;
+  unlink("testArenaWrite.mmap");
+  unlink("testArenaWrite.mmap.header");
+  unlink("testArenaWrite.mmap.redo");
+  pool_ = new MMapMempool;
+  ASSERT_EQ(0, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE));
+  arena_ = new Arena();
+  ASSERT_EQ(0, arena_->openRedoLog("testArenaWrite.mmap.redo"));
+  ASSERT_EQ(0, arena_->init(pool_, 32, 1U << 31, 1.05, 0));
+  use_delay_queue = false;
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 100; i++) {
+    keys.push_back(arena_->alloc(100 + i));
+  }
+  for (int i = 0; i < 100; i += 2) {
+    EXPECT_EQ(0, arena_->free(keys[i]));
+  }
+  ASSERT_EQ(0, arena_->commit());
+  int64_t used = pool_->getUsedSize();
+  ArenaStats stats;
+  arena_->getStats(&stats);
+  int64_t live = 0;
+  int64_t freeBlocks = 0;
+  for (size_t i = 0; i < stats.classes.size(); i++) {
+    live += stats.classes[i].live_blocks;
+    freeBlocks += stats.classes[i].free_blocks;
+  }
+
+  // Changes after the commit are lost, some half written: a list head
+  // pointing into the void and a used size that went backwards.
+  arena_->alloc(5000);
+  int64_t* freeList = reinterpret_cast<int64_t*>
+    (pool_->getAddress(arena_->free_list_offset_));
+  uint32_t level = arena_->blockLevel(keys[0]);
+  freeList[level] = used + 4096;
+  pool_->shrink(pool_->getUsedSize(), keys[50]);
+  delete arena_;
+  delete pool_;
+  // A torn record at the tail is ignored.
+  int fd = open("testArenaWrite.mmap.redo", O_WRONLY | O_APPEND);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(5, write(fd, "RDO1x", 5));
+  close(fd);
+
+  pool_ = new MMapMempool;
+  ASSERT_EQ(0, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE));
+  arena_ = new Arena();
+  ASSERT_EQ(0, arena_->openRedoLog("testArenaWrite.mmap.redo"));
+  ASSERT_EQ(0, arena_->init(pool_));
+  EXPECT_EQ(used, pool_->getUsedSize());
+  arena_->getStats(&stats);
+  for (size_t i = 0; i < stats.classes.size(); i++) {
+    live -= stats.classes[i].live_blocks;
+    freeBlocks -= stats.classes[i].free_blocks;
+  }
+  EXPECT_EQ(0, live);
+  EXPECT_EQ(0, freeBlocks);
+  struct stat st;
+  ASSERT_EQ(0, stat("testArenaWrite.mmap.redo", &st));
+  EXPECT_EQ(0, st.st_size);
+
+  // Every freed block comes back exactly once, live ones never.
+  std::set<int64_t> freed;
+  for (int i = 0; i < 100; i += 2) {
+    freed.insert(keys[i]);
+  }
+  for (int i = 0; i < 50; i++) {
+    int64_t key = arena_->alloc(100 + 2 * i);
+    ASSERT_NE(-1, key);
+    if (key < used) {
+      EXPECT_EQ(1U, freed.erase(key)) << key;
+    }
+  }
+
+  // A checkpoint empties the log, yet pages written after it may reach the
+  // disk torn: here a list head whose link in the block did not.
+  ASSERT_EQ(0, arena_->dump());
+  EXPECT_EQ(0, arena_->free(keys[1]));
+  *reinterpret_cast<int64_t*>(arena_->getAddress(keys[1])) = used + 65536;
+  level = arena_->blockLevel(keys[1]);
+  delete arena_;
+  delete pool_;
+  pool_ = new MMapMempool;
+  ASSERT_EQ(0, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE));
+  arena_ = new Arena();
+  ASSERT_EQ(0, arena_->openRedoLog("testArenaWrite.mmap.redo"));
+  ASSERT_EQ(0, arena_->init(pool_));
+  freeList = reinterpret_cast<int64_t*>
+    (pool_->getAddress(arena_->free_list_offset_));
+  EXPECT_EQ(keys[1], freeList[level]);
+  EXPECT_EQ(-1, *reinterpret_cast<int64_t*>(arena_->getAddress(keys[1])));
+  unlink("testArenaWrite.mmap.redo");
+}
+
+TEST_F(ArenaWriteTest, snapshotWhileWriting) {
+  unlink("testArenaWrite.snap.mmap");
+  unlink("testArenaWrite.snap.mmap.header");
+  arena_->set_thread_safe(true);
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 4000; i++) {
+    keys.push_back(arena_->alloc(16000));
+    memset(arena_->getAddress(keys.back()), 'a', 16000);
+  }
+  int64_t used = pool_->getUsedSize();
+  uint64_t mark = 7;
+  ASSERT_TRUE(arena_->SetUserDefine(&mark));
+  ASSERT_EQ(0, arena_->snapshot("testArenaWrite.snap.mmap"));
+  // The header is in the image as of snapshot(), whenever the copy gets
+  // to it.
+  mark = 8;
+  ASSERT_TRUE(arena_->SetUserDefine(&mark));
+  for (int i = 3999; i >= 0; i -= 3) {
+    arena_->markDirty(keys[i]);
+    memset(arena_->getAddress(keys[i]), 'b', 16000);
+  }
+  for (int i = 1; i < 4000; i += 3) {
+    EXPECT_EQ(0, arena_->free(keys[i]));
+  }
+  arena_->alloc(100);
+  ASSERT_EQ(0, arena_->waitSnapshot());
+
+  MMapMempool pool;
+  ASSERT_EQ(0, pool.init("testArenaWrite.snap.mmap", MFILE_MODE_WRITE));
+  Arena arena;
+  ASSERT_EQ(0, arena.init(&pool));
+  EXPECT_EQ(used, pool.getUsedSize());
+  for (int i = 0; i < 4000; i++) {
+    char* data = arena.getAddress(keys[i]);
+    ASSERT_TRUE(data != NULL);
+    ASSERT_EQ(arena_->getSize(keys[i]), arena.getSize(keys[i]));
+    EXPECT_EQ('a', data[0]);
+    EXPECT_EQ('a', data[15999]);
+  }
+  ArenaStats stats;
+  arena.getStats(&stats);
+  EXPECT_EQ(0, stats.delay_blocks);
+  EXPECT_EQ(7u, *arena.GetUserDefine());
+  pool.close();
+  unlink("testArenaWrite.snap.mmap");
+  unlink("testArenaWrite.snap.mmap.header");
+}
+
+TEST_F(ArenaWriteTest, anonAndMemfdPools) {
+  AnonMempool anon;
+  ASSERT_EQ(0, anon.init("anon", MFILE_MODE_WRITE, MMAP_POLICY_HUGEPAGE));
+  anon.setExpandSize(1 << 20);
+  Arena scratch;
+  ASSERT_EQ(0, scratch.init(&anon));
+  int64_t key = scratch.alloc(3 << 20);
+  ASSERT_NE(-1, key);
+  memset(scratch.getAddress(key), 1, 3 << 20);
+  EXPECT_GT(anon.getExpandCount(), 0);
+  EXPECT_EQ(0, scratch.dump());
+  EXPECT_EQ(0, scratch.reset());
+  EXPECT_EQ(0, anon.release(0, 1 << 20));
+  EXPECT_EQ(0, anon.getAddress(4096)[0]);
+
+  MemfdMempool memfd;
+  ASSERT_EQ(0, memfd.init("arena_test", MFILE_MODE_WRITE));
+  Arena shared;
+  ASSERT_EQ(0, shared.init(&memfd));
+  key = shared.alloc(100);
+  strcpy(shared.getAddress(key), "hello");
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    MemfdMempool reader;
+    if (reader.attach(memfd.getFd(), MFILE_MODE_READ) != 0) {
+      _exit(1);
+    }
+    char* data = reader.getAddress(key + sizeof(uint32_t), 6);
+    _exit(data != NULL && strcmp(data, "hello") == 0 ? 0 : 2);
+  }
+  int status = 0;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+
+  // Growth shows up in a pool attached later.
+  int64_t big = shared.alloc(8 << 20);
+  ASSERT_NE(-1, big);
+  shared.getAddress(big)[(8 << 20) - 1] = 7;
+  MemfdMempool reader;
+  ASSERT_EQ(0, reader.attach(memfd.getFd(), MFILE_MODE_READ));
+  EXPECT_EQ(memfd.getUsedSize(), reader.getUsedSize());
+  EXPECT_EQ(7, reader.getAddress(big + sizeof(uint32_t))[(8 << 20) - 1]);
+}
+
+TEST_F(ArenaWriteTest, typedArenaMatchesArena) {
+  AnonMempool pool;
+  ASSERT_EQ(0, pool.init("typed", MFILE_MODE_WRITE));
+  TypedArena<AnonMempool> arena;
+  TypedArena<AnonMempool>* typed = &arena;
+  ASSERT_EQ(0, typed->init(&pool));
+  typed->set_slab_max_size(64);
+  std::vector<int64_t> keys;
+  for (uint32_t size = 1; size < 100000; size = size * 3 / 2 + 1) {
+    keys.push_back(typed->alloc(size));
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    char* data = typed->Arena::getAddress(keys[i]);
+    ASSERT_TRUE(data != NULL);
+    EXPECT_EQ(data, typed->getAddress(keys[i]));
+    EXPECT_EQ(data, typed->getAddressUnchecked(keys[i]));
+    EXPECT_EQ(typed->Arena::getSize(keys[i]), typed->getSize(keys[i]));
+  }
+  EXPECT_TRUE(typed->getAddress(-1) == NULL);
+  EXPECT_TRUE(typed->getAddress(pool.getUsedSize()) == NULL);
+  EXPECT_TRUE(typed->getAddress(kSlabKeyTag | pool.getUsedSize()) == NULL);
+  // A prefix claiming more than the pool holds.
+  int64_t key = keys.back();
+  *reinterpret_cast<uint32_t*>(pool.getAddress(key)) = 1U << 30;
+  EXPECT_TRUE(typed->getAddress(key) == NULL);
+  EXPECT_TRUE(typed->Arena::getAddress(key) == NULL);
+}
+
+TEST_F(ArenaWriteTest, heatMapWarmsRestart) {
+  delete arena_;
+  delete pool_;
+  unlink("testArenaWrite.mmap");
+  unlink("testArenaWrite.mmap.header");
+  unlink("testArenaWrite.mmap.heat");
+  pool_ = new MMapMempool;
+  // Locked pages cannot be sampled.
+  EXPECT_EQ(-1, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE,
+                            MMAP_POLICY_HEAT_MAP | MMAP_POLICY_MLOCK));
+  ASSERT_EQ(0, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE,
+                           MMAP_POLICY_HEAT_MAP));
+  arena_ = new Arena();
+  ASSERT_EQ(0, arena_->init(pool_));
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 64; i++) {
+    keys.push_back(arena_->alloc(1 << 20));
+    memset(arena_->getAddress(keys.back()), 1, 1 << 20);
+  }
+  ASSERT_EQ(0, arena_->dump());
+  // Only the first chunks are read before the next dump, the rest stays
+  // cached but untouched.
+  const int64_t chunk = MMapMempool::kHeatChunkSize;
+  int64_t hot = (keys[8] + chunk - 1) / chunk * chunk;
+  int64_t used = pool_->getUsedSize();
+  const int64_t page = sysconf(_SC_PAGESIZE);
+  int64_t sum = 0;
+  for (int64_t offset = 0; offset < hot; offset += page) {
+    sum += *reinterpret_cast<volatile char*>(pool_->getBase() + offset);
+  }
+  EXPECT_LT(0, sum);
+  ASSERT_EQ(0, arena_->dump());
+  struct stat st;
+  ASSERT_EQ(0, stat("testArenaWrite.mmap.heat", &st));
+  EXPECT_GT(st.st_size, (used / MMapMempool::kHeatChunkSize) - 1);
+  EXPECT_GT(pool_->heat_[0], pool_->heat_[hot / chunk]);
+  EXPECT_GT(pool_->heat_[hot / chunk - 1], pool_->heat_[used / chunk - 1]);
+  // One window of chunks is unmapped per dump, not the whole pool.
+  int64_t armed = std::count(pool_->heat_armed_.begin(),
+                             pool_->heat_armed_.end(), 1);
+  EXPECT_EQ(std::min(MMapMempool::kHeatSampleChunks,
+                     static_cast<int64_t>(pool_->heat_armed_.size())), armed);
+  delete arena_;
+  delete pool_;
+  // Warm-up has to page the hot chunks back in from the file.
+  int fd = open("testArenaWrite.mmap", O_RDONLY);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  pool_ = new MMapMempool;
+  ASSERT_EQ(0, pool_->init("testArenaWrite.mmap", MFILE_MODE_WRITE,
+                           MMAP_POLICY_HEAT_MAP | MMAP_POLICY_WARM_UP));
+  pool_->waitWarmUp();
+  arena_ = new Arena();
+  ASSERT_EQ(0, arena_->init(pool_));
+  std::vector<unsigned char> resident(hot / page);
+  ASSERT_EQ(0, mincore(pool_->getBase(), hot, &resident[0]));
+  for (size_t i = 0; i < resident.size(); i++) {
+    ASSERT_TRUE(resident[i] & 1) << "page " << i;
+  }
+  unlink("testArenaWrite.mmap.heat");
+}
+
+TEST_F(ArenaWriteTest, segmentedPoolSpansFiles) {
+  const int64_t segment = 1 << 20;
+  for (int i = 0; i < 8; i++) {
+    unlink(("testSegmented.mmap." + std::to_string(i)).c_str());
+  }
+  unlink("testSegmented.mmap.header");
+  SegmentedMempool* pool = new SegmentedMempool;
+  ASSERT_EQ(0, pool->setSegmentSize(segment));
+  pool->setExpandSize(64 << 10);
+  ASSERT_EQ(0, pool->init("testSegmented.mmap", MFILE_MODE_WRITE));
+  Arena* arena = new Arena();
+  ASSERT_EQ(0, arena->init(pool));
+  EXPECT_EQ(-1, pool->alloc(segment + 1));
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 16; i++) {
+    keys.push_back(arena->alloc(300000));
+    ASSERT_NE(-1, keys.back());
+    // No block straddles two segments.
+    EXPECT_EQ(keys[i] / segment, (keys[i] + 300000) / segment);
+    memset(arena->getAddress(keys[i]), i, 300000);
+  }
+  EXPECT_GE(pool->getSegmentCount(), 5);
+  int64_t gap = keys[2] + sizeof(uint32_t) + arena->getSize(keys[2]);
+  EXPECT_EQ(keys[3], pool->skipUnallocated(gap));
+  EXPECT_EQ(keys[3] / segment * segment, keys[3]);
+  EXPECT_TRUE(pool->getAddress(gap, 1) == NULL);
+  // Keys would not shift by one delta across the gaps.
+  AnonMempool copyPool;
+  ASSERT_EQ(0, copyPool.init("copy", MFILE_MODE_WRITE));
+  Arena copy;
+  ASSERT_EQ(0, copy.init(&copyPool));
+  int64_t copyUsed = copyPool.getUsedSize();
+  int64_t delta = 0;
+  EXPECT_EQ(-1, copy.append(arena));
+  EXPECT_EQ(-1, copy.merge(arena, &delta));
+  EXPECT_EQ(copyUsed, copyPool.getUsedSize());
+  ASSERT_EQ(0, arena->dump());
+  delete arena;
+  delete pool;
+
+  pool = new SegmentedMempool;
+  pool->setThreads(4);
+  ASSERT_EQ(0, pool->init("testSegmented.mmap", MFILE_MODE_WRITE));
+  EXPECT_EQ(segment, pool->getSegmentSize());
+  arena = new Arena();
+  ASSERT_EQ(0, arena->init(pool));
+  for (int i = 0; i < 16; i++) {
+    char* data = arena->getAddress(keys[i]);
+    ASSERT_TRUE(data != NULL);
+    EXPECT_EQ(i, data[0]);
+    EXPECT_EQ(i, data[299999]);
+  }
+  // Compaction walks across the gaps and hands the last segments back.
+  use_delay_queue = false;
+  for (int i = 0; i < 12; i++) {
+    arena->free(keys[i]);
+  }
+  Compactor compactor(arena);
+  ASSERT_EQ(0, compactor.begin());
+  std::vector<Relocation> relocations;
+  while (compactor.step(16, &relocations) > 0) {
+  }
+  EXPECT_GT(compactor.finish(), 0);
+  EXPECT_LT(pool->getSegmentCount(), 5);
+  for (size_t i = 0; i < relocations.size(); i++) {
+    int64_t from = relocations[i].old_key;
+    EXPECT_EQ(std::find(keys.begin(), keys.end(), from) - keys.begin(),
+              arena->getAddress(relocations[i].new_key)[0]);
+  }
+  delete arena;
+  delete pool;
+  for (int i = 0; i < 8; i++) {
+    unlink(("testSegmented.mmap." + std::to_string(i)).c_str());
+  }
+  unlink("testSegmented.mmap.header");
+}
+
+TEST_F(ArenaWriteTest, numaArenaServesLocalNode) {
+  EXPECT_GE(numaNodeCount(), 1);
+  EXPECT_LT(numaCurrentNode(), numaNodeCount());
+  // Two pools stand for two nodes, so that this runs on one-node hosts.
+  AnonMempool pools[2];
+  std::vector<Mempool*> list;
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(0, pools[i].init("numa", MFILE_MODE_WRITE));
+    list.push_back(&pools[i]);
+  }
+  NumaArena arena;
+  ASSERT_EQ(0, arena.init(list));
+  EXPECT_EQ(2, arena.getNodeCount());
+  int32_t local = arena.getLocalNode();
+  EXPECT_EQ(numaCurrentNode() % 2, local);
+
+  int64_t key = arena.alloc(100);
+  ASSERT_NE(-1, key);
+  EXPECT_EQ(local, NumaArena::getNode(key));
+  int64_t remote = arena.allocOnNode(1 - local, 100);
+  ASSERT_NE(-1, remote);
+  EXPECT_EQ(1 - local, NumaArena::getNode(remote));
+  memset(arena.getAddress(key), 1, 100);
+  memset(arena.getAddress(remote), 2, 100);
+  EXPECT_EQ(1, arena.getAddress(key)[99]);
+  EXPECT_EQ(2, arena.getAddress(remote)[99]);
+  EXPECT_GE(arena.getSize(key), 100U);
+  EXPECT_TRUE(arena.getAddress(key | kNumaKeyMask) == NULL);
+  EXPECT_EQ(-1, arena.allocOnNode(2, 100));
+
+  std::vector<ArenaStats> stats;
+  ASSERT_EQ(0, arena.getStats(&stats));
+  ASSERT_EQ(2U, stats.size());
+  for (int node = 0; node < 2; node++) {
+    int64_t live = 0;
+    for (size_t i = 0; i < stats[node].classes.size(); i++) {
+      live += stats[node].classes[i].live_blocks;
+    }
+    EXPECT_EQ(1, live);
+  }
+  EXPECT_EQ(0, arena.free(remote));
+  EXPECT_EQ(-1, arena.free(-1));
+
+  // Binding to the only node there surely is.
+  AnonMempool bound;
+  ASSERT_EQ(0, bound.setNumaPolicy(NUMA_POLICY_INTERLEAVE, 1));
+  ASSERT_EQ(0, bound.init("bound", MFILE_MODE_WRITE));
+  EXPECT_EQ(-1, bound.setNumaPolicy(NUMA_POLICY_BIND, 0));
+  int64_t offset = bound.alloc(1 << 20);
+  memset(bound.getAddress(offset), 1, 1 << 20);
+}
+
+TEST_F(ArenaWriteTest, mergeCarriesFreeListsAndSlabs) {
+  unlink("testArenaMerge.mmap");
+  unlink("testArenaMerge.mmap.header");
+  MMapMempool srcPool;
+  ASSERT_EQ(0, srcPool.init("testArenaMerge.mmap", MFILE_MODE_WRITE));
+  Arena src;
+  ASSERT_EQ(0, src.init(&srcPool));
+  src.set_slab_max_size(64);
+  arena_->set_slab_max_size(64);
+  int64_t own = arena_->alloc(1000);
+  memset(arena_->getAddress(own), 9, 1000);
+
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 200; i++) {
+    keys.push_back(src.alloc(i % 2 == 0 ? 24 : 100 + i * 50));
+    memset(src.getAddress(keys[i]), i, src.getSize(keys[i]));
+  }
+  // One pending free in the delay queue, then some on the free lists and
+  // one leaving a partial slab page.
+  ASSERT_EQ(0, src.free(keys[1]));
+  use_delay_queue = false;
+  ASSERT_EQ(0, src.free(keys[3]));
+  ASSERT_EQ(0, src.free(keys[5]));
+  ASSERT_EQ(0, src.free(keys[0]));
+  ArenaStats before;
+  ASSERT_EQ(0, arena_->getStats(&before));
+
+  int64_t delta = 0;
+  ASSERT_EQ(srcPool.getUsedSize() - src.getHeaderSize(),
+            arena_->merge(&src, &delta, 4));
+  std::vector<int64_t> merged(keys);
+  merged[0] = merged[1] = merged[3] = merged[5] = -1;
+  Arena::translateKeys(&merged[0], merged.size(), delta);
+  EXPECT_EQ(-1, merged[0]);
+  for (size_t i = 6; i < merged.size(); i++) {
+    char* data = arena_->getAddress(merged[i]);
+    ASSERT_TRUE(data != NULL);
+    ASSERT_EQ(src.getSize(keys[i]), arena_->getSize(merged[i]));
+    EXPECT_EQ(static_cast<char>(i), data[0]);
+    EXPECT_EQ(static_cast<char>(i), data[arena_->getSize(merged[i]) - 1]);
+  }
+  EXPECT_EQ(9, arena_->getAddress(own)[999]);
+
+  ArenaStats after;
+  ArenaStats srcStats;
+  ASSERT_EQ(0, arena_->getStats(&after));
+  ASSERT_EQ(0, src.getStats(&srcStats));
+  EXPECT_EQ(before.slab_objects + srcStats.slab_objects, after.slab_objects);
+  EXPECT_EQ(before.delay_blocks + 1, after.delay_blocks);
+  for (size_t i = 0; i < after.classes.size(); i++) {
+    EXPECT_EQ(before.classes[i].live_blocks + srcStats.classes[i].live_blocks,
+              after.classes[i].live_blocks);
+    EXPECT_EQ(before.classes[i].free_blocks + srcStats.classes[i].free_blocks,
+              after.classes[i].free_blocks);
+  }
+  // The freed blocks and slab slot are handed out again.
+  int64_t reused = arena_->alloc(src.getSize(keys[3]));
+  EXPECT_TRUE(reused == keys[3] + delta || reused == keys[5] + delta);
+  int64_t slot = arena_->alloc(24);
+  EXPECT_EQ((keys[0] & kKeyOffsetMask) + delta, slot & kKeyOffsetMask);
+  EXPECT_EQ(0, arena_->free(merged[2]));
+  EXPECT_EQ(0, arena_->free(merged[7]));
+  unlink("testArenaMerge.mmap");
+  unlink("testArenaMerge.mmap.header");
+
+  // Pools without files copy in memory.
+  AnonMempool from;
+  AnonMempool to;
+  ASSERT_EQ(0, from.init("from", MFILE_MODE_WRITE));
+  ASSERT_EQ(0, to.init("to", MFILE_MODE_WRITE));
+  Arena a;
+  Arena b;
+  ASSERT_EQ(0, a.init(&from));
+  ASSERT_EQ(0, b.init(&to));
+  int64_t big = a.alloc(8 << 20);
+  memset(a.getAddress(big), 3, 8 << 20);
+  b.alloc(100);
+  ASSERT_LT(0, b.merge(&a, &delta, 3));
+  EXPECT_EQ(3, b.getAddress(big + delta)[(8 << 20) - 1]);
+  // Different size classes.
+  AnonMempool other;
+  ASSERT_EQ(0, other.init("other", MFILE_MODE_WRITE));
+  Arena c;
+  ASSERT_EQ(0, c.init(&other, 64));
+  EXPECT_EQ(-1, c.merge(&a, &delta));
+
+  // Segments src's delay queue grew by come over as free blocks.
+  use_delay_queue = true;
+  AnonMempool queuedPool;
+  ASSERT_EQ(0, queuedPool.init("queued", MFILE_MODE_WRITE));
+  Arena queued;
+  ASSERT_EQ(0, queued.init(&queuedPool));
+  std::vector<int64_t> pending;
+  for (uint32_t i = 0; i < 2 * kDelayQueueSegmentSize + 1; i++) {
+    pending.push_back(queued.alloc(100));
+  }
+  for (size_t i = 0; i < pending.size(); i++) {
+    ASSERT_EQ(0, queued.free(pending[i]));
+  }
+  std::vector<int64_t> segments;
+  reinterpret_cast<DelayQueue*>
+    (queuedPool.getAddress(queued.delay_queue_offset_))
+    ->getSegments(&queuedPool, &segments);
+  ASSERT_EQ(3U, segments.size());
+  ASSERT_EQ(0, b.getStats(&before));
+  ASSERT_LT(0, b.merge(&queued, &delta));
+  ASSERT_EQ(0, b.getStats(&after));
+  int64_t freeBefore = 0;
+  int64_t freeAfter = 0;
+  for (size_t i = 0; i < after.classes.size(); i++) {
+    freeBefore += before.classes[i].free_blocks;
+    freeAfter += after.classes[i].free_blocks;
+  }
+  EXPECT_EQ(freeBefore + 2, freeAfter);
+  EXPECT_EQ(before.delay_blocks + static_cast<int64_t>(pending.size()),
+            after.delay_blocks);
+}
+
+struct ScanResult {
+  Arena* arena;
+  std::mutex mutex;
+  std::set<int64_t> keys;
+  int64_t mismatches;
+};
+
+void collectBlock(int64_t key, char* data, uint32_t size, void* arg) {
+  ScanResult* result = reinterpret_cast<ScanResult*>(arg);
+  std::lock_guard<std::mutex> guard(result->mutex);
+  if (data != result->arena->getAddress(key)
+      || size != result->arena->getSize(key)
+      || !result->keys.insert(key).second) {
+    result->mismatches++;
+  }
+}
+
+TEST_F(ArenaWriteTest, scanVisitsLiveBlocks) {
+  unlink("testArenaLive.map");
+  unlink("testArenaLive.map.header");
+  EXPECT_EQ(-1, arena_->scan(&collectBlock, NULL));
+  ASSERT_EQ(0, arena_->openLiveMap("testArenaLive.map"));
+  // The side file grows with the arena, not by the pool's default step.
+  struct stat st;
+  ASSERT_EQ(0, stat("testArenaLive.map", &st));
+  EXPECT_GE(2 << 20, st.st_size);
+  arena_->set_slab_max_size(64);
+  std::set<int64_t> live;
+  std::vector<int64_t> keys;
+  for (int i = 0; i < 600; i++) {
+    // Small, medium and a few blocks spanning several regions.
+    uint32_t size = i % 3 == 0 ? 40 : (i % 50 == 1 ? (3 << 20) : 100 + i * 7);
+    keys.push_back(arena_->alloc(size));
+    ASSERT_NE(-1, keys.back());
+  }
+  ASSERT_EQ(0, arena_->free(keys[0]));
+  ASSERT_EQ(0, arena_->free(keys[1]));
+  use_delay_queue = false;
+  for (int i = 2; i < 600; i += 5) {
+    ASSERT_EQ(0, arena_->free(keys[i]));
+    keys[i] = -1;
+  }
+  keys[0] = keys[1] = -1;
+  // Splits off a remainder that goes to the free lists.
+  keys[4] = arena_->realloc(keys[4], 30);
+  // Reuses freed blocks.
+  keys.push_back(arena_->alloc(40));
+  keys.push_back(arena_->alloc(arena_->getSize(keys[3])));
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (keys[i] != -1) {
+      live.insert(keys[i]);
+    }
+  }
+
+  ScanResult result;
+  result.arena = arena_;
+  result.mismatches = 0;
+  EXPECT_EQ(static_cast<int64_t>(live.size()),
+            arena_->scan(&collectBlock, &result, 4));
+  EXPECT_EQ(0, result.mismatches);
+  EXPECT_TRUE(live == result.keys);
+
+  // A map written back with the pool is used as is, a rebuild agrees.
+  ASSERT_EQ(0, arena_->dump());
+  ASSERT_EQ(0, arena_->openLiveMap("testArenaLive.map"));
+  EXPECT_EQ(1, arena_->live_map_->header_->clean);
+  result.keys.clear();
+  EXPECT_EQ(static_cast<int64_t>(live.size()),
+            arena_->scan(&collectBlock, &result, 3));
+  EXPECT_TRUE(live == result.keys);
+  ASSERT_EQ(0, arena_->rebuildLiveMap());
+  result.keys.clear();
+  EXPECT_EQ(static_cast<int64_t>(live.size()),
+            arena_->scan(&collectBlock, &result, 2));
+  EXPECT_TRUE(live == result.keys);
+  EXPECT_EQ(0, result.mismatches);
+  unlink("testArenaLive.map");
+  unlink("testArenaLive.map.header");
+}
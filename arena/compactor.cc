@@ -0,0 +1,299 @@
+#include <string.h>
+#include <algorithm>
+
+#include "arena/arena.h"
+#include "arena/compactor.h"
+
+namespace base {
+
+extern bool use_delay_queue;
+
+namespace {
+
+struct BlockLess {
+    template <typename Block>
+    bool operator()(const Block& block, int64_t offset) const {
+        return block.offset < offset;
+    }
+};
+
+}  // namespace
+
+Compactor::Compactor(Arena* arena)
+    : arena_(arena),
+      heat_func_(NULL),
+      heat_arg_(NULL),
+      hot_threshold_(0),
+      active_(false),
+      end_(0),
+      tail_(-1) {
+}
+
+Compactor::~Compactor() {
+    if (active_) {
+        finish();
+    }
+}
+
+void Compactor::set_heat_func(HeatFunc func, void* arg,
+                              uint32_t hot_threshold) {
+    heat_func_ = func;
+    heat_arg_ = arg;
+    hot_threshold_ = hot_threshold;
+}
+
+int32_t Compactor::begin() {
+    if (active_ || arena_->compactor_ != NULL) {
+        return -1;
+    }
+    arena_->flushThreadCaches();
+    Arena::LockGuard guard(arena_);
+    Mempool* pool = arena_->pool_;
+
+    // Walk every block between the header and the tail, stepping over
+    // space the pool left unallocated.
+    blocks_.clear();
+    end_ = pool->getUsedSize();
+    int64_t offset = pool->skipUnallocated(arena_->header_size_);
+    while (offset + static_cast<int64_t>(sizeof(uint32_t)) <= end_) {
+        uint32_t* prefix = reinterpret_cast<uint32_t*>
+          (pool->getAddress(offset));
+        Block block = {offset, 0, BLOCK_LIVE, -1};
+        int64_t length = 0;
+        if (prefix[0] == kInternalBlockMark
+            || prefix[0] == kDeadSpanMark) {
+            block.state = BLOCK_PINNED;
+            length = 2 * sizeof(uint32_t) + prefix[1];
+        } else if (prefix[0] == 0) {
+            // Space reserved but not written yet, nothing is found past it.
+            break;
+        } else {
+            block.level = arena_->blockLevel(offset);
+            length = sizeof(uint32_t) + prefix[0];
+        }
+        blocks_.push_back(block);
+        offset = pool->skipUnallocated(offset + length);
+    }
+    end_ = offset;
+
+    // Take over the free lists.
+    holes_.assign(arena_->level_, std::set<int64_t>());
+    int64_t* freeList = reinterpret_cast<int64_t*>
+      (pool->getAddress(arena_->free_list_offset_));
+    for (uint32_t level = 0; level < arena_->level_; level++) {
+        for (int64_t key = freeList[level]; key != -1;
+             key = *reinterpret_cast<int64_t*>(arena_->getAddress(key))) {
+            int64_t i = find(key);
+            if (i == -1) {
+                break;
+            }
+            blocks_[i].state = BLOCK_FREE;
+            holes_[level].insert(key);
+        }
+        freeList[level] = -1;
+        arena_->classCounters()[level].free_blocks = 0;
+        arena_->classCounters()[level].free_bytes = 0;
+    }
+    memset(pool->getAddress(arena_->free_bitmap_offset_), 0,
+           sizeof(uint64_t) * ((arena_->level_ + 63) / 64));
+
+    DelayQueue* delayQueue = reinterpret_cast<DelayQueue*>
+      (pool->getAddress(arena_->delay_queue_offset_));
+    DelayQueue::Cursor cursor = delayQueue->begin();
+    for (DelayNode* node = delayQueue->next(&cursor, pool); node != NULL;
+         node = delayQueue->next(&cursor, pool)) {
+        retire(node->key);
+    }
+
+    tail_ = static_cast<int64_t>(blocks_.size()) - 1;
+    active_ = true;
+    arena_->compactor_ = this;
+    return 0;
+}
+
+int32_t Compactor::step(uint32_t max_moves,
+                        std::vector<Relocation>* relocations) {
+    if (!active_) {
+        return -1;
+    }
+    Arena::LockGuard guard(arena_);
+    uint32_t moves = 0;
+    while (tail_ >= 0 && moves < max_moves) {
+        // Pinned blocks stay, finish() cuts the pool past the last of them.
+        if (blocks_[tail_].state != BLOCK_LIVE) {
+            tail_--;
+            continue;
+        }
+        uint32_t size = arena_->getSize(blocks_[tail_].offset);
+        int64_t hole = takeHole(blocks_[tail_].level, blocks_[tail_].offset,
+                                size);
+        if (hole == -1) {
+            tail_--;
+            continue;
+        }
+        Block& block = blocks_[tail_];
+        arena_->markDirty(hole);
+        memcpy(arena_->getAddress(hole), arena_->getAddress(block.offset),
+               size);
+        ClassCounters* counter = arena_->classCounters();
+        uint32_t holeLevel = arena_->blockLevel(hole);
+        int64_t requested = arena_->requestedShare(block.level, size);
+        counter[block.level].live_blocks--;
+        counter[block.level].live_bytes -= size;
+        counter[block.level].requested_estimate -= requested;
+        counter[holeLevel].live_blocks++;
+        counter[holeLevel].live_bytes += arena_->getSize(hole);
+        counter[holeLevel].requested_estimate += requested;
+        arena_->markLive(hole, true);
+        arena_->markLive(block.offset, false);
+        Relocation relocation = {block.offset, hole};
+        relocations->push_back(relocation);
+        // A block is moved at most once, the sweep steps over it.
+        blocks_[find(hole)].state = BLOCK_PINNED;
+        block.state = BLOCK_MOVED;
+        block.moved_to = hole;
+        tail_--;
+        moves++;
+    }
+    return tail_ >= 0 ? 1 : 0;
+}
+
+int64_t Compactor::finish() {
+    if (!active_) {
+        return 0;
+    }
+    Arena::LockGuard guard(arena_);
+    // Everything past the last block still in use goes.
+    size_t last = blocks_.size();
+    while (last > 0 && (blocks_[last - 1].state == BLOCK_FREE
+                        || blocks_[last - 1].state == BLOCK_MOVED)) {
+        last--;
+    }
+    int64_t frontier = last < blocks_.size() ? blocks_[last].offset : end_;
+
+    int64_t released = 0;
+    if (frontier < end_ && arena_->shrinkPool(end_, frontier) == 0) {
+        released = end_ - frontier;
+    } else {
+        frontier = end_;
+    }
+    for (size_t i = 0; i < blocks_.size() && blocks_[i].offset < frontier;
+         i++) {
+        if (blocks_[i].state == BLOCK_FREE || blocks_[i].state == BLOCK_MOVED) {
+            arena_->pushFreeList(blocks_[i].offset, blocks_[i].level);
+        }
+    }
+    arena_->use_free_list_ = true;
+
+    blocks_.clear();
+    holes_.clear();
+    active_ = false;
+    arena_->compactor_ = NULL;
+    return released;
+}
+
+bool Compactor::retire(int64_t key) {
+    int64_t i = find(key);
+    if (i == -1) {
+        return false;
+    }
+    Block& block = blocks_[i];
+    if (block.state == BLOCK_LIVE) {
+        block.state = BLOCK_PINNED;
+    }
+    if (block.state != BLOCK_MOVED) {
+        return false;
+    }
+    int64_t copy = block.moved_to;
+    if (copy != -1) {
+        block.moved_to = -1;
+        // The caller books key's size as freed, the copy's is what step()
+        // counted.
+        uint32_t level = arena_->blockLevel(copy);
+        ClassCounters* counter = arena_->classCounters();
+        int64_t requested = arena_->requestedShare(level,
+                                                   arena_->getSize(copy));
+        counter[level].live_blocks--;
+        counter[level].live_bytes -= arena_->getSize(copy);
+        counter[level].requested_estimate -= requested;
+        counter[block.level].live_blocks++;
+        counter[block.level].live_bytes += arena_->getSize(key);
+        counter[block.level].requested_estimate += requested;
+        if (use_delay_queue) {
+            arena_->delayFree(copy, level, arena_->retireStamp());
+        } else {
+            arena_->pushFreeList(copy, level);
+        }
+    }
+    return true;
+}
+
+int64_t Compactor::find(int64_t offset) {
+    std::vector<Block>::iterator it = std::lower_bound(
+        blocks_.begin(), blocks_.end(), offset, BlockLess());
+    if (it == blocks_.end() || it->offset != offset) {
+        return -1;
+    }
+    return it - blocks_.begin();
+}
+
+int64_t Compactor::takeHole(uint32_t level, int64_t offset, uint32_t size) {
+    bool cold = heat_func_ != NULL
+        && heat_func_(offset, heat_arg_) < hot_threshold_;
+    // Blocks listed under level may be shorter than a block of that level
+    // that is not a class size, the next level always fits.
+    for (uint32_t i = level; i <= level + 1 && i < holes_.size(); i++) {
+        std::set<int64_t>& holes = holes_[i];
+        if (holes.empty() || *holes.begin() >= offset) {
+            continue;
+        }
+        std::set<int64_t>::iterator it = holes.begin();
+        if (cold) {
+            // Cold blocks stay as close to where they were as possible.
+            it = holes.lower_bound(offset);
+            --it;
+        }
+        if (arena_->getSize(*it) < size) {
+            continue;
+        }
+        int64_t hole = *it;
+        holes.erase(it);
+        return hole;
+    }
+
+    // Failing that, split the best placed larger hole.  Any of them holds
+    // a block of the next level.
+    int64_t best = -1;
+    uint32_t bestLevel = 0;
+    for (uint32_t i = level + 2; i < holes_.size(); i++) {
+        std::set<int64_t>& holes = holes_[i];
+        if (holes.empty() || *holes.begin() >= offset) {
+            continue;
+        }
+        int64_t hole = cold ? *--holes.lower_bound(offset) : *holes.begin();
+        if (best == -1 || (cold ? hole > best : hole < best)) {
+            best = hole;
+            bestLevel = i;
+        }
+    }
+    if (best == -1) {
+        return -1;
+    }
+    holes_[bestLevel].erase(best);
+    uint32_t realSize = size;
+    arena_->getLevel(realSize);
+    int64_t rest = arena_->splitBlock(best, arena_->getSize(best), realSize);
+    if (rest != -1) {
+        uint32_t restLevel = arena_->blockLevel(rest);
+        Block block = {rest, restLevel, BLOCK_FREE, -1};
+        std::vector<Block>::iterator it = std::lower_bound(
+            blocks_.begin(), blocks_.end(), rest, BlockLess());
+        // rest lies below the block being moved.
+        blocks_.insert(it, block);
+        tail_++;
+        holes_[restLevel].insert(rest);
+    }
+    return best;
+}
+
+}  // namespace base
@@ -0,0 +1,108 @@
+#ifndef BASE_COMPACTOR_H_
+#define BASE_COMPACTOR_H_
+
+#include <stdint.h>
+#include <set>
+#include <vector>
+
+namespace base {
+
+class Arena;
+
+struct Relocation {
+  int64_t old_key;
+  int64_t new_key;
+};
+
+// Incremental compaction of an Arena.  Live blocks are moved from the tail
+// of the pool into free blocks lower in the file, of the same size class or
+// split off a larger one, then the evacuated tail is cut off.  Blocks that
+// cannot move (internal ones such as slab chunks, delayed ones, ones freed
+// during the session) are stepped over; the pool is only cut past the last
+// of them.
+//
+//   Compactor compactor(&arena);
+//   compactor.begin();
+//   std::vector<Relocation> relocations;
+//   while (compactor.step(1024, &relocations) > 0) {
+//     // point the index at relocations[i].new_key
+//   }
+//   compactor.finish();
+//
+// begin() has to run while no other thread uses the arena.  step() and
+// finish() take the arena lock and may run next to other users, who keep
+// reading moved blocks through their old keys until they switch over; the
+// old copies are only released by finish().  step() has already copied a
+// moved block, so writes through its old key are lost.  Freeing a moved
+// block by its old key frees the new copy.  Free lists belong to the
+// compactor during the session, so the pool grows for allocations made
+// meanwhile.  A crash in the middle of a session leaks those free blocks.
+class Compactor {
+ public:
+  // Access heat of the block at key, used to place hot blocks first.
+  typedef uint32_t (*HeatFunc)(int64_t key, void* arg);
+
+  explicit Compactor(Arena* arena);
+
+  ~Compactor();
+
+  // Blocks whose heat reaches hot_threshold go to the lowest free block,
+  // colder ones to the highest free block below them, so that hot data ends
+  // up packed at the head of the file.
+  void set_heat_func(HeatFunc func, void* arg, uint32_t hot_threshold);
+
+  int32_t begin();
+
+  // Moves up to max_moves blocks and appends their new keys to relocations.
+  // Returns 1 while more can be moved, 0 once done, -1 on error.
+  int32_t step(uint32_t max_moves, std::vector<Relocation>* relocations);
+
+  // Returns the unused free blocks and drops the evacuated tail, truncating
+  // the pool if nothing was allocated past it.  Returns the number of bytes
+  // cut from the pool.
+  int64_t finish();
+
+  // Called by Arena, under its lock, for every key freed during the
+  // session.  Returns true when key is the old copy of a moved block: the
+  // new copy is freed instead and finish() releases the old one, so the
+  // caller must not.
+  bool retire(int64_t key);
+
+ private:
+  enum BlockState {
+    BLOCK_LIVE = 0,
+    BLOCK_FREE,      // in a free list when the session began
+    BLOCK_PINNED,    // internal, in the delay queue or freed since begin
+    BLOCK_MOVED
+  };
+
+  struct Block {
+    int64_t offset;
+    uint32_t level;
+    uint8_t state;
+    int64_t moved_to;  // new key of a BLOCK_MOVED block, -1 once freed
+  };
+
+  // Index of the block starting at offset, -1 if there is none.
+  int64_t find(int64_t offset);
+
+  // Picks the destination for the live block of size bytes at offset, -1
+  // if none.  Splitting a larger hole lists the rest in blocks_, shifting
+  // the blocks after it.
+  int64_t takeHole(uint32_t level, int64_t offset, uint32_t size);
+
+  Arena* arena_;
+  HeatFunc heat_func_;
+  void* heat_arg_;
+  uint32_t hot_threshold_;
+
+  bool active_;
+  int64_t end_;
+  int64_t tail_;  // blocks_[tail_ + 1 ..] are free or moved
+  std::vector<Block> blocks_;
+  std::vector<std::set<int64_t> > holes_;  // per level, free block offsets
+};
+
+}  // namespace base
+
+#endif  // BASE_COMPACTOR_H_
@@ -1,5 +1,8 @@
 
+#include <stddef.h>
+#include <vector>
 #include "arena/mempool.h"
+#include "arena/redo_log.h"
 
 #ifndef BASE_DELAY_QUEUE_H_
 #define BASE_DELAY_QUEUE_H_
@@ -12,62 +15,149 @@ struct DelayNode {
   int64_t time;
 };
 
+// Nodes per delay queue segment.  The first segment is embedded in the arena
+// header, further ones are internal blocks linked behind it.
+const uint32_t kDelayQueueSegmentSize = 4096;
+
+struct DelaySegment {
+  int64_t next;  // offset of the following segment, -1 at the tail
+  DelayNode nodes[kDelayQueueSegmentSize];
+};
+
+// FIFO of pending frees over a chain of fixed segments.  Growing links a
+// segment at the tail, segments drained at the head go to a free list for
+// the next growth; pending nodes never move.
 class DelayQueue {
  public:
-  DelayQueue(uint32_t size, int64_t array_offset) {
-    size_ = size > 2 ? size : 2;
-    used_ = 0;
+  // Walks the pending nodes from the front.
+  struct Cursor {
+    int64_t segment;
+    uint32_t index;
+    uint32_t remaining;
+  };
+
+  explicit DelayQueue(int64_t segment_offset) {
+    head_ = segment_offset;
+    tail_ = segment_offset;
     front_ = 0;
-    rear_ = 1;
-    array_offset_ = array_offset;
+    rear_ = 0;
+    used_ = 0;
+    segments_ = 1;
+    free_segments_ = -1;
   }
 
   ~DelayQueue() {}
 
-  int32_t push(const DelayNode &node, Mempool* pool) {
-    DelayNode* pArray =
-      reinterpret_cast<DelayNode*>(pool->getAddress(array_offset_));
-    if (!full()) {
-      pArray[rear_] = node;
-      rear_ = (rear_ + 1) % size_;
-      used_++;
-      return 0;
+  // log, when given, is told about every byte written to the pool.
+  int32_t push(const DelayNode &node, Mempool* pool, RedoLog* log = NULL) {
+    if (rear_ == kDelayQueueSegmentSize) {
+      if (free_segments_ == -1) {
+        return -1;
+      }
+      int64_t offset = free_segments_;
+      free_segments_ = segment(offset, pool)->next;
+      touch(offset, sizeof(int64_t), pool, log);
+      touch(tail_, sizeof(int64_t), pool, log);
+      segment(offset, pool)->next = -1;
+      segment(tail_, pool)->next = offset;
+      tail_ = offset;
+      rear_ = 0;
     }
-    return -1;
+    touch(tail_ + offsetof(DelaySegment, nodes) + rear_ * sizeof(DelayNode),
+          sizeof(DelayNode), pool, log);
+    segment(tail_, pool)->nodes[rear_] = node;
+    rear_++;
+    used_++;
+    return 0;
   }
 
-  int32_t pop() {
-    if (!empty()) {
-      front_ = (front_ + 1) % size_;
-      used_--;
-      return 0;
+  int32_t pop(Mempool* pool, RedoLog* log = NULL) {
+    if (empty()) {
+      return -1;
     }
-    return -1;
+    front_++;
+    used_--;
+    if (head_ == tail_) {
+      if (used_ == 0) {
+        front_ = 0;
+        rear_ = 0;
+      }
+    } else if (front_ == kDelayQueueSegmentSize) {
+      int64_t drained = head_;
+      head_ = segment(drained, pool)->next;
+      front_ = 0;
+      touch(drained, sizeof(int64_t), pool, log);
+      segment(drained, pool)->next = free_segments_;
+      free_segments_ = drained;
+    }
+    return 0;
   }
 
   DelayNode* front(Mempool* pool) {
     if (!empty()) {
-      DelayNode* pArray =
-        reinterpret_cast<DelayNode*>(pool->getAddress(array_offset_));
-      return pArray + ((front_ + 1) % size_);
+      return segment(head_, pool)->nodes + front_;
     }
     return NULL;
   }
 
+  Cursor begin() {
+    Cursor cursor = {head_, front_, used_};
+    return cursor;
+  }
+
+  // Returns the node under cursor and moves past it, NULL at the end.
+  DelayNode* next(Cursor* cursor, Mempool* pool) {
+    if (cursor->remaining == 0) {
+      return NULL;
+    }
+    if (cursor->index == kDelayQueueSegmentSize) {
+      cursor->segment = segment(cursor->segment, pool)->next;
+      cursor->index = 0;
+    }
+    cursor->remaining--;
+    return segment(cursor->segment, pool)->nodes + cursor->index++;
+  }
+
   bool empty() {
     return used_ == 0;
   }
 
+  // No room left without linking a new segment.
   bool full() {
-    return used_ == size_;
+    return rear_ == kDelayQueueSegmentSize && free_segments_ == -1;
+  }
+
+  // Hands a fresh segment to the queue.
+  void addSegment(int64_t offset, Mempool* pool, RedoLog* log = NULL) {
+    touch(offset, sizeof(int64_t), pool, log);
+    segment(offset, pool)->next = free_segments_;
+    free_segments_ = offset;
+    segments_++;
+  }
+
+  // Appends the offset of every segment, linked or free, to segments.
+  void getSegments(Mempool* pool, std::vector<int64_t>* segments) {
+    for (int64_t offset = head_; offset != -1;
+         offset = segment(offset, pool)->next) {
+      segments->push_back(offset);
+    }
+    for (int64_t offset = free_segments_; offset != -1;
+         offset = segment(offset, pool)->next) {
+      segments->push_back(offset);
+    }
   }
 
-  void setArrayOffset(int64_t array_offset) {
-    array_offset_ = array_offset;
+  // Segments whose next pointer push, pop or addSegment may rewrite: the
+  // head, the tail and the first free one, -1 where there is none.
+  void getLinks(int64_t* links) {
+    links[0] = head_;
+    links[1] = tail_;
+    links[2] = free_segments_;
   }
 
+  // Capacity over all segments, linked or free.
   uint32_t size() {
-    return size_;
+    return segments_ * kDelayQueueSegmentSize;
   }
 
   uint32_t usedSize() {
@@ -75,11 +165,25 @@ class DelayQueue {
   }
 
  private:
+  static void touch(int64_t offset, int64_t length, Mempool* pool,
+                    RedoLog* log) {
+    pool->markDirty(offset, length);
+    if (log != NULL) {
+      log->note(offset, length);
+    }
+  }
+
+  static DelaySegment* segment(int64_t offset, Mempool* pool) {
+    return reinterpret_cast<DelaySegment*>(pool->getAddress(offset));
+  }
+
+  int64_t head_;  // segment holding the front node
+  int64_t tail_;  // segment receiving pushes
   uint32_t front_;
   uint32_t rear_;
   uint32_t used_;
-  uint32_t size_;
-  int64_t array_offset_;
+  uint32_t segments_;
+  int64_t free_segments_;
 };
 
 }  // namespace base
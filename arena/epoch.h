@@ -0,0 +1,99 @@
+#ifndef BASE_EPOCH_H_
+#define BASE_EPOCH_H_
+
+#include <stdint.h>
+
+namespace base {
+
+// Quiescent-state based reclamation.  Readers register a slot and announce
+// the global epoch whenever they hold no reference into the arena.  A block
+// retired at epoch e may be reused once every registered reader has
+// announced an epoch after e.  Epochs are local to the process.
+class EpochManager {
+ public:
+  static const uint32_t kMaxReaders = 256;
+
+  EpochManager() : epoch_(1), readers_(0) {
+    for (uint32_t i = 0; i < kMaxReaders; i++) {
+      slots_[i].epoch = kIdle;
+    }
+  }
+
+  // Returns a reader id, or -1 when every slot is taken.
+  int32_t registerReader() {
+    for (uint32_t i = 0; i < kMaxReaders; i++) {
+      uint64_t idle = kIdle;
+      if (__atomic_compare_exchange_n(&slots_[i].epoch, &idle,
+            __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST), false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        uint32_t readers = __atomic_load_n(&readers_, __ATOMIC_RELAXED);
+        while (readers < i + 1
+               && !__atomic_compare_exchange_n(&readers_, &readers, i + 1,
+                    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void unregisterReader(int32_t reader) {
+    __atomic_store_n(&slots_[reader].epoch, kIdle, __ATOMIC_SEQ_CST);
+  }
+
+  // The reader holds no reference obtained before this call.
+  void quiescent(int32_t reader) {
+    __atomic_store_n(&slots_[reader].epoch,
+      __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  }
+
+  // The reader holds no reference until its next quiescent call, e.g.
+  // before it blocks.
+  void offline(int32_t reader) {
+    __atomic_store_n(&slots_[reader].epoch, kOffline, __ATOMIC_SEQ_CST);
+  }
+
+  uint64_t current() {
+    return __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST);
+  }
+
+  // Stamp of a block retired now.  Moves to a new epoch so that readers
+  // announcing from here on are known to be past the block.
+  uint64_t retire() {
+    return __atomic_fetch_add(&epoch_, 1, __ATOMIC_SEQ_CST);
+  }
+
+  // Oldest epoch a reader may still be in: blocks stamped before it are
+  // safe to reuse.
+  uint64_t safeEpoch() {
+    uint64_t safe = __atomic_load_n(&epoch_, __ATOMIC_SEQ_CST);
+    uint32_t readers = __atomic_load_n(&readers_, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < readers; i++) {
+      uint64_t epoch = __atomic_load_n(&slots_[i].epoch, __ATOMIC_SEQ_CST);
+      if (epoch < safe) {
+        safe = epoch;
+      }
+    }
+    return safe;
+  }
+
+ private:
+  static const uint64_t kIdle = ~0ULL;
+  static const uint64_t kOffline = ~0ULL - 1;
+
+  // One cache line per reader so announcing does not bounce other slots.
+  struct Slot {
+    uint64_t epoch;
+    char padding[56];
+  };
+
+  char padding_[64];
+  uint64_t epoch_;
+  uint32_t readers_;  // slots below this index have been used
+  char padding2_[52];
+  Slot slots_[kMaxReaders];
+};
+
+}  // namespace base
+
+#endif  // BASE_EPOCH_H_
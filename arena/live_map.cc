@@ -0,0 +1,209 @@
+#include <string.h>
+#include <algorithm>
+
+#include "arena/anon_mempool.h"
+#include "arena/live_map.h"
+#include "arena/mmap_mempool.h"
+
+namespace base {
+
+namespace {
+
+const uint32_t kLiveMapMagic = 0x4c564d31;  // "LVM1"
+
+// Least the side file grows by.
+const int64_t kLiveMapMinExpand = 1 << 20;
+
+}  // namespace
+
+LiveMap::LiveMap()
+    : pool_(NULL),
+      header_(NULL),
+      granularity_(0),
+      record_size_(0),
+      words_(0),
+      regions_(0),
+      valid_(false),
+      clean_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+LiveMap::~LiveMap() {
+  close();
+  pthread_mutex_destroy(&mutex_);
+}
+
+int32_t LiveMap::open(const char* path, uint32_t granularity,
+                      int64_t used_size) {
+  close();
+  if (granularity == 0 || (granularity & (granularity - 1)) != 0
+      || granularity * 64 > kLiveRegionSize) {
+    return -1;
+  }
+  MMapMempool* pool = path == NULL ? new AnonMempool : new MMapMempool;
+  if (pool->init(path == NULL ? "live map" : path, MFILE_MODE_WRITE) != 0) {
+    delete pool;
+    return -1;
+  }
+  pool_ = pool;
+  granularity_ = granularity;
+  words_ = kLiveRegionSize / granularity / 64;
+  record_size_ = sizeof(int64_t) * (1 + words_);
+  // The pool's default step is sized for arenas, grow by about what the
+  // arena's used size takes instead.
+  pool_->setExpandSize(std::max(kLiveMapMinExpand,
+      static_cast<int64_t>(sizeof(Header))
+      + (used_size / kLiveRegionSize + 1) * record_size_));
+
+  int64_t size = pool_->getUsedSize();
+  header_ = reinterpret_cast<Header*>(pool_->getAddress(0));
+  if (size >= static_cast<int64_t>(sizeof(Header))
+      && header_->magic == kLiveMapMagic
+      && header_->granularity == granularity && header_->clean != 0
+      && header_->used_size == used_size) {
+    regions_ = (size - sizeof(Header)) / record_size_;
+    valid_ = true;
+    clean_ = true;
+    return 1;
+  }
+  reset();
+  return header_ == NULL ? -1 : 0;
+}
+
+void LiveMap::close() {
+  if (pool_ != NULL) {
+    pool_->close();
+    delete pool_;
+    pool_ = NULL;
+  }
+  header_ = NULL;
+  regions_ = 0;
+  valid_ = false;
+  clean_ = false;
+}
+
+void LiveMap::reset() {
+  pthread_mutex_lock(&mutex_);
+  pool_->reset();
+  if (pool_->alloc(sizeof(Header)) != 0) {
+    header_ = NULL;
+    valid_ = false;
+  } else {
+    header_ = reinterpret_cast<Header*>(pool_->getAddress(0));
+    header_->magic = kLiveMapMagic;
+    header_->granularity = granularity_;
+    header_->used_size = 0;
+    header_->clean = 0;
+    valid_ = true;
+  }
+  regions_ = 0;
+  clean_ = false;
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool LiveMap::reserve(int64_t region) {
+  if (region < __atomic_load_n(&regions_, __ATOMIC_ACQUIRE)) {
+    return true;
+  }
+  bool ok = true;
+  pthread_mutex_lock(&mutex_);
+  while (ok && regions_ <= region) {
+    // Records are the only thing allocated after the header, so they are
+    // laid out by region.
+    int64_t offset = pool_->alloc(record_size_);
+    if (offset == -1) {
+      __atomic_store_n(&valid_, false, __ATOMIC_RELEASE);
+      ok = false;
+      break;
+    }
+    int64_t* fresh = reinterpret_cast<int64_t*>(pool_->getAddress(offset));
+    fresh[0] = -1;
+    memset(fresh + 1, 0, sizeof(int64_t) * words_);
+    __atomic_store_n(&regions_, regions_ + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return ok;
+}
+
+int64_t* LiveMap::record(int64_t region) {
+  return reinterpret_cast<int64_t*>(
+      pool_->getAddress(sizeof(Header) + region * record_size_));
+}
+
+void LiveMap::touch() {
+  if (__atomic_load_n(&clean_, __ATOMIC_RELAXED)
+      && __atomic_exchange_n(&clean_, false, __ATOMIC_ACQ_REL)) {
+    header_->clean = 0;
+  }
+}
+
+void LiveMap::noteStart(int64_t offset) {
+  int64_t region = offset / kLiveRegionSize;
+  if (!reserve(region)) {
+    return;
+  }
+  touch();
+  int64_t* first = record(region);
+  int64_t current = __atomic_load_n(first, __ATOMIC_RELAXED);
+  while ((current == -1 || offset < current)
+         && !__atomic_compare_exchange_n(first, &current, offset, true,
+                                         __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED)) {
+  }
+}
+
+void LiveMap::dropStarts(int64_t end) {
+  int64_t regions = __atomic_load_n(&regions_, __ATOMIC_ACQUIRE);
+  touch();
+  for (int64_t region = end / kLiveRegionSize; region < regions; region++) {
+    int64_t* first = record(region);
+    if (*first >= end) {
+      *first = -1;
+    }
+  }
+}
+
+void LiveMap::setLive(int64_t offset, bool live) {
+  int64_t region = offset / kLiveRegionSize;
+  if (!reserve(region)) {
+    return;
+  }
+  touch();
+  int64_t bit = offset % kLiveRegionSize / granularity_;
+  uint64_t* word = reinterpret_cast<uint64_t*>(record(region) + 1) + bit / 64;
+  if (live) {
+    __atomic_fetch_or(word, 1ULL << (bit & 63), __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_and(word, ~(1ULL << (bit & 63)), __ATOMIC_RELAXED);
+  }
+}
+
+bool LiveMap::isLive(int64_t offset) {
+  int64_t region = offset / kLiveRegionSize;
+  if (region >= __atomic_load_n(&regions_, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  int64_t bit = offset % kLiveRegionSize / granularity_;
+  const uint64_t* word =
+      reinterpret_cast<uint64_t*>(record(region) + 1) + bit / 64;
+  return (__atomic_load_n(word, __ATOMIC_RELAXED) >> (bit & 63)) & 1;
+}
+
+int64_t LiveMap::firstStart(int64_t region) {
+  if (region >= __atomic_load_n(&regions_, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  return __atomic_load_n(record(region), __ATOMIC_ACQUIRE);
+}
+
+int32_t LiveMap::dump(int64_t used_size) {
+  if (header_ == NULL) {
+    return -1;
+  }
+  header_->used_size = used_size;
+  header_->clean = isValid() ? 1 : 0;
+  __atomic_store_n(&clean_, true, __ATOMIC_RELEASE);
+  return pool_->dump();
+}
+
+}  // namespace base
@@ -0,0 +1,90 @@
+#ifndef BASE_LIVE_MAP_H_
+#define BASE_LIVE_MAP_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "arena/mempool.h"
+
+namespace base {
+
+// Size of the regions LiveMap indexes, and the unit scans are split in.
+const int64_t kLiveRegionSize = 1LL << 20;
+
+// Side map of an arena's data region, kept in a pool of its own.  For
+// every kLiveRegionSize region of the arena's pool it records where the
+// first block starting in the region is, so the region can be walked
+// without walking everything in front of it, and one bit per granularity
+// bytes telling whether the block starting there is handed out.  Blocks
+// must be at least granularity bytes apart.
+//
+// Marking is thread safe and lock free once the map covers the region;
+// growing it takes a mutex.
+class LiveMap {
+ public:
+  LiveMap();
+  ~LiveMap();
+
+  // Opens or creates the map at path (plus path.header), or in memory when
+  // path is NULL.  granularity is a power of two.  Returns 1 when the map
+  // was written back by dump() for a pool of used_size and not changed
+  // since, 0 when it starts empty and has to be rebuilt, -1 on error.
+  int32_t open(const char* path, uint32_t granularity, int64_t used_size);
+
+  void close();
+
+  // Forgets every block.
+  void reset();
+
+  // Records a block starting at offset.
+  void noteStart(int64_t offset);
+
+  // Forgets the block starts at or past end, once the pool gave its tail
+  // back.
+  void dropStarts(int64_t end);
+
+  void setLive(int64_t offset, bool live);
+
+  bool isLive(int64_t offset);
+
+  // First block start in region, or -1 when no block starts in it.
+  int64_t firstStart(int64_t region);
+
+  // False once the map failed to grow and missed a change, until reset().
+  bool isValid() {
+    return __atomic_load_n(&valid_, __ATOMIC_ACQUIRE);
+  }
+
+  // Writes the map back as matching a pool of used_size.
+  int32_t dump(int64_t used_size);
+
+ private:
+  struct Header {
+    uint32_t magic;
+    uint32_t granularity;
+    int64_t used_size;
+    int64_t clean;  // set by dump(), cleared by the next change
+  };
+
+  // Makes the map cover region.  Returns false when the pool cannot grow.
+  bool reserve(int64_t region);
+
+  inline int64_t* record(int64_t region);
+
+  // Clears the clean flag dump() left behind.
+  inline void touch();
+
+  Mempool* pool_;
+  Header* header_;
+  uint32_t granularity_;
+  // Bytes per region: the first start, then the bitmap words.
+  int64_t record_size_;
+  int64_t words_;
+  int64_t regions_;
+  bool valid_;
+  bool clean_;
+  pthread_mutex_t mutex_;
+};
+
+}  // namespace base
+
+#endif  // BASE_LIVE_MAP_H_
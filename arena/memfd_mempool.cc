@@ -0,0 +1,100 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "arena/memfd_mempool.h"
+
+namespace base {
+
+MemfdMempool::MemfdMempool() {
+}
+
+MemfdMempool::~MemfdMempool() {
+  stopWarmUp();
+  stopGrowth();
+  waitSnapshot();
+  if (file_ != NULL) {
+    munmap(file_, data_offset_ + kMmapSize_);
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  fd_ = -1;
+  file_ = NULL;
+  header_file_ = NULL;
+  base_ = NULL;
+}
+
+int32_t MemfdMempool::init(const char* name, uint32_t mode) {
+  if (Mempool::init(name) != 0 || fd_ >= 0 || mode == MFILE_MODE_READ
+      || mode == MFILE_MODE_WRITE_SHARED) {
+    return -1;
+  }
+  fd_ = memfd_create(name, MFD_CLOEXEC);
+  if (fd_ < 0) {
+    return -1;
+  }
+  // A fresh memfd reads as zeros, which is an empty header.
+  data_offset_ = sysconf(_SC_PAGESIZE);
+  if (ftruncate(fd_, data_offset_) != 0 || mapFd() != 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return -1;
+  }
+  applyMapPolicy();
+  return 0;
+}
+
+int32_t MemfdMempool::attach(int32_t fd, uint32_t mode) {
+  if (fd_ >= 0 || mode == MFILE_MODE_WRITE_SHARED) {
+    return -1;
+  }
+  fd_ = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (fd_ < 0) {
+    return -1;
+  }
+  read_only_ = (MFILE_MODE_READ == mode);
+  data_offset_ = sysconf(_SC_PAGESIZE);
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || st.st_size < data_offset_ || mapFd() != 0
+      || header_file_->max_size > st.st_size - data_offset_
+      || header_file_->used_size > header_file_->max_size) {
+    if (file_ != NULL) {
+      munmap(file_, data_offset_ + kMmapSize_);
+    }
+    ::close(fd_);
+    fd_ = -1;
+    file_ = NULL;
+    header_file_ = NULL;
+    base_ = NULL;
+    return -1;
+  }
+  applyMapPolicy();
+  return 0;
+}
+
+int32_t MemfdMempool::mapFd() {
+  int prot = read_only_ ? PROT_READ : PROT_READ | PROT_WRITE;
+  void* addr = mmap(NULL, data_offset_ + kMmapSize_, prot, MAP_SHARED, fd_,
+                    0);
+  if (addr == MAP_FAILED) {
+    return -1;
+  }
+  file_ = reinterpret_cast<char*>(addr);
+  header_file_ = reinterpret_cast<MMapFileHeader*>(file_);
+  base_ = file_ + data_offset_;
+  return 0;
+}
+
+int32_t MemfdMempool::dump() {
+  return read_only_ ? -1 : 0;
+}
+
+int32_t MemfdMempool::growFile(const int64_t& offset,
+                               const int64_t& length) {
+  return ftruncate(fd_, data_offset_ + offset + length);
+}
+
+}  // namespace base
@@ -0,0 +1,44 @@
+#ifndef BASE_MEMFD_MEMPOOL_H_
+#define BASE_MEMFD_MEMPOOL_H_
+
+#include "arena/mmap_mempool.h"
+
+namespace base {
+
+// Mempool over a memfd, an unnamed tmpfs file: no path, no header side
+// file and no writeback, but its fd can be handed to another process (over
+// a unix socket, or inherited) and mapped there with attach().  The header
+// sits in the first page of the memfd.  The pages are shared but the
+// allocator is not, so one process writes at a time and others attach
+// read only.
+class MemfdMempool : public MMapMempool {
+ public:
+  using MMapMempool::init;
+
+  MemfdMempool();
+
+  ~MemfdMempool();
+
+  // Creates an empty pool in a new memfd.  name shows in /proc/<pid>/fd.
+  virtual int32_t init(const char* name, uint32_t mode);
+
+  // Maps the pool behind fd, which stays the caller's.
+  int32_t attach(int32_t fd, uint32_t mode);
+
+  int32_t getFd() {
+    return fd_;
+  }
+
+  virtual int32_t dump();
+
+ protected:
+  // Sizes the memfd without allocating its pages up front.
+  virtual int32_t growFile(const int64_t& offset, const int64_t& length);
+
+ private:
+  int32_t mapFd();
+};
+
+}  // namespace base
+
+#endif  // BASE_MEMFD_MEMPOOL_H_
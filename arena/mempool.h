@@ -5,9 +5,20 @@
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <vector>
 
 namespace base {
 
+// A concurrent pool that gives up a reservation others have already
+// reserved behind leaves this word at its start, then the length of the
+// rest as a uint32, so that walks over the blocks can step past it.
+const uint32_t kDeadSpanMark = 0xFFFFFFFE;
+
+struct DirtyRange {
+  int64_t offset;
+  int64_t length;
+};
+
 class Mempool {
  public:
   Mempool() {}
@@ -36,6 +47,123 @@ class Mempool {
     return;
   }
 
+  // Gives [new_end, end) back if end is still the used size.  Returns 0 on
+  // success, -1 if something was allocated past end meanwhile.
+  virtual int32_t shrink(const int64_t& end, const int64_t& new_end) {
+    return -1;
+  }
+
+  // Moves the used size from end to new_end if end is still the used size,
+  // growing a block at the tail in place.  Returns 0 on success.
+  virtual int32_t extend(const int64_t& end, const int64_t& new_end) {
+    return -1;
+  }
+
+  // Drops the backing memory of [offset, offset + length), which reads back
+  // as zeros afterwards.  Only whole pages inside the range are released.
+  virtual int32_t release(const int64_t& offset, const int64_t& length) {
+    return -1;
+  }
+
+  // Asks for [offset, offset + length) to stay resident, for metadata the
+  // allocator touches on every operation.  Returns 0 if it does.
+  virtual int32_t lockResident(const int64_t& offset, const int64_t& length) {
+    return -1;
+  }
+
+  // Records that [offset, offset + length) is about to change, for pools
+  // tracking dirty ranges.
+  virtual void markDirty(const int64_t& offset, const int64_t& length) {
+    return;
+  }
+
+  // Moves the ranges marked since the last call into ranges.  Returns -1
+  // when the pool does not track dirty ranges.
+  virtual int32_t takeDirty(std::vector<DirtyRange>* ranges) {
+    return -1;
+  }
+
+  // Writes ranges back to storage, split over threads.
+  virtual int32_t syncRanges(const std::vector<DirtyRange>& ranges,
+                             uint32_t threads) {
+    return -1;
+  }
+
+  // Starts writing an image of the pool as of now to path and its header,
+  // while the pool stays writable: ranges passed to markDirty afterwards
+  // are saved to the image before they change.  Returns -1 when the pool
+  // cannot, or a snapshot is already running.
+  virtual int32_t beginSnapshot(const char* path) {
+    return -1;
+  }
+
+  // Waits until the running snapshot is complete and durable.  Returns 0,
+  // or -1 when it failed or none was started.
+  virtual int32_t waitSnapshot() {
+    return -1;
+  }
+
+  // Sets the used size back to one recorded earlier, e.g. by a redo log,
+  // growing the pool when needed.
+  virtual int32_t restoreUsedSize(const int64_t& used_size) {
+    return -1;
+  }
+
+  // Copies [src_offset, src_offset + length) of src to offset without going
+  // through memory, file to file.  Both ranges must be allocated.  Returns
+  // -1 when either pool cannot.
+  virtual int32_t copyFrom(const int64_t& offset, Mempool* src,
+                           const int64_t& src_offset, const int64_t& length) {
+    return -1;
+  }
+
+  // Places the pool's pages by policy (a NumaPolicy) over the nodes in
+  // the mask nodes.  Returns -1 when the pool cannot.
+  virtual int32_t setNumaPolicy(uint32_t policy, uint64_t nodes) {
+    return -1;
+  }
+
+  // Returns offset, or where the next allocated byte is when offset falls
+  // into space the pool skipped over, for walking blocks from the start.
+  virtual int64_t skipUnallocated(const int64_t& offset) {
+    return offset;
+  }
+
+  // Bytes the pool can hold before it has to grow.
+  virtual int64_t getCapacity() {
+    return getUsedSize();
+  }
+
+  // Times the pool has grown since init.
+  virtual int64_t getExpandCount() {
+    return 0;
+  }
+
+  // Whether alloc may be called from several threads at once.
+  virtual bool isConcurrentAlloc() {
+    return false;
+  }
+
+  // Whether several processes may map and write the pool at once.
+  virtual bool isShared() {
+    return false;
+  }
+
+  // Whether no other process has the pool attached.  Only meaningful
+  // between lockInit and unlockInit.
+  virtual bool isSoleOwner() {
+    return true;
+  }
+
+  // Serializes setting up the pool's contents across processes.
+  virtual int32_t lockInit() {
+    return 0;
+  }
+
+  virtual void unlockInit() {
+    return;
+  }
+
   const char* getFileName() {
       return file_name_;
   }
@@ -1,22 +1,46 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <algorithm>
 #include <iostream>
 
 #include "arena/mmap_mempool.h"
+#include "arena/numa.h"
 
 using namespace std;
 
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
 namespace base {
 
+namespace {
+
+// Bytes of the data file carrying the OFD record locks of shared pools:
+// growing the file is serialized on the first, every attached process
+// holds a read lock on the second.
+const off_t kExpandByte = 0;
+const off_t kAttachByte = 1;
+
+}  // namespace
+
 const int64_t MMapMempool::_NULL = -1L;
+const int64_t MMapMempool::kDirtyChunkSize = 64 * 1024;
+const int64_t MMapMempool::kHeatChunkSize = 2 * 1024 * 1024;
+const int64_t MMapMempool::kHeatSampleChunks = 64;
 const int64_t MMapMempool::kMmapSize_ = (64L * 1024 * 1024 * 1024);  // 64G
 const int64_t MMapMempool::kMaxMempoolSize_ = MMapMempool::kMmapSize_;
 
@@ -26,16 +50,70 @@ MMapMempool::MMapMempool()
       file_(NULL),
       header_file_(NULL),
       base_(NULL),
+      data_offset_(0),
       read_only_(false),
-      expand_size_(1*1024*1024*1024) {
+      expand_size_(1*1024*1024*1024),
+      expand_count_(0),
+      map_policy_(MMAP_POLICY_NONE),
+      numa_policy_(NUMA_POLICY_DEFAULT),
+      numa_nodes_(0),
+      headroom_(0),
+      growth_running_(false),
+      growth_stop_(false),
+      growth_wanted_(false),
+      dirty_(NULL),
+      snap_end_(0),
+      snap_fd_(-1),
+      snap_state_(NULL),
+      snap_running_(false),
+      snap_ret_(0),
+      warm_running_(false),
+      warm_stop_(false),
+      heat_cursor_(0),
+      concurrent_(false),
+      shared_(false) {
+  pthread_mutex_init(&expand_mutex_, NULL);
+  pthread_mutex_init(&growth_mutex_, NULL);
+  pthread_cond_init(&growth_cond_, NULL);
 }
 
 MMapMempool::~MMapMempool() {
+  stopWarmUp();
+  stopGrowth();
+  waitSnapshot();
+  delete[] snap_state_;
+  pthread_cond_destroy(&growth_cond_);
+  pthread_mutex_destroy(&growth_mutex_);
+  delete[] dirty_;
+  // Subclasses with mappings of their own have released them already.
+  // Pages left mapped could not be evicted from the page cache.
+  if (file_ != NULL) {
+    munmap(file_, kMmapSize_);
+  }
+  if (header_file_ != NULL) {
+    munmap(header_file_, sizeof(MMapFileHeader));
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  if (fd_header_ >= 0) {
+    ::close(fd_header_);
+  }
   fd_ = -1;
   fd_header_ = -1;
   file_ = NULL;
   header_file_ = NULL;
   base_ = NULL;
+  pthread_mutex_destroy(&expand_mutex_);
+}
+
+int32_t MMapMempool::init(const char* file_name, uint32_t mode,
+                          uint32_t policy) {
+  if ((policy & MMAP_POLICY_HEAT_MAP) && (policy & MMAP_POLICY_MLOCK)) {
+    return -1;
+  }
+  map_policy_ = policy;
+  return init(file_name, mode);
 }
 
 int32_t MMapMempool::init(const char* file_name, uint32_t mode) {
@@ -45,8 +123,19 @@ int32_t MMapMempool::init(const char* file_name, uint32_t mode) {
   }
 
   read_only_ = (MFILE_MODE_READ == mode);
+  shared_ = (MFILE_MODE_WRITE_SHARED == mode);
+  if (shared_) {
+    concurrent_ = true;
+  }
 
   do {
+    if (shared_) {
+      if (openShared() < 0) {
+        break;
+      }
+      applyMapPolicy();
+      return 0;
+    }
     ret = access(file_name_, F_OK);  // check for existence
     if (ret == 0) {  // file exists
       ret = access(header_file_name_, F_OK);  // check header file
@@ -63,6 +152,7 @@ int32_t MMapMempool::init(const char* file_name, uint32_t mode) {
     } else {
       break;
     }
+    applyMapPolicy();
     return 0;
   } while (0);
 
@@ -78,13 +168,22 @@ int32_t MMapMempool::init(const char* file_name, uint32_t mode) {
   return -1;
 }
 
+void MMapMempool::close() {
+  stopWarmUp();
+  stopGrowth();
+  waitSnapshot();
+}
+
 int32_t MMapMempool::dump() {
   if (read_only_) {
     return -1;
   }
-  if (header_file_) {
+  if (header_file_ && !concurrent_ && !growth_running_) {
     header_file_->max_size = header_file_->used_size;
   }
+  if (map_policy_ & MMAP_POLICY_HEAT_MAP) {
+    recordHeat();
+  }
   msync(file_, header_file_->used_size, MS_SYNC);
   msync(header_file_, sizeof(MMapFileHeader), MS_SYNC);
   return 0;
@@ -109,37 +208,401 @@ int64_t MMapMempool::alloc(const int64_t& size) {
     return _NULL;
   }
 
+  if (concurrent_) {
+    int64_t ret = __atomic_fetch_add(&header_file_->used_size, size,
+      __ATOMIC_RELAXED);
+    if (ret + size > __atomic_load_n(&header_file_->max_size,
+                                     __ATOMIC_ACQUIRE)
+        && expandTo(ret + size) < 0) {
+      // The file cannot grow any more.  Give the reservation back only if
+      // nobody reserved behind it; max_size may be stale by now, and
+      // pulling used_size down to it could hand a range out twice.
+      // Otherwise the blocks behind must still be found past it.
+      int64_t end = ret + size;
+      if (!__atomic_compare_exchange_n(&header_file_->used_size, &end, ret,
+                                       false, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED)) {
+        markDeadSpan(ret, size);
+      }
+      return _NULL;
+    }
+    checkHeadroom(ret + size);
+    return ret;
+  }
+
   if (header_file_->used_size + size > header_file_->max_size) {
-    if (expand(size) < 0) {
+    if (expandTo(header_file_->used_size + size) < 0) {
       return _NULL;
     }
   }
 
   int64_t ret = header_file_->used_size;
   header_file_->used_size += size;
+  checkHeadroom(ret + size);
   return ret;
 }
 
+void MMapMempool::markDeadSpan(const int64_t& offset, const int64_t& size) {
+  const int64_t header = 2 * sizeof(uint32_t);
+  if (size < header || size - header > UINT32_MAX) {
+    return;
+  }
+  // Reservations behind this one may still get the file to cover it.
+  if (offset + header > __atomic_load_n(&header_file_->max_size,
+                                        __ATOMIC_ACQUIRE)
+      && expandTo(offset + header) < 0) {
+    return;
+  }
+  uint32_t* span = reinterpret_cast<uint32_t*>(base_ + offset);
+  span[1] = size - header;
+  __atomic_store_n(&span[0], kDeadSpanMark, __ATOMIC_RELEASE);
+}
+
 char* MMapMempool::getAddressSafe(const int64_t& offset) {
   if (base_ != NULL
       && offset != _NULL
-      && offset < header_file_->used_size) {
+      && offset < getUsedSize()) {
     return base_ + offset;
   }
   return NULL;
 }
 
 char* MMapMempool::getAddress(const int64_t& offset, const int64_t& length) {
+  int64_t used_size = getUsedSize();
   if (base_ != NULL
       && offset != _NULL
-      && offset < header_file_->used_size
-      && offset + length <= header_file_->used_size
+      && offset < used_size
+      && offset + length <= used_size
       ) {
     return base_ + offset;
   }
   return NULL;
 }
 
+int32_t MMapMempool::shrink(const int64_t& end, const int64_t& new_end) {
+  if (read_only_ || new_end > end) {
+    return -1;
+  }
+  saveSnapshot(new_end, end - new_end);
+  int64_t expected = end;
+  if (!__atomic_compare_exchange_n(&header_file_->used_size, &expected,
+        new_end, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return -1;
+  }
+  if (!concurrent_ && !growth_running_ && end - new_end >= expand_size_) {
+    // Concurrent allocators may still be writing up to max_size, the file
+    // only shrinks when nobody else can reach it.  Small trims keep the
+    // size so that the next alloc does not have to grow the file again.
+    if (ftruncate(fd_, data_offset_ + new_end) == 0) {
+      header_file_->max_size = new_end;
+      return 0;
+    }
+  }
+  release(new_end, end - new_end);
+  return 0;
+}
+
+int32_t MMapMempool::extend(const int64_t& end, const int64_t& new_end) {
+  if (read_only_ || new_end < end || getUsedSize() != end) {
+    return -1;
+  }
+  if (new_end > __atomic_load_n(&header_file_->max_size, __ATOMIC_ACQUIRE)
+      && expandTo(new_end) < 0) {
+    return -1;
+  }
+  int64_t expected = end;
+  if (!__atomic_compare_exchange_n(&header_file_->used_size, &expected,
+        new_end, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return -1;
+  }
+  return 0;
+}
+
+int32_t MMapMempool::restoreUsedSize(const int64_t& used_size) {
+  if (read_only_ || base_ == NULL || used_size < 0) {
+    return -1;
+  }
+  if (used_size > __atomic_load_n(&header_file_->max_size, __ATOMIC_ACQUIRE)
+      && expandTo(used_size) < 0) {
+    return -1;
+  }
+  __atomic_store_n(&header_file_->used_size, used_size, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int32_t MMapMempool::release(const int64_t& offset, const int64_t& length) {
+  if (read_only_ || base_ == NULL) {
+    return -1;
+  }
+  saveSnapshot(offset, length);
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+  int64_t begin = (offset + page_size - 1) & ~(page_size - 1);
+  int64_t end = (offset + length) & ~(page_size - 1);
+  if (begin >= end) {
+    return 0;
+  }
+  if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                data_offset_ + begin, end - begin) == 0) {
+    return 0;
+  }
+  return madvise(base_ + begin, end - begin, MADV_REMOVE);
+}
+
+int32_t MMapMempool::lockResident(const int64_t& offset,
+                                  const int64_t& length) {
+  if (!(map_policy_ & MMAP_POLICY_MLOCK) || base_ == NULL) {
+    return -1;
+  }
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+  int64_t begin = offset & ~(page_size - 1);
+  return mlock(base_ + begin, offset + length - begin);
+}
+
+int32_t MMapMempool::setNumaPolicy(uint32_t policy, uint64_t nodes) {
+  if (policy > NUMA_POLICY_PREFERRED
+      || (policy != NUMA_POLICY_DEFAULT && nodes == 0)) {
+    return -1;
+  }
+  numa_policy_ = policy;
+  numa_nodes_ = nodes;
+  if (file_ == NULL) {
+    return 0;
+  }
+  return numaBind(file_, data_offset_ + kMmapSize_, policy, nodes);
+}
+
+int32_t MMapMempool::copyFrom(const int64_t& offset, Mempool* src,
+                              const int64_t& src_offset,
+                              const int64_t& length) {
+  MMapMempool* from = dynamic_cast<MMapMempool*>(src);
+  if (read_only_ || from == NULL || fd_ < 0 || from->fd_ < 0
+      || getAddress(offset, length) == NULL
+      || from->getAddress(src_offset, length) == NULL) {
+    return -1;
+  }
+  // Both files are mapped shared, the page cache they go through is what
+  // the mappings show.
+  loff_t in = from->data_offset_ + src_offset;
+  loff_t out = data_offset_ + offset;
+  for (int64_t left = length; left > 0;) {
+    ssize_t copied = copy_file_range(from->fd_, &in, fd_, &out, left, 0);
+    if (copied <= 0) {
+      return -1;
+    }
+    left -= copied;
+  }
+  return 0;
+}
+
+void MMapMempool::applyMapPolicy() {
+  if (numa_policy_ != NUMA_POLICY_DEFAULT) {
+    // Before anything below faults pages in.  Placement is advice, a
+    // kernel refusing it leaves the pool usable.
+    numaBind(file_, data_offset_ + kMmapSize_, numa_policy_, numa_nodes_);
+  }
+  if (map_policy_ & MMAP_POLICY_HUGEPAGE) {
+    // Fails with EINVAL where huge pages are not supported, which only
+    // costs the advice.
+    madvise(file_, kMmapSize_, MADV_HUGEPAGE);
+  }
+  if (map_policy_ & MMAP_POLICY_MLOCK) {
+    mlock(header_file_, sizeof(MMapFileHeader));
+  }
+  int64_t used_size = getUsedSize();
+  if ((map_policy_ & MMAP_POLICY_POPULATE) && used_size > 0) {
+    // Read faults only: write faults would dirty every page of a file
+    // mapping, to be written back in full at the next dump.
+    if (madvise(file_, used_size, MADV_POPULATE_READ) != 0) {
+      // Kernels before 5.14: read ahead and touch every page.
+      madvise(file_, used_size, MADV_WILLNEED);
+      const int64_t page_size = sysconf(_SC_PAGESIZE);
+      volatile char sink = 0;
+      for (int64_t offset = 0; offset < used_size; offset += page_size) {
+        sink += file_[offset];
+      }
+    }
+  }
+  if (map_policy_ & (MMAP_POLICY_HEAT_MAP | MMAP_POLICY_WARM_UP)) {
+    loadHeat();
+  }
+  // Pages mapped since init were touched since init, unless populated.
+  heat_armed_.assign((used_size + kHeatChunkSize - 1) / kHeatChunkSize,
+                     (map_policy_ & MMAP_POLICY_POPULATE) ? 0 : 1);
+  heat_cursor_ = 0;
+  if ((map_policy_ & MMAP_POLICY_WARM_UP) && !heat_.empty()) {
+    // The thread works from a copy, dump() updates heat_ meanwhile.
+    warm_heat_ = heat_;
+    warm_stop_ = false;
+    warm_running_ = pthread_create(&warm_thread_, NULL,
+                                   &MMapMempool::warmUpMain, this) == 0;
+  }
+}
+
+namespace {
+
+const uint32_t kHeatMagic = 0x54414548;  // "HEAT"
+
+struct HeatFileHeader {
+  uint32_t magic;
+  uint32_t chunk_size;
+  int64_t chunks;
+};
+
+// Chunks paged in with one call once their heat sorts them next to each
+// other.
+const int64_t kWarmUpRunChunks = 32;
+
+struct HotterChunk {
+  explicit HotterChunk(const std::vector<uint8_t>* heat) : heat_(heat) {}
+  bool operator()(int64_t a, int64_t b) const {
+    return (*heat_)[a] > (*heat_)[b]
+        || ((*heat_)[a] == (*heat_)[b] && a < b);
+  }
+  const std::vector<uint8_t>* heat_;
+};
+
+}  // namespace
+
+int32_t MMapMempool::recordHeat() {
+  if (base_ == NULL) {
+    return -1;
+  }
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+  int64_t used_size = getUsedSize();
+  int64_t chunks = (used_size + kHeatChunkSize - 1) / kHeatChunkSize;
+  heat_.resize(chunks, 0);
+  heat_armed_.resize(chunks, 1);
+  // Residency says nothing about access, pages stay cached long after the
+  // last touch.  Whether the page is mapped into this process does, for
+  // chunks unmapped since they were last read.
+  int32_t pagemap = open("/proc/self/pagemap", O_RDONLY);
+  if (pagemap < 0) {
+    return -1;
+  }
+  std::vector<uint64_t> entries(kHeatChunkSize / page_size);
+  for (int64_t i = 0; i < chunks; i++) {
+    if (!heat_armed_[i]) {
+      continue;
+    }
+    char* begin = base_ + i * kHeatChunkSize;
+    int64_t length = std::min(kHeatChunkSize, used_size - i * kHeatChunkSize);
+    int64_t pages = (length + page_size - 1) / page_size;
+    ssize_t bytes = pages * sizeof(uint64_t);
+    int64_t hot = 0;
+    if (pread(pagemap, &entries[0], bytes,
+              reinterpret_cast<uintptr_t>(begin) / page_size
+              * sizeof(uint64_t)) == bytes) {
+      for (int64_t page = 0; page < pages; page++) {
+        hot += entries[page] >> 63;
+      }
+    }
+    heat_[i] = heat_[i] / 2 + hot * 127 / pages;
+    heat_armed_[i] = 0;
+  }
+  ::close(pagemap);
+  // Shared mappings keep the data, the next touch maps the page back.
+  for (int64_t n = std::min(chunks, kHeatSampleChunks); n > 0; n--) {
+    if (heat_cursor_ >= chunks) {
+      heat_cursor_ = 0;
+    }
+    int64_t i = heat_cursor_++;
+    int64_t length = std::min(kHeatChunkSize, used_size - i * kHeatChunkSize);
+    int64_t pages = (length + page_size - 1) / page_size;
+    if (madvise(base_ + i * kHeatChunkSize, pages * page_size,
+                MADV_DONTNEED) == 0) {
+      heat_armed_[i] = 1;
+    }
+  }
+
+  std::string path = std::string(file_name_) + ".heat";
+  std::string tmp = path + ".tmp";
+  int32_t fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                    S_IRWXU | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    return -1;
+  }
+  HeatFileHeader header = {kHeatMagic, static_cast<uint32_t>(kHeatChunkSize),
+                           chunks};
+  bool written = write(fd, &header, sizeof(header))
+      == static_cast<ssize_t>(sizeof(header))
+      && (chunks == 0 || write(fd, &heat_[0], chunks) == chunks);
+  ::close(fd);
+  if (!written || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+void MMapMempool::loadHeat() {
+  heat_.clear();
+  std::string path = std::string(file_name_) + ".heat";
+  int32_t fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  HeatFileHeader header;
+  if (read(fd, &header, sizeof(header)) == sizeof(header)
+      && header.magic == kHeatMagic && header.chunk_size == kHeatChunkSize
+      && header.chunks >= 0 && header.chunks <= kMmapSize_ / kHeatChunkSize) {
+    heat_.resize(header.chunks);
+    if (header.chunks > 0 && read(fd, &heat_[0], header.chunks)
+        != header.chunks) {
+      heat_.clear();
+    }
+  }
+  ::close(fd);
+}
+
+void* MMapMempool::warmUpMain(void* data) {
+  MMapMempool* pool = reinterpret_cast<MMapMempool*>(data);
+  std::vector<int64_t> order;
+  for (size_t i = 0; i < pool->warm_heat_.size(); i++) {
+    if (pool->warm_heat_[i] != 0) {
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(), HotterChunk(&pool->warm_heat_));
+  int64_t used_size = pool->getUsedSize();
+  for (size_t i = 0; i < order.size()
+       && !__atomic_load_n(&pool->warm_stop_, __ATOMIC_RELAXED);) {
+    // Equally hot neighbours go in as one sequential run.
+    size_t end = i + 1;
+    while (end < order.size() && end - i < kWarmUpRunChunks
+           && order[end] == order[end - 1] + 1) {
+      end++;
+    }
+    int64_t offset = order[i] * kHeatChunkSize;
+    int64_t length = std::min((order[end - 1] + 1) * kHeatChunkSize,
+                              used_size) - offset;
+    i = end;
+    if (length <= 0) {
+      continue;
+    }
+    // Read faults only, writing would dirty every page of the run.
+    if (madvise(pool->base_ + offset, length, MADV_POPULATE_READ) != 0) {
+      // Kernels before 5.14: at least get the pages into the page cache.
+      madvise(pool->base_ + offset, length, MADV_WILLNEED);
+      if (pool->fd_ >= 0) {
+        readahead(pool->fd_, pool->data_offset_ + offset, length);
+      }
+    }
+  }
+  return NULL;
+}
+
+void MMapMempool::waitWarmUp() {
+  if (warm_running_) {
+    pthread_join(warm_thread_, NULL);
+    warm_running_ = false;
+  }
+}
+
+void MMapMempool::stopWarmUp() {
+  __atomic_store_n(&warm_stop_, true, __ATOMIC_RELAXED);
+  waitWarmUp();
+}
+
 int32_t MMapMempool::expand(const int64_t& size) {
   if (header_file_->max_size + size > kMaxMempoolSize_) {
     return -1;
@@ -155,21 +618,469 @@ int32_t MMapMempool::expand(const int64_t& size) {
     expand_size = kMaxMempoolSize_ - header_file_->max_size;
   }
 
+  if (growFile(header_file_->max_size, expand_size) != 0) {
+    return -1;
+  }
+
+  __atomic_store_n(&header_file_->max_size,
+    header_file_->max_size + expand_size, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&expand_count_, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int32_t MMapMempool::growFile(const int64_t& offset, const int64_t& length) {
+  // Allocate the blocks now rather than on the first write fault.
+  if (fallocate(fd_, 0, data_offset_ + offset, length) != 0) {
+    if (errno != EOPNOTSUPP
+        || ftruncate(fd_, data_offset_ + offset + length) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int32_t MMapMempool::expandTo(const int64_t& end) {
   int32_t ret = 0;
-  ret = lseek(fd_, header_file_->max_size + expand_size - sizeof(expand_size),
-    SEEK_SET);
-  if (ret == -1) {
+  pthread_mutex_lock(&expand_mutex_);
+  if (shared_ && lockExpand(F_WRLCK) != 0) {
+    pthread_mutex_unlock(&expand_mutex_);
     return -1;
   }
-  ret = write(fd_, &expand_size, sizeof(expand_size));
-  if (ret == -1) {
+  while (ret == 0 && header_file_->max_size < end) {
+    ret = expand(end - header_file_->max_size);
+  }
+  if (shared_) {
+    lockExpand(F_UNLCK);
+  }
+  pthread_mutex_unlock(&expand_mutex_);
+  return ret;
+}
+
+int32_t MMapMempool::lockExpand(int16_t type) {
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = kExpandByte;
+  lock.l_len = 1;
+  return fcntl(fd_, F_OFD_SETLKW, &lock);
+}
+
+namespace {
+
+enum ChunkState {
+  kChunkPending = 0,
+  kChunkSaving,
+  kChunkSaved
+};
+
+struct SyncTask {
+  char* base;
+  std::vector<DirtyRange> ranges;
+  int32_t ret;
+};
+
+void* syncMain(void* data) {
+  SyncTask* task = reinterpret_cast<SyncTask*>(data);
+  for (size_t i = 0; i < task->ranges.size(); i++) {
+    if (msync(task->base + task->ranges[i].offset, task->ranges[i].length,
+              MS_SYNC) != 0) {
+      task->ret = -1;
+    }
+  }
+  return NULL;
+}
+
+}  // namespace
+
+int32_t MMapMempool::setDirtyTracking(bool enable) {
+  if (!enable) {
+    delete[] dirty_;
+    dirty_ = NULL;
+    return 0;
+  }
+  if (read_only_ || base_ == NULL) {
     return -1;
   }
+  if (dirty_ == NULL) {
+    int64_t words = kMmapSize_ / kDirtyChunkSize / 64;
+    dirty_ = new uint64_t[words];
+    memset(dirty_, 0, words * sizeof(uint64_t));
+    markDirty(0, getUsedSize());
+  }
+  return 0;
+}
+
+void MMapMempool::markDirty(const int64_t& offset, const int64_t& length) {
+  saveSnapshot(offset, length);
+  if (dirty_ == NULL || length <= 0) {
+    return;
+  }
+  int64_t last = (offset + length - 1) / kDirtyChunkSize;
+  for (int64_t chunk = offset / kDirtyChunkSize; chunk <= last; chunk++) {
+    uint64_t bit = 1ULL << (chunk & 63);
+    uint64_t* word = dirty_ + (chunk >> 6);
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)) {
+      __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+    }
+  }
+}
 
-  header_file_->max_size += expand_size;
+int32_t MMapMempool::takeDirty(std::vector<DirtyRange>* ranges) {
+  if (dirty_ == NULL) {
+    return -1;
+  }
+  int64_t used_size = getUsedSize();
+  int64_t chunks = (used_size + kDirtyChunkSize - 1) / kDirtyChunkSize;
+  for (int64_t i = 0; i < (chunks + 63) / 64; i++) {
+    uint64_t bits = __atomic_exchange_n(&dirty_[i], 0, __ATOMIC_ACQ_REL);
+    while (bits != 0) {
+      int64_t chunk = i * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      int64_t offset = chunk * kDirtyChunkSize;
+      if (offset >= used_size) {
+        break;
+      }
+      int64_t length = std::min(kDirtyChunkSize, used_size - offset);
+      if (!ranges->empty()
+          && ranges->back().offset + ranges->back().length == offset) {
+        ranges->back().length += length;
+      } else {
+        DirtyRange range = {offset, length};
+        ranges->push_back(range);
+      }
+    }
+  }
   return 0;
 }
 
+int32_t MMapMempool::syncRanges(const std::vector<DirtyRange>& ranges,
+                                uint32_t threads) {
+  if (read_only_ || base_ == NULL) {
+    return -1;
+  }
+  int64_t total = 0;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    total += ranges[i].length;
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+  // Deal the ranges out in slices of about total / threads bytes, cutting
+  // ranges on chunk boundaries where needed.
+  int64_t slice = (total / threads + kDirtyChunkSize - 1)
+      / kDirtyChunkSize * kDirtyChunkSize;
+  std::vector<SyncTask> tasks(threads);
+  size_t task = 0;
+  int64_t filled = 0;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    DirtyRange range = ranges[i];
+    while (range.length > 0) {
+      if (filled >= slice && task + 1 < tasks.size()) {
+        task++;
+        filled = 0;
+      }
+      int64_t length = range.length;
+      if (task + 1 < tasks.size()) {
+        length = std::min(length, slice - filled);
+      }
+      DirtyRange part = {range.offset, length};
+      tasks[task].ranges.push_back(part);
+      filled += length;
+      range.offset += length;
+      range.length -= length;
+    }
+  }
+
+  std::vector<pthread_t> workers(tasks.size());
+  std::vector<bool> started(tasks.size(), false);
+  for (size_t i = 0; i < tasks.size(); i++) {
+    tasks[i].base = base_;
+    tasks[i].ret = 0;
+    started[i] = i > 0 && !tasks[i].ranges.empty()
+        && pthread_create(&workers[i], NULL, &syncMain, &tasks[i]) == 0;
+  }
+  // The caller takes the first slice and any that could not get a thread.
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (!started[i]) {
+      syncMain(&tasks[i]);
+    }
+  }
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (started[i]) {
+      pthread_join(workers[i], NULL);
+    }
+  }
+  int32_t ret = msync(header_file_, sizeof(MMapFileHeader), MS_SYNC);
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (tasks[i].ret != 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+int32_t MMapMempool::beginSnapshot(const char* path) {
+  if (base_ == NULL || snap_running_) {
+    return -1;
+  }
+  char header_name[PATH_MAX];
+  if (snprintf(header_name, sizeof(header_name), "%s.header", path)
+      >= static_cast<int>(sizeof(header_name))) {
+    return -1;
+  }
+  int64_t used_size = getUsedSize();
+  MMapFileHeader header = {used_size, used_size};
+  int32_t fd_header = open(header_name, O_WRONLY | O_CREAT | O_TRUNC,
+                           S_IRWXU | S_IRGRP | S_IROTH);
+  if (fd_header < 0) {
+    return -1;
+  }
+  bool written = write(fd_header, &header, sizeof(header))
+      == static_cast<ssize_t>(sizeof(header)) && fsync(fd_header) == 0;
+  ::close(fd_header);
+  int32_t fd = open(path, O_RDWR | O_CREAT | O_TRUNC,
+                    S_IRWXU | S_IRGRP | S_IROTH);
+  if (!written || fd < 0) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return -1;
+  }
+
+  // A reflink shares the blocks with the pool, the filesystem copies them
+  // on write.  It writes back dirty pages of the range first.
+  if (data_offset_ == 0 && ioctl(fd, FICLONE, fd_) == 0) {
+    int32_t ret = ftruncate(fd, used_size) == 0 && fsync(fd) == 0 ? 0 : -1;
+    ::close(fd);
+    snap_ret_ = ret;
+    return ret;
+  }
+  if (ftruncate(fd, used_size) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  int64_t chunks = (used_size + kDirtyChunkSize - 1) / kDirtyChunkSize;
+  if (snap_state_ == NULL) {
+    snap_state_ = new uint8_t[kMmapSize_ / kDirtyChunkSize];
+  }
+  memset(snap_state_, kChunkPending, chunks);
+  snap_fd_ = fd;
+  snap_ret_ = 0;
+  __atomic_store_n(&snap_end_, used_size, __ATOMIC_RELEASE);
+  if (pthread_create(&snap_thread_, NULL, &MMapMempool::snapshotMain,
+                     this) != 0) {
+    __atomic_store_n(&snap_end_, 0, __ATOMIC_RELEASE);
+    ::close(fd);
+    snap_fd_ = -1;
+    return -1;
+  }
+  snap_running_ = true;
+  return 0;
+}
+
+int32_t MMapMempool::waitSnapshot() {
+  if (snap_running_) {
+    pthread_join(snap_thread_, NULL);
+    snap_running_ = false;
+  }
+  return snap_ret_;
+}
+
+void* MMapMempool::snapshotMain(void* data) {
+  MMapMempool* pool = reinterpret_cast<MMapMempool*>(data);
+  int64_t end = pool->snap_end_;
+  for (int64_t chunk = 0; chunk * kDirtyChunkSize < end; chunk++) {
+    pool->saveChunk(chunk, end);
+  }
+  if (fsync(pool->snap_fd_) != 0) {
+    pool->snap_ret_ = -1;
+  }
+  // Writers still inside saveChunk only find saved chunks from here on.
+  __atomic_store_n(&pool->snap_end_, 0, __ATOMIC_RELEASE);
+  ::close(pool->snap_fd_);
+  pool->snap_fd_ = -1;
+  return NULL;
+}
+
+void MMapMempool::saveChunk(int64_t chunk, int64_t end) {
+  uint8_t* state = snap_state_ + chunk;
+  uint8_t expected = kChunkPending;
+  if (__atomic_compare_exchange_n(state, &expected, kChunkSaving, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    int64_t offset = chunk * kDirtyChunkSize;
+    int64_t length = std::min(kDirtyChunkSize, end - offset);
+    if (pwrite(snap_fd_, base_ + offset, length, offset) != length) {
+      __atomic_store_n(&snap_ret_, -1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(state, kChunkSaved, __ATOMIC_RELEASE);
+    return;
+  }
+  while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != kChunkSaved) {
+    sched_yield();
+  }
+}
+
+int32_t MMapMempool::setGrowthHeadroom(const int64_t& headroom) {
+  if (headroom <= 0) {
+    stopGrowth();
+    return 0;
+  }
+  if (read_only_ || base_ == NULL) {
+    return -1;
+  }
+  __atomic_store_n(&headroom_, headroom, __ATOMIC_RELAXED);
+  if (growth_running_) {
+    return 0;
+  }
+  growth_stop_ = false;
+  growth_wanted_ = true;
+  if (pthread_create(&growth_thread_, NULL, &MMapMempool::growthMain,
+                     this) != 0) {
+    __atomic_store_n(&headroom_, 0, __ATOMIC_RELAXED);
+    return -1;
+  }
+  growth_running_ = true;
+  return 0;
+}
+
+void MMapMempool::stopGrowth() {
+  if (!growth_running_) {
+    return;
+  }
+  __atomic_store_n(&headroom_, 0, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&growth_mutex_);
+  growth_stop_ = true;
+  pthread_cond_signal(&growth_cond_);
+  pthread_mutex_unlock(&growth_mutex_);
+  pthread_join(growth_thread_, NULL);
+  growth_running_ = false;
+}
+
+void* MMapMempool::growthMain(void* data) {
+  MMapMempool* pool = reinterpret_cast<MMapMempool*>(data);
+  while (true) {
+    pthread_mutex_lock(&pool->growth_mutex_);
+    while (!pool->growth_stop_
+           && !__atomic_load_n(&pool->growth_wanted_, __ATOMIC_ACQUIRE)) {
+      pthread_cond_wait(&pool->growth_cond_, &pool->growth_mutex_);
+    }
+    bool stop = pool->growth_stop_;
+    pthread_mutex_unlock(&pool->growth_mutex_);
+    if (stop) {
+      break;
+    }
+    int64_t target = pool->getUsedSize()
+        + __atomic_load_n(&pool->headroom_, __ATOMIC_RELAXED);
+    if (target > kMaxMempoolSize_) {
+      target = kMaxMempoolSize_;
+    }
+    pool->expandTo(target);
+    // Cleared only now, so allocs do not wake us while we are growing.
+    __atomic_store_n(&pool->growth_wanted_, false, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+bool MMapMempool::isSoleOwner() {
+  if (!shared_) {
+    return true;
+  }
+  // Every attached process holds a read lock on kAttachByte of fd_.  Only
+  // probing for a conflicting write lock leaves ours untouched.
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = kAttachByte;
+  lock.l_len = 1;
+  if (fcntl(fd_, F_OFD_GETLK, &lock) != 0) {
+    return false;
+  }
+  return lock.l_type == F_UNLCK;
+}
+
+int32_t MMapMempool::lockInit() {
+  if (!shared_) {
+    return 0;
+  }
+  return flock(fd_header_, LOCK_EX);
+}
+
+void MMapMempool::unlockInit() {
+  if (shared_) {
+    flock(fd_header_, LOCK_UN);
+  }
+}
+
+int32_t MMapMempool::openShared() {
+  fd_ = open(file_name_, O_RDWR | O_CREAT, S_IRWXU | S_IRGRP | S_IROTH);
+  if (fd_ < 0) {
+    return -1;
+  }
+  fd_header_ = open(header_file_name_, O_RDWR | O_CREAT,
+    S_IRWXU | S_IRGRP | S_IROTH);
+  if (fd_header_ < 0) {
+    return -1;
+  }
+  if (lockInit() != 0) {
+    return -1;
+  }
+
+  int32_t ret = -1;
+  do {
+    // The first process to get here writes the header.
+    struct stat stHeader;
+    if (fstat(fd_header_, &stHeader) != 0) {
+      break;
+    }
+    if (stHeader.st_size == 0) {
+      char buf[sizeof(MMapFileHeader)] = {0};
+      if (pwrite(fd_header_, buf, sizeof(buf), 0) != sizeof(buf)) {
+        break;
+      }
+    } else if (stHeader.st_size != sizeof(MMapFileHeader)) {
+      break;
+    }
+
+    file_ = reinterpret_cast<char*>(mmap(NULL, kMmapSize_,
+      PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+    if (MAP_FAILED == file_) {
+      file_ = NULL;
+      break;
+    }
+    header_file_ = reinterpret_cast<MMapFileHeader*>(mmap(NULL,
+      sizeof(MMapFileHeader), PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd_header_, 0));
+    if (MAP_FAILED == header_file_) {
+      header_file_ = NULL;
+      break;
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) != 0
+        || header_file_->max_size > (int64_t) st.st_size
+        || header_file_->used_size > header_file_->max_size) {
+      break;
+    }
+    // Held until fd_ is closed, see isSoleOwner.
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = kAttachByte;
+    lock.l_len = 1;
+    if (fcntl(fd_, F_OFD_SETLK, &lock) != 0) {
+      break;
+    }
+    base_ = file_;
+    ret = 0;
+  } while (0);
+
+  unlockInit();
+  return ret;
+}
+
 int32_t MMapMempool::loadFile() {
   int openFlags = 0;
   int mmapProt = 0;
@@ -2,7 +2,9 @@
 #define BASE_MMAP_MEMPOOL_H_
 
 #include "arena/mempool.h"
+#include <pthread.h>
 #include <stdint.h>
+#include <algorithm>
 #include <string>
 
 namespace base {
@@ -11,7 +13,31 @@ enum MMapOpenMode {
   MFILE_MODE_IGNORE = 0,
   MFILE_MODE_READ,
   MFILE_MODE_WRITE,
-  MFILE_MODE_WRITE_NODUMP
+  MFILE_MODE_WRITE_NODUMP,
+  // Writable by several processes at once, implies concurrent alloc.
+  MFILE_MODE_WRITE_SHARED
+};
+
+// Mapping policy flags for MMapMempool::init.
+enum MMapPolicy {
+  MMAP_POLICY_NONE = 0,
+  // Ask for transparent huge pages (MADV_HUGEPAGE).  File mappings only get
+  // them on filesystems supporting it, e.g. tmpfs with huge=advise.
+  MMAP_POLICY_HUGEPAGE = 1 << 0,
+  // Fault the used range in at init instead of on first touch.  Pages are
+  // mapped for reading, the first write to each still takes a minor fault.
+  MMAP_POLICY_POPULATE = 1 << 1,
+  // Keep ranges handed to lockResident, e.g. the arena header, in memory.
+  MMAP_POLICY_MLOCK = 1 << 2,
+  // Record which parts of the pool were touched since the last dump() into
+  // a .heat file beside the .header file at every dump().  Each dump()
+  // unmaps a bounded window of chunks to sample, so the next touch of a
+  // page there takes a minor fault.  Cannot be combined with
+  // MMAP_POLICY_MLOCK.
+  MMAP_POLICY_HEAT_MAP = 1 << 3,
+  // At init, page the ranges the .heat file marks hot back in from a
+  // background thread, hottest first.
+  MMAP_POLICY_WARM_UP = 1 << 4
 };
 
 struct MMapFileHeader {
@@ -27,6 +53,11 @@ class MMapMempool : public Mempool {
 
   virtual int32_t init(const char* file_name, uint32_t mode);
 
+  // init with a combination of MMapPolicy flags.  Returns -1 for
+  // MMAP_POLICY_HEAT_MAP with MMAP_POLICY_MLOCK: locked pages cannot be
+  // unmapped to sample, and would all read hot.
+  int32_t init(const char* file_name, uint32_t mode, uint32_t policy);
+
   virtual void close();
 
   virtual int32_t dump();
@@ -41,23 +72,159 @@ class MMapMempool : public Mempool {
 
   virtual char* getAddressSafe(const int64_t& offset);
 
+  virtual int32_t shrink(const int64_t& end, const int64_t& new_end);
+
+  virtual int32_t extend(const int64_t& end, const int64_t& new_end);
+
+  virtual int32_t release(const int64_t& offset, const int64_t& length);
+
+  virtual int32_t restoreUsedSize(const int64_t& used_size);
+
+  virtual int32_t lockResident(const int64_t& offset, const int64_t& length);
+
   virtual inline char* getBase();
 
   virtual inline int64_t getUsedSize();
 
+  virtual int64_t getCapacity() {
+    return __atomic_load_n(&header_file_->max_size, __ATOMIC_ACQUIRE);
+  }
+
+  virtual int64_t getExpandCount() {
+    return __atomic_load_n(&expand_count_, __ATOMIC_RELAXED);
+  }
+
   virtual void setExpandSize(const int64_t& size) {
     expand_size_ = size;
   }
 
+  // In concurrent mode alloc bumps used_size with one atomic fetch-add and
+  // only the thread that crosses max_size extends the file, the others keep
+  // allocating below it.  dump() then leaves max_size alone.  An alloc the
+  // file cannot grow to gives its reservation back only when nothing was
+  // reserved behind it, otherwise the range stays used.
+  void setConcurrentAlloc(bool concurrent) {
+    concurrent_ = concurrent;
+  }
+
+  virtual bool isConcurrentAlloc() {
+    return concurrent_;
+  }
+
+  // Keeps at least headroom bytes of preallocated file past used_size from
+  // a background thread, so that alloc does not stall growing the file.
+  // 0 stops the thread, close() and the destructor stop it too.
+  int32_t setGrowthHeadroom(const int64_t& headroom);
+
+  // Tracks writes at kDirtyChunkSize granularity for takeDirty and
+  // syncRanges.  Enabling marks the whole used range dirty.  Must be
+  // switched while nobody writes the pool.  The bitmap is private to the
+  // process, ranges other processes mark on a shared pool are not in it.
+  int32_t setDirtyTracking(bool enable);
+
+  virtual void markDirty(const int64_t& offset, const int64_t& length);
+
+  virtual int32_t takeDirty(std::vector<DirtyRange>* ranges);
+
+  virtual int32_t syncRanges(const std::vector<DirtyRange>& ranges,
+                             uint32_t threads);
+
+  // Clones the file where the filesystem supports reflinks, otherwise
+  // copies it from a background thread, saving chunks about to be written
+  // first.
+  virtual int32_t beginSnapshot(const char* path);
+
+  virtual int32_t waitSnapshot();
+
+  // Folds the pages touched since the last call into the heat map and
+  // writes it to the .heat file.  A page counts when it is mapped into the
+  // process, so a chunk is only read after it was unmapped, its data
+  // staying in the file's page cache.  Each call unmaps the next
+  // kHeatSampleChunks chunks round the pool, bounding the refaults; the
+  // others keep their heat until their turn.  A sampled chunk's heat
+  // halves, so the map follows the working set over a few rounds.
+  virtual int32_t recordHeat();
+
+  // Waits for the warm-up started by MMAP_POLICY_WARM_UP.
+  void waitWarmUp();
+
+  // Binds the whole mapping, before init or at any time after it.  Files
+  // on tmpfs and the anonymous and memfd pools follow the policy; the page
+  // cache of other files is placed by the thread reading it in, so there
+  // the policy only moves the pages this process has mapped.
+  virtual int32_t setNumaPolicy(uint32_t policy, uint64_t nodes);
+
+  // copy_file_range from another MMapMempool's file, which reflinks on
+  // filesystems supporting it.
+  virtual int32_t copyFrom(const int64_t& offset, Mempool* src,
+                           const int64_t& src_offset, const int64_t& length);
+
+  virtual bool isShared() {
+    return shared_;
+  }
+
+  virtual bool isSoleOwner();
+
+  virtual int32_t lockInit();
+
+  virtual void unlockInit();
+
  protected:
   virtual int32_t loadFile();
 
   virtual int32_t createFile();
 
+  // Applies map_policy_ to the fresh mapping.
+  void applyMapPolicy();
+
+  // Opens or creates the files in MFILE_MODE_WRITE_SHARED and attaches to
+  // them with a read lock on a byte of the data file.
+  int32_t openShared();
+
   virtual int32_t expand(const int64_t& size);
 
+  // Backs [offset, offset + length) of the data, which expand() is about to
+  // add to the pool.
+  virtual int32_t growFile(const int64_t& offset, const int64_t& length);
+
+  // Extends the file until max_size covers end, serialized on expand_mutex_
+  // and, in shared mode, on a record lock of the data file.
+  int32_t expandTo(const int64_t& end);
+
+  // Marks the size bytes reserved at offset as dead (see kDeadSpanMark).
+  // Skipped when the span cannot be described or its start not backed.
+  void markDeadSpan(const int64_t& offset, const int64_t& size);
+
+  // Takes (F_WRLCK) or drops (F_UNLCK) the cross-process expand lock.
+  int32_t lockExpand(int16_t type);
+
+  // Wakes the growth thread once headroom falls below half of its target.
+  inline void checkHeadroom(const int64_t& used_size);
+
+  static void* growthMain(void* pool);
+
+  static void* snapshotMain(void* pool);
+
+  // Saves the chunks of [offset, offset + length) not yet in the running
+  // snapshot, or waits for whoever is saving them.
+  inline void saveSnapshot(const int64_t& offset, const int64_t& length);
+
+  void saveChunk(int64_t chunk, int64_t end);
+
+  void stopGrowth();
+
+  // Reads the .heat file into heat_, if there is one.
+  void loadHeat();
+
+  static void* warmUpMain(void* pool);
+
+  void stopWarmUp();
+
  public:
   static const int64_t _NULL;
+  static const int64_t kDirtyChunkSize;
+  static const int64_t kHeatChunkSize;
+  static const int64_t kHeatSampleChunks;
 
  protected:
   int32_t fd_;
@@ -65,8 +232,55 @@ class MMapMempool : public Mempool {
   char* file_;
   MMapFileHeader* header_file_;
   char* base_;
+  // File offset of base_, for pools keeping their header in front of the
+  // data.
+  int64_t data_offset_;
   bool read_only_;
   int64_t expand_size_;
+  int64_t expand_count_;
+  uint32_t map_policy_;
+  uint32_t numa_policy_;
+  uint64_t numa_nodes_;
+
+  // Background growth, see setGrowthHeadroom.
+  int64_t headroom_;
+  bool growth_running_;
+  bool growth_stop_;
+  bool growth_wanted_;
+  pthread_t growth_thread_;
+  pthread_mutex_t growth_mutex_;
+  pthread_cond_t growth_cond_;
+
+  // One bit per kDirtyChunkSize chunk of the mapping, NULL when dirty
+  // tracking is off.
+  uint64_t* dirty_;
+
+  // Size of the running snapshot's image, 0 when none runs.  Chunks below
+  // it move from kChunkPending through kChunkSaving to kChunkSaved in
+  // snap_state_.
+  int64_t snap_end_;
+  int32_t snap_fd_;
+  uint8_t* snap_state_;
+  bool snap_running_;
+  int32_t snap_ret_;
+  pthread_t snap_thread_;
+
+  // One heat byte per kHeatChunkSize chunk, and the warm-up thread paging
+  // in the hot ones.
+  std::vector<uint8_t> heat_;
+  std::vector<uint8_t> warm_heat_;
+  bool warm_running_;
+  bool warm_stop_;
+  pthread_t warm_thread_;
+  // Chunks unmapped since their last reading, and where the next window of
+  // them starts.
+  std::vector<uint8_t> heat_armed_;
+  int64_t heat_cursor_;
+  bool concurrent_;
+  pthread_mutex_t expand_mutex_;
+  // Several processes write the pool.  A flock on fd_header_ is the init
+  // lock, every attached process holds an OFD read lock on fd_.
+  bool shared_;
 
   static const int64_t kMmapSize_;
   static const int64_t kMaxMempoolSize_;
@@ -80,12 +294,32 @@ inline char* MMapMempool::getBase() {
   return base_;
 }
 
-inline int64_t MMapMempool::getUsedSize() {
-  return header_file_->used_size;
+inline void MMapMempool::saveSnapshot(const int64_t& offset,
+                                      const int64_t& length) {
+  int64_t end = __atomic_load_n(&snap_end_, __ATOMIC_ACQUIRE);
+  if (offset >= end || length <= 0) {
+    return;
+  }
+  int64_t last = (std::min(offset + length, end) - 1) / kDirtyChunkSize;
+  for (int64_t chunk = offset / kDirtyChunkSize; chunk <= last; chunk++) {
+    saveChunk(chunk, end);
+  }
 }
 
-inline void MMapMempool::close() {
-  return;
+inline void MMapMempool::checkHeadroom(const int64_t& used_size) {
+  int64_t headroom = __atomic_load_n(&headroom_, __ATOMIC_RELAXED);
+  if (headroom != 0
+      && __atomic_load_n(&header_file_->max_size, __ATOMIC_RELAXED)
+         - used_size < headroom / 2
+      && !__atomic_exchange_n(&growth_wanted_, true, __ATOMIC_ACQ_REL)) {
+    pthread_mutex_lock(&growth_mutex_);
+    pthread_cond_signal(&growth_cond_);
+    pthread_mutex_unlock(&growth_mutex_);
+  }
+}
+
+inline int64_t MMapMempool::getUsedSize() {
+  return __atomic_load_n(&header_file_->used_size, __ATOMIC_RELAXED);
 }
 
 }  // namespace base
@@ -0,0 +1,116 @@
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "arena/numa.h"
+
+namespace base {
+
+namespace {
+
+// Reads a sysfs list such as "0-3,8,10-11" into ids.  Returns false when
+// the file cannot be read.
+bool readIdList(const char* path, std::vector<int32_t>* ids) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+  char buf[4096];
+  bool ok = fgets(buf, sizeof(buf), file) != NULL;
+  fclose(file);
+  if (!ok) {
+    return false;
+  }
+  for (char* p = buf; *p != '\0' && *p != '\n';) {
+    char* end = NULL;
+    long first = strtol(p, &end, 10);
+    if (end == p) {
+      return false;
+    }
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return false;
+      }
+    }
+    for (long id = first; id <= last; id++) {
+      ids->push_back(id);
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return true;
+}
+
+}  // namespace
+
+int32_t numaNodeCount() {
+  std::vector<int32_t> nodes;
+  if (!readIdList("/sys/devices/system/node/online", &nodes)
+      || nodes.empty()) {
+    return 1;
+  }
+  int32_t count = nodes.back() + 1;
+  return count > kMaxNumaNodes ? kMaxNumaNodes : count;
+}
+
+int32_t numaCurrentNode() {
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0
+      || node >= static_cast<unsigned>(kMaxNumaNodes)) {
+    return 0;
+  }
+  return node;
+}
+
+void numaCpuNodes(std::vector<int32_t>* nodes) {
+  nodes->assign(sysconf(_SC_NPROCESSORS_CONF), 0);
+  for (int32_t node = 0; node < numaNodeCount(); node++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    std::vector<int32_t> cpus;
+    readIdList(path, &cpus);
+    for (size_t i = 0; i < cpus.size(); i++) {
+      if (cpus[i] >= static_cast<int32_t>(nodes->size())) {
+        nodes->resize(cpus[i] + 1, 0);
+      }
+      (*nodes)[cpus[i]] = node;
+    }
+  }
+}
+
+int32_t numaBind(void* addr, int64_t length, uint32_t policy,
+                 uint64_t nodes) {
+  int mode = MPOL_DEFAULT;
+  switch (policy) {
+    case NUMA_POLICY_DEFAULT:
+      nodes = 0;
+      break;
+    case NUMA_POLICY_BIND:
+      mode = MPOL_BIND;
+      break;
+    case NUMA_POLICY_INTERLEAVE:
+      mode = MPOL_INTERLEAVE;
+      break;
+    case NUMA_POLICY_PREFERRED:
+      mode = MPOL_PREFERRED;
+      break;
+    default:
+      return -1;
+  }
+  if (mode != MPOL_DEFAULT && nodes == 0) {
+    return -1;
+  }
+  // maxnode counts one past the last bit, as the kernel drops the last.
+  unsigned long mask = nodes;
+  return syscall(SYS_mbind, addr, length, mode, nodes == 0 ? NULL : &mask,
+                 nodes == 0 ? 0 : sizeof(mask) * 8 + 1, MPOL_MF_MOVE) == 0
+      ? 0 : -1;
+}
+
+}  // namespace base
@@ -0,0 +1,44 @@
+#ifndef BASE_NUMA_H_
+#define BASE_NUMA_H_
+
+#include <stdint.h>
+#include <vector>
+
+namespace base {
+
+// Memory placement of a pool's mapping, see Mempool::setNumaPolicy.
+enum NumaPolicy {
+  // Pages go to the node of the thread touching them first.
+  NUMA_POLICY_DEFAULT = 0,
+  // Pages only come from the given nodes.
+  NUMA_POLICY_BIND,
+  // Pages are spread round robin over the given nodes.
+  NUMA_POLICY_INTERLEAVE,
+  // Pages come from the first given node while it has free memory.
+  NUMA_POLICY_PREFERRED
+};
+
+// Nodes are numbered from 0, a node set is a mask with bit i for node i.
+// These go to the system calls directly rather than through libnuma, and
+// report a single node 0 where the kernel has no NUMA support.
+const int32_t kMaxNumaNodes = 64;
+
+// Highest online node plus one, 1 when unknown.
+int32_t numaNodeCount();
+
+// Node the calling thread runs on, 0 when unknown.
+int32_t numaCurrentNode();
+
+// Fills nodes with the node of every cpu, indexed by cpu number, for
+// callers mapping sched_getcpu() to a node on a hot path.
+void numaCpuNodes(std::vector<int32_t>* nodes);
+
+// Applies policy over nodes to the pages of [addr, addr + length), moving
+// pages already faulted in where the kernel can.  addr must be page
+// aligned.
+int32_t numaBind(void* addr, int64_t length, uint32_t policy,
+                 uint64_t nodes);
+
+}  // namespace base
+
+#endif  // BASE_NUMA_H_
@@ -0,0 +1,137 @@
+#include <sched.h>
+
+#include "arena/numa_arena.h"
+
+namespace base {
+
+NumaArena::NumaArena() {
+}
+
+NumaArena::~NumaArena() {
+    for (size_t i = 0; i < arenas_.size(); i++) {
+        delete arenas_[i];
+    }
+}
+
+int32_t NumaArena::init(const std::vector<Mempool*>& pools,
+                        uint32_t minMemSize,
+                        uint32_t maxMemSize,
+                        float rate,
+                        uint32_t delayTime) {
+    if (!arenas_.empty() || pools.empty()
+        || pools.size() > static_cast<size_t>(kMaxNumaNodes)) {
+        return -1;
+    }
+    int32_t nodes = numaNodeCount();
+    for (size_t i = 0; i < pools.size(); i++) {
+        // Nodes sharing this pool, placement is advice.
+        uint64_t mask = 0;
+        for (int32_t node = i; node < nodes; node += pools.size()) {
+            mask |= 1ULL << node;
+        }
+        if (mask != 0) {
+            pools[i]->setNumaPolicy(NUMA_POLICY_BIND, mask);
+        }
+        Arena* arena = new Arena();
+        arenas_.push_back(arena);
+        if (arena->init(pools[i], minMemSize, maxMemSize, rate,
+                        delayTime) != 0) {
+            for (size_t j = 0; j < arenas_.size(); j++) {
+                delete arenas_[j];
+            }
+            arenas_.clear();
+            return -1;
+        }
+    }
+    numaCpuNodes(&cpu_nodes_);
+    return 0;
+}
+
+int32_t NumaArena::dump() {
+    int32_t ret = 0;
+    for (size_t i = 0; i < arenas_.size(); i++) {
+        if (arenas_[i]->dump() != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+void NumaArena::close() {
+    for (size_t i = 0; i < arenas_.size(); i++) {
+        arenas_[i]->close();
+    }
+}
+
+int32_t NumaArena::getLocalNode() {
+    int cpu = sched_getcpu();
+    int32_t node = 0;
+    if (cpu >= 0 && cpu < static_cast<int>(cpu_nodes_.size())) {
+        node = cpu_nodes_[cpu];
+    }
+    return arenas_.empty() ? 0 : node % arenas_.size();
+}
+
+int64_t NumaArena::alloc(uint32_t size) {
+    int32_t local = getLocalNode();
+    int32_t count = arenas_.size();
+    for (int32_t i = 0; i < count; i++) {
+        // A remote block beats no block.
+        int64_t key = allocOnNode((local + i) % count, size);
+        if (key != -1) {
+            return key;
+        }
+    }
+    return -1;
+}
+
+int64_t NumaArena::allocOnNode(int32_t node, uint32_t size) {
+    Arena* arena = getArena(node);
+    if (arena == NULL) {
+        return -1;
+    }
+    int64_t key = arena->alloc(size);
+    if (key == -1) {
+        return -1;
+    }
+    return key | static_cast<int64_t>(node) << kNumaKeyShift;
+}
+
+int32_t NumaArena::free(int64_t key) {
+    int64_t local = 0;
+    Arena* arena = arenaOf(key, &local);
+    return arena == NULL ? -1 : arena->free(local);
+}
+
+char* NumaArena::getAddress(int64_t key) {
+    int64_t local = 0;
+    Arena* arena = arenaOf(key, &local);
+    return arena == NULL ? NULL : arena->getAddress(local);
+}
+
+uint32_t NumaArena::getSize(int64_t key) {
+    int64_t local = 0;
+    Arena* arena = arenaOf(key, &local);
+    return arena == NULL ? 0 : arena->getSize(local);
+}
+
+int32_t NumaArena::getStats(std::vector<ArenaStats>* stats) {
+    stats->assign(arenas_.size(), ArenaStats());
+    for (size_t i = 0; i < arenas_.size(); i++) {
+        if (arenas_[i]->getStats(&(*stats)[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int32_t NumaArena::set_thread_safe(bool thread_safe) {
+    for (size_t i = 0; i < arenas_.size(); i++) {
+        if (arenas_[i]->set_thread_safe(thread_safe) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+}  // namespace base
@@ -0,0 +1,95 @@
+#ifndef BASE_NUMA_ARENA_H_
+#define BASE_NUMA_ARENA_H_
+
+#include <stdint.h>
+#include <vector>
+#include "arena/arena.h"
+#include "arena/numa.h"
+
+namespace base {
+
+// A NumaArena key is the key of one of its arenas with the arena's index
+// in bits kNumaKeyShift and up, below the slab key tag.
+const int32_t kNumaKeyShift = 56;
+const int64_t kNumaKeyMask = static_cast<int64_t>(kMaxNumaNodes - 1)
+    << kNumaKeyShift;
+
+// Front end over one Arena per NUMA node.  Each node's pool is bound to
+// its node, and alloc serves the caller from the arena of the node it runs
+// on, falling back to the other nodes when that one is full.  Blocks are
+// freed into the arena they came from, whichever thread frees them.
+//
+// There may be fewer pools than nodes, node n then uses pool
+// n % pools.size(); a single pool makes this a plain Arena on one-node
+// machines.  The pools stay the caller's.
+class NumaArena {
+ public:
+  NumaArena();
+  ~NumaArena();
+
+  // pools[i] serves node i.  Binding a pool is only advice: where the
+  // kernel refuses it, pages still land on the node of the thread that
+  // allocates and first writes them.
+  int32_t init(const std::vector<Mempool*>& pools,
+               uint32_t minMemSize = 32,
+               uint32_t maxMemSize = 1U << 31,
+               float rate = 1.05,
+               uint32_t delayTime = 10);
+
+  int32_t dump();
+
+  void close();
+
+  int64_t alloc(uint32_t size);
+
+  // Allocates from node's arena only.
+  int64_t allocOnNode(int32_t node, uint32_t size);
+
+  int32_t free(int64_t key);
+
+  char* getAddress(int64_t key);
+
+  uint32_t getSize(int64_t key);
+
+  // Index of the arena holding key.
+  static int32_t getNode(int64_t key) {
+    return (key & kNumaKeyMask) >> kNumaKeyShift;
+  }
+
+  int32_t getNodeCount() {
+    return arenas_.size();
+  }
+
+  Arena* getArena(int32_t node) {
+    return node >= 0 && node < getNodeCount() ? arenas_[node] : NULL;
+  }
+
+  // Arena of the node the calling thread runs on.
+  int32_t getLocalNode();
+
+  // Fills stats with one ArenaStats per node.
+  int32_t getStats(std::vector<ArenaStats>* stats);
+
+  // See Arena::set_thread_safe, applies to every node.
+  int32_t set_thread_safe(bool thread_safe);
+
+ private:
+  // The node's arena and its own key, or NULL.
+  inline Arena* arenaOf(int64_t key, int64_t* local);
+
+  std::vector<Arena*> arenas_;
+  // Node of every cpu, for sched_getcpu().
+  std::vector<int32_t> cpu_nodes_;
+};
+
+inline Arena* NumaArena::arenaOf(int64_t key, int64_t* local) {
+  if (key < 0) {
+    return NULL;
+  }
+  *local = key & ~kNumaKeyMask;
+  return getArena(getNode(key));
+}
+
+}  // namespace base
+
+#endif  // BASE_NUMA_ARENA_H_
@@ -0,0 +1,262 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "arena/redo_log.h"
+
+namespace base {
+
+namespace {
+
+const uint32_t kRecordMagic = 0x52444f31;  // "RDO1"
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t count;  // ranges in the record
+  uint64_t seq;  // one more than the previous record's
+  int64_t used_size;
+  int64_t length;  // payload bytes after the header
+  uint64_t checksum;
+};
+
+// The payload is count entries of this followed by length bytes.
+struct RangeHeader {
+  int64_t offset;
+  int64_t length;
+};
+
+// noted_ is merged at no less than this many entries.
+const size_t kNoteMergeSize = 1024;
+
+bool RangeLess(const DirtyRange& a, const DirtyRange& b) {
+  return a.offset < b.offset;
+}
+
+// Sorts ranges and folds overlapping or adjacent ones together.
+void mergeRanges(std::vector<DirtyRange>* ranges) {
+  std::sort(ranges->begin(), ranges->end(), RangeLess);
+  size_t merged = 0;
+  for (size_t i = 1; i < ranges->size(); i++) {
+    DirtyRange& last = (*ranges)[merged];
+    const DirtyRange& range = (*ranges)[i];
+    if (range.offset <= last.offset + last.length) {
+      last.length = std::max(last.length,
+                             range.offset + range.length - last.offset);
+    } else {
+      (*ranges)[++merged] = range;
+    }
+  }
+  ranges->resize(ranges->empty() ? 0 : merged + 1);
+}
+
+uint64_t checksum(const RecordHeader& header, const char* payload) {
+  // FNV-1a over the payload, seeded with the header fields.
+  uint64_t hash = 14695981039346656037ULL;
+  hash = (hash ^ header.count) * 1099511628211ULL;
+  hash = (hash ^ header.seq) * 1099511628211ULL;
+  hash = (hash ^ static_cast<uint64_t>(header.used_size)) * 1099511628211ULL;
+  for (int64_t i = 0; i < header.length; i++) {
+    hash = (hash ^ static_cast<unsigned char>(payload[i])) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+}  // namespace
+
+RedoLog::RedoLog()
+    : fd_(-1),
+      merge_at_(kNoteMergeSize),
+      end_(0),
+      seq_(0),
+      concurrent_(false),
+      synced_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_mutex_init(&sync_mutex_, NULL);
+}
+
+RedoLog::~RedoLog() {
+  close();
+  pthread_mutex_destroy(&sync_mutex_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+int32_t RedoLog::open(const char* path) {
+  close();
+  fd_ = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd_ == -1) {
+    return -1;
+  }
+  end_ = lseek(fd_, 0, SEEK_END);
+  synced_ = end_;
+  return 0;
+}
+
+void RedoLog::close() {
+  if (fd_ != -1) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  noted_.clear();
+  merge_at_ = kNoteMergeSize;
+}
+
+void RedoLog::note(int64_t offset, int64_t length) {
+  if (concurrent_) {
+    pthread_mutex_lock(&mutex_);
+  }
+  if (!noted_.empty()
+      && noted_.back().offset + noted_.back().length == offset) {
+    noted_.back().length += length;
+  } else {
+    DirtyRange range = {offset, length};
+    noted_.push_back(range);
+    // The same prefixes and links are noted over and over between two
+    // records, keep each once.
+    if (noted_.size() >= merge_at_) {
+      mergeRanges(&noted_);
+      merge_at_ = std::max(kNoteMergeSize, noted_.size() * 2);
+    }
+  }
+  if (concurrent_) {
+    pthread_mutex_unlock(&mutex_);
+  }
+}
+
+int64_t RedoLog::append(Mempool* pool, const std::vector<DirtyRange>& fixed,
+                        int64_t used_size) {
+  pthread_mutex_lock(&mutex_);
+  std::vector<DirtyRange> ranges;
+  ranges.swap(noted_);
+  merge_at_ = kNoteMergeSize;
+  ranges.insert(ranges.end(), fixed.begin(), fixed.end());
+  mergeRanges(&ranges);
+
+  std::vector<char> record(sizeof(RecordHeader));
+  RecordHeader header = {kRecordMagic, 0, seq_ + 1, used_size, 0, 0};
+  for (size_t i = 0; i < ranges.size(); i++) {
+    // Ranges beyond the pool tail were cut off after being noted.
+    const char* data = pool->getAddress(ranges[i].offset, ranges[i].length);
+    if (data == NULL) {
+      continue;
+    }
+    RangeHeader range = {ranges[i].offset, ranges[i].length};
+    const char* raw = reinterpret_cast<const char*>(&range);
+    record.insert(record.end(), raw, raw + sizeof(range));
+    record.insert(record.end(), data, data + range.length);
+    header.count++;
+  }
+  header.length = record.size() - sizeof(RecordHeader);
+  header.checksum = checksum(header, &record[0] + sizeof(RecordHeader));
+  memcpy(&record[0], &header, sizeof(header));
+
+  int64_t ret = -1;
+  if (fd_ != -1 && pwrite(fd_, &record[0], record.size(), end_)
+      == static_cast<ssize_t>(record.size())) {
+    end_ += record.size();
+    seq_++;
+    ret = end_;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return ret;
+}
+
+int32_t RedoLog::sync(int64_t lsn) {
+  pthread_mutex_lock(&sync_mutex_);
+  int32_t ret = 0;
+  if (synced_ < lsn) {
+    pthread_mutex_lock(&mutex_);
+    int64_t end = end_;
+    pthread_mutex_unlock(&mutex_);
+    ret = fdatasync(fd_);
+    if (ret == 0) {
+      synced_ = end;
+    }
+  }
+  pthread_mutex_unlock(&sync_mutex_);
+  return ret;
+}
+
+int32_t RedoLog::replay(Mempool* pool) {
+  if (fd_ == -1) {
+    return -1;
+  }
+  pthread_mutex_lock(&mutex_);
+  int64_t size = lseek(fd_, 0, SEEK_END);
+  std::vector<char> log(size);
+  int32_t applied = 0;
+  int64_t offset = 0;
+  if (size > 0 && pread(fd_, &log[0], size, 0) != size) {
+    pthread_mutex_unlock(&mutex_);
+    return -1;
+  }
+  while (offset + static_cast<int64_t>(sizeof(RecordHeader)) <= size) {
+    RecordHeader header;
+    memcpy(&header, &log[offset], sizeof(header));
+    const char* payload = &log[offset] + sizeof(header);
+    // Records left over from before a truncation carry older sequence
+    // numbers and end the log.
+    if (header.magic != kRecordMagic || header.length < 0
+        || header.length > size - offset - static_cast<int64_t>(sizeof(header))
+        || (applied > 0 && header.seq != seq_ + 1)
+        || header.checksum != checksum(header, payload)) {
+      break;
+    }
+    if (pool->restoreUsedSize(header.used_size) != 0) {
+      break;
+    }
+    const char* entry = payload;
+    for (uint32_t i = 0; i < header.count; i++) {
+      RangeHeader range;
+      memcpy(&range, entry, sizeof(range));
+      entry += sizeof(range);
+      char* data = pool->getAddress(range.offset, range.length);
+      if (data != NULL) {
+        memcpy(data, entry, range.length);
+      }
+      entry += range.length;
+    }
+    seq_ = header.seq;
+    offset += sizeof(header) + header.length;
+    applied++;
+  }
+  // Drop the torn tail so that new records follow the last intact one.
+  if (ftruncate(fd_, offset) != 0) {
+    applied = -1;
+  }
+  end_ = offset;
+  synced_ = offset;
+  pthread_mutex_unlock(&mutex_);
+  return applied;
+}
+
+int32_t RedoLog::truncate(int64_t lsn) {
+  pthread_mutex_lock(&sync_mutex_);
+  pthread_mutex_lock(&mutex_);
+  int32_t ret = 0;
+  if (end_ == lsn && end_ != 0) {
+    ret = ftruncate(fd_, 0);
+    if (ret == 0) {
+      end_ = 0;
+      synced_ = 0;
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+  pthread_mutex_unlock(&sync_mutex_);
+  return ret;
+}
+
+int32_t RedoLog::reset() {
+  pthread_mutex_lock(&sync_mutex_);
+  pthread_mutex_lock(&mutex_);
+  noted_.clear();
+  merge_at_ = kNoteMergeSize;
+  int32_t ret = fd_ == -1 ? -1 : ftruncate(fd_, 0);
+  end_ = 0;
+  synced_ = 0;
+  pthread_mutex_unlock(&mutex_);
+  pthread_mutex_unlock(&sync_mutex_);
+  return ret;
+}
+
+}  // namespace base
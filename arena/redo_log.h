@@ -0,0 +1,79 @@
+#ifndef BASE_REDO_LOG_H_
+#define BASE_REDO_LOG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+#include "arena/mempool.h"
+
+namespace base {
+
+// Redo log of allocator metadata kept next to a pool.  Writers note the
+// ranges they are about to change; append() then turns the noted ranges,
+// plus any fixed ones, into one record holding their current bytes and
+// the pool's used size.  Records are applied in order on replay, a torn or
+// corrupt tail is ignored, so the pool comes back in the state of the last
+// record that made it to disk.
+class RedoLog {
+ public:
+  RedoLog();
+  ~RedoLog();
+
+  // Opens or creates the log at path.
+  int32_t open(const char* path);
+
+  void close();
+
+  bool isOpen() {
+    return fd_ != -1;
+  }
+
+  // Records that [offset, offset + length) changes.  Ranges noted again
+  // before the next append() are kept once.  Thread safe when concurrent.
+  void note(int64_t offset, int64_t length);
+
+  // Whether note() may be called from several threads at once.  Off by
+  // default, note() then takes no lock.
+  void set_concurrent(bool concurrent) {
+    concurrent_ = concurrent;
+  }
+
+  // Writes a record of the noted ranges and fixed, read from pool, and
+  // clears the noted set.  Returns the log position the record ends at, to
+  // hand to sync(), or -1.
+  int64_t append(Mempool* pool, const std::vector<DirtyRange>& fixed,
+                 int64_t used_size);
+
+  // Makes the log durable up to lsn.  Callers arriving while another one
+  // syncs are covered by that sync when it started after their append.
+  int32_t sync(int64_t lsn);
+
+  // Applies every intact record to pool.  Returns the number of records
+  // applied, or -1 when the log cannot be read.
+  int32_t replay(Mempool* pool);
+
+  // Empties the log when nothing was appended after lsn, i.e. once the
+  // pool itself is durable up to lsn.
+  int32_t truncate(int64_t lsn);
+
+  // Forgets every record.
+  int32_t reset();
+
+ private:
+  int fd_;
+  // Noted ranges and the end of the log, under mutex_.  noted_ is sorted
+  // and merged whenever it reaches merge_at_ entries.
+  std::vector<DirtyRange> noted_;
+  size_t merge_at_;
+  int64_t end_;
+  uint64_t seq_;  // of the last record written or replayed
+  pthread_mutex_t mutex_;
+  bool concurrent_;
+  // Highest position known durable, under sync_mutex_.
+  int64_t synced_;
+  pthread_mutex_t sync_mutex_;
+};
+
+}  // namespace base
+
+#endif  // BASE_REDO_LOG_H_
@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "arena/segmented_mempool.h"
+
+namespace base {
+
+const int64_t SegmentedMempool::kDefaultSegmentSize =
+    64L * 1024 * 1024 * 1024;  // 64G
+const int64_t SegmentedMempool::kMaxSegments;
+
+SegmentedMempool::SegmentedMempool()
+    : fd_header_(-1),
+      header_(NULL),
+      base_(NULL),
+      read_only_(false),
+      segment_size_(kDefaultSegmentSize),
+      expand_size_(1*1024*1024*1024),
+      expand_count_(0),
+      threads_(1) {
+}
+
+SegmentedMempool::~SegmentedMempool() {
+  unmap();
+}
+
+int32_t SegmentedMempool::setSegmentSize(const int64_t& size) {
+  if (header_ != NULL || size < sysconf(_SC_PAGESIZE)
+      || (size & (size - 1)) != 0 || size > (1L << 54) / kMaxSegments) {
+    return -1;
+  }
+  segment_size_ = size;
+  return 0;
+}
+
+int32_t SegmentedMempool::init(const char* file_name, uint32_t mode) {
+  if (Mempool::init(file_name) != 0 || header_ != NULL
+      || (mode != MFILE_MODE_READ && mode != MFILE_MODE_WRITE)) {
+    return -1;
+  }
+  read_only_ = (MFILE_MODE_READ == mode);
+  int32_t ret = -1;
+  if (access(header_file_name_, F_OK) == 0) {
+    ret = loadFile();
+  } else if (errno == ENOENT) {
+    ret = createFile();
+  }
+  if (ret != 0) {
+    unmap();
+    return -1;
+  }
+  return 0;
+}
+
+int32_t SegmentedMempool::reserve() {
+  void* addr = mmap(NULL, kMaxSegments * segment_size_, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    return -1;
+  }
+  base_ = reinterpret_cast<char*>(addr);
+  return 0;
+}
+
+void SegmentedMempool::unmap() {
+  if (base_ != NULL) {
+    munmap(base_, kMaxSegments * segment_size_);
+    base_ = NULL;
+  }
+  for (size_t i = 0; i < fds_.size(); i++) {
+    if (fds_[i] >= 0) {
+      ::close(fds_[i]);
+    }
+  }
+  fds_.clear();
+  sizes_.clear();
+  if (header_ != NULL) {
+    munmap(header_, sizeof(SegmentedFileHeader));
+    header_ = NULL;
+  }
+  if (fd_header_ >= 0) {
+    ::close(fd_header_);
+    fd_header_ = -1;
+  }
+}
+
+int32_t SegmentedMempool::loadFile() {
+  fd_header_ = open(header_file_name_, read_only_ ? O_RDONLY : O_RDWR);
+  struct stat st;
+  if (fd_header_ < 0 || fstat(fd_header_, &st) != 0
+      || st.st_size != static_cast<off_t>(sizeof(SegmentedFileHeader))) {
+    return -1;
+  }
+  int prot = read_only_ ? PROT_READ : PROT_READ | PROT_WRITE;
+  void* addr = mmap(NULL, sizeof(SegmentedFileHeader), prot, MAP_SHARED,
+                    fd_header_, 0);
+  if (addr == MAP_FAILED) {
+    return -1;
+  }
+  header_ = reinterpret_cast<SegmentedFileHeader*>(addr);
+  int64_t size = header_->segment_size;
+  if (size < sysconf(_SC_PAGESIZE) || (size & (size - 1)) != 0
+      || size > (1L << 54) / kMaxSegments
+      || header_->tail < 0 || header_->tail >= kMaxSegments
+      || header_->used_size < header_->tail * size
+      || header_->used_size > (header_->tail + 1) * size) {
+    return -1;
+  }
+  for (int64_t i = 0; i < header_->tail; i++) {
+    if (header_->ends[i] < 0 || header_->ends[i] > size) {
+      return -1;
+    }
+  }
+  segment_size_ = size;
+  if (reserve() != 0) {
+    return -1;
+  }
+  fds_.assign(header_->tail + 1, -1);
+  sizes_.assign(header_->tail + 1, 0);
+  return forSegments(&SegmentedMempool::loadMain, header_->tail + 1);
+}
+
+int32_t SegmentedMempool::createFile() {
+  if (read_only_) {
+    return -1;
+  }
+  fd_header_ = open(header_file_name_, O_RDWR | O_CREAT | O_TRUNC,
+                    S_IRWXU | S_IRGRP | S_IROTH);
+  if (fd_header_ < 0
+      || ftruncate(fd_header_, sizeof(SegmentedFileHeader)) != 0) {
+    return -1;
+  }
+  void* addr = mmap(NULL, sizeof(SegmentedFileHeader),
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd_header_, 0);
+  if (addr == MAP_FAILED) {
+    return -1;
+  }
+  header_ = reinterpret_cast<SegmentedFileHeader*>(addr);
+  header_->segment_size = segment_size_;
+  if (reserve() != 0) {
+    return -1;
+  }
+  fds_.assign(1, -1);
+  sizes_.assign(1, 0);
+  return openSegment(0, true);
+}
+
+int32_t SegmentedMempool::openSegment(int64_t segment, bool create) {
+  char path[PATH_MAX];
+  if (snprintf(path, PATH_MAX, "%s.%ld", file_name_, segment) >= PATH_MAX) {
+    return -1;
+  }
+  int flags = read_only_ ? O_RDONLY : O_RDWR;
+  if (create) {
+    flags |= O_CREAT;
+  }
+  int32_t fd = open(path, flags, S_IRWXU | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  int prot = read_only_ ? PROT_READ : PROT_READ | PROT_WRITE;
+  if (fstat(fd, &st) != 0 || st.st_size > segment_size_
+      || mmap(base_ + segment * segment_size_, segment_size_, prot,
+              MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    ::close(fd);
+    return -1;
+  }
+  fds_[segment] = fd;
+  sizes_[segment] = st.st_size;
+  return 0;
+}
+
+void* SegmentedMempool::loadMain(void* data) {
+  SegmentTask* task = reinterpret_cast<SegmentTask*>(data);
+  SegmentedMempool* pool = task->pool;
+  for (size_t i = 0; i < task->segments.size(); i++) {
+    int64_t segment = task->segments[i];
+    if (pool->openSegment(segment, false) != 0
+        || pool->segmentUsed(segment) > pool->sizes_[segment]) {
+      task->ret = -1;
+      continue;
+    }
+    // Every segment starts reading ahead at once.
+    madvise(pool->base_ + segment * pool->segment_size_,
+            pool->segmentUsed(segment), MADV_WILLNEED);
+  }
+  return NULL;
+}
+
+void* SegmentedMempool::dumpMain(void* data) {
+  SegmentTask* task = reinterpret_cast<SegmentTask*>(data);
+  SegmentedMempool* pool = task->pool;
+  for (size_t i = 0; i < task->segments.size(); i++) {
+    int64_t segment = task->segments[i];
+    int64_t used = pool->segmentUsed(segment);
+    if (used > 0 && msync(pool->base_ + segment * pool->segment_size_, used,
+                          MS_SYNC) != 0) {
+      task->ret = -1;
+    }
+  }
+  return NULL;
+}
+
+int32_t SegmentedMempool::forSegments(void* (*main)(void*), int64_t count) {
+  std::vector<SegmentTask> tasks(std::min<int64_t>(threads_, count));
+  for (size_t i = 0; i < tasks.size(); i++) {
+    tasks[i].pool = this;
+    tasks[i].ret = 0;
+  }
+  for (int64_t segment = 0; segment < count; segment++) {
+    tasks[segment % tasks.size()].segments.push_back(segment);
+  }
+  std::vector<pthread_t> workers(tasks.size());
+  std::vector<bool> started(tasks.size(), false);
+  for (size_t i = 1; i < tasks.size(); i++) {
+    started[i] = pthread_create(&workers[i], NULL, main, &tasks[i]) == 0;
+  }
+  // The caller takes the first share and any that could not get a thread.
+  int32_t ret = 0;
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (!started[i]) {
+      main(&tasks[i]);
+    }
+  }
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (started[i]) {
+      pthread_join(workers[i], NULL);
+    }
+    if (tasks[i].ret != 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+int32_t SegmentedMempool::dump() {
+  if (read_only_ || header_ == NULL) {
+    return -1;
+  }
+  int32_t ret = forSegments(&SegmentedMempool::dumpMain, header_->tail + 1);
+  if (msync(header_, sizeof(SegmentedFileHeader), MS_SYNC) != 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+int32_t SegmentedMempool::reset() {
+  if (read_only_ || header_ == NULL) {
+    return -1;
+  }
+  header_->used_size = 0;
+  header_->tail = 0;
+  memset(header_->ends, 0, sizeof(header_->ends));
+  return 0;
+}
+
+int64_t SegmentedMempool::segmentUsed(int64_t segment) {
+  if (segment < header_->tail) {
+    return header_->ends[segment];
+  }
+  if (segment == header_->tail) {
+    return header_->used_size - segment * segment_size_;
+  }
+  return 0;
+}
+
+int32_t SegmentedMempool::growSegment(int64_t segment, int64_t end) {
+  int64_t size = sizes_[segment];
+  if (end <= size) {
+    return 0;
+  }
+  int64_t length = std::min(std::max(expand_size_, end - size),
+                            segment_size_ - size);
+  // Allocate the blocks now rather than on the first write fault.
+  if (fallocate(fds_[segment], 0, size, length) != 0) {
+    if (errno != EOPNOTSUPP || ftruncate(fds_[segment], size + length) != 0) {
+      return -1;
+    }
+  }
+  sizes_[segment] = size + length;
+  expand_count_++;
+  return 0;
+}
+
+int64_t SegmentedMempool::alloc(const int64_t& size) {
+  if (size <= 0 || size > segment_size_ || read_only_) {
+    return -1;
+  }
+  int64_t tail = header_->tail;
+  int64_t begin = header_->used_size;
+  if (begin + size > (tail + 1) * segment_size_) {
+    // Leave the rest of the tail segment and start the next one.
+    if (tail + 1 >= kMaxSegments) {
+      return -1;
+    }
+    if (tail + 1 >= static_cast<int64_t>(fds_.size())) {
+      fds_.resize(tail + 2, -1);
+      sizes_.resize(tail + 2, 0);
+      if (openSegment(tail + 1, true) != 0) {
+        fds_.resize(tail + 1);
+        sizes_.resize(tail + 1);
+        return -1;
+      }
+    }
+    if (growSegment(tail + 1, size) != 0) {
+      return -1;
+    }
+    header_->ends[tail] = begin - tail * segment_size_;
+    tail++;
+    begin = tail * segment_size_;
+    header_->tail = tail;
+  } else if (growSegment(tail, begin + size - tail * segment_size_) != 0) {
+    return -1;
+  }
+  header_->used_size = begin + size;
+  return begin;
+}
+
+char* SegmentedMempool::getAddress(const int64_t& offset,
+                                   const int64_t& length) {
+  if (base_ == NULL || offset < 0 || length < 0
+      || offset >= header_->used_size) {
+    return NULL;
+  }
+  int64_t segment = offset / segment_size_;
+  if (offset + length > segment * segment_size_ + segmentUsed(segment)) {
+    return NULL;
+  }
+  return base_ + offset;
+}
+
+char* SegmentedMempool::getAddressSafe(const int64_t& offset) {
+  if (base_ != NULL && offset >= 0 && offset < header_->used_size) {
+    return base_ + offset;
+  }
+  return NULL;
+}
+
+int64_t SegmentedMempool::getCapacity() {
+  return header_->tail * segment_size_ + sizes_[header_->tail];
+}
+
+int32_t SegmentedMempool::shrink(const int64_t& end, const int64_t& new_end) {
+  if (read_only_ || new_end > end || new_end < 0
+      || header_->used_size != end) {
+    return -1;
+  }
+  int64_t tail = header_->tail;
+  int64_t new_tail = std::min(new_end / segment_size_, tail);
+  if (new_tail < tail && new_end - new_tail * segment_size_
+                         > header_->ends[new_tail]) {
+    return -1;
+  }
+  int64_t used = new_tail < tail ? header_->ends[new_tail]
+                                 : end - tail * segment_size_;
+  header_->used_size = new_end;
+  header_->tail = new_tail;
+  // Segments past the new tail are given back whole.
+  for (int64_t i = new_tail + 1; i <= tail; i++) {
+    header_->ends[i] = 0;
+    if (ftruncate(fds_[i], 0) == 0) {
+      sizes_[i] = 0;
+    }
+  }
+  header_->ends[new_tail] = 0;
+  release(new_end, new_tail * segment_size_ + used - new_end);
+  return 0;
+}
+
+int32_t SegmentedMempool::extend(const int64_t& end, const int64_t& new_end) {
+  int64_t tail = header_->tail;
+  if (read_only_ || new_end < end || header_->used_size != end
+      || new_end > (tail + 1) * segment_size_
+      || growSegment(tail, new_end - tail * segment_size_) != 0) {
+    return -1;
+  }
+  header_->used_size = new_end;
+  return 0;
+}
+
+int32_t SegmentedMempool::release(const int64_t& offset,
+                                  const int64_t& length) {
+  if (read_only_ || base_ == NULL) {
+    return -1;
+  }
+  const int64_t page_size = sysconf(_SC_PAGESIZE);
+  int32_t ret = 0;
+  int64_t end = offset + length;
+  for (int64_t at = offset; at < end;) {
+    int64_t segment = at / segment_size_;
+    int64_t segment_end = std::min(end, (segment + 1) * segment_size_);
+    int64_t begin = (at + page_size - 1) & ~(page_size - 1);
+    int64_t last = segment_end & ~(page_size - 1);
+    at = segment_end;
+    if (begin >= last || segment >= static_cast<int64_t>(fds_.size())) {
+      continue;
+    }
+    if (fallocate(fds_[segment], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  begin - segment * segment_size_, last - begin) != 0
+        && madvise(base_ + begin, last - begin, MADV_REMOVE) != 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+int32_t SegmentedMempool::restoreUsedSize(const int64_t& used_size) {
+  if (read_only_ || base_ == NULL || used_size < 0) {
+    return -1;
+  }
+  int64_t tail = used_size == 0 ? 0 : (used_size - 1) / segment_size_;
+  if (tail >= kMaxSegments) {
+    return -1;
+  }
+  for (int64_t i = fds_.size(); i <= tail; i++) {
+    fds_.resize(i + 1, -1);
+    sizes_.resize(i + 1, 0);
+    if (openSegment(i, true) != 0) {
+      fds_.resize(i);
+      sizes_.resize(i);
+      return -1;
+    }
+  }
+  if (growSegment(tail, used_size - tail * segment_size_) != 0) {
+    return -1;
+  }
+  // Where the segments started since the header was last written ended is
+  // not known, they count as used up to the end of their files.
+  for (int64_t i = header_->tail; i < tail; i++) {
+    header_->ends[i] = i == header_->tail
+        ? header_->used_size - i * segment_size_ : sizes_[i];
+  }
+  header_->tail = tail;
+  header_->used_size = used_size;
+  return 0;
+}
+
+int64_t SegmentedMempool::skipUnallocated(const int64_t& offset) {
+  int64_t at = offset;
+  while (at >= 0 && at < header_->used_size) {
+    int64_t segment = at / segment_size_;
+    if (at - segment * segment_size_ < segmentUsed(segment)) {
+      break;
+    }
+    at = (segment + 1) * segment_size_;
+  }
+  return at;
+}
+
+}  // namespace base
@@ -0,0 +1,160 @@
+#ifndef BASE_SEGMENTED_MEMPOOL_H_
+#define BASE_SEGMENTED_MEMPOOL_H_
+
+#include "arena/mempool.h"
+#include "arena/mmap_mempool.h"
+#include <stdint.h>
+#include <vector>
+
+namespace base {
+
+// Mempool spread over several files, <file>.0, <file>.1 and so on, one per
+// segment, with the used size of every segment in <file>.header.  All
+// segments are mapped into one address range reserved up front, segment i
+// at getBase() + i * getSegmentSize(), so a key is still an offset from
+// getBase(): segment * getSegmentSize() + offset in the segment.  New
+// segments go into the reserved range, mapped ones never move.
+//
+// A block never straddles two segments.  An alloc that does not fit into
+// the rest of the last segment starts a new one, leaving the rest unused;
+// skipUnallocated steps over such gaps.
+class SegmentedMempool : public Mempool {
+ public:
+  static const int64_t kDefaultSegmentSize;
+  static const int64_t kMaxSegments = 256;
+
+  SegmentedMempool();
+
+  ~SegmentedMempool();
+
+  // mode is MFILE_MODE_READ or MFILE_MODE_WRITE.
+  virtual int32_t init(const char* file_name, uint32_t mode);
+
+  virtual void close() {
+    return;
+  }
+
+  // msyncs the segments from setThreads() threads.
+  virtual int32_t dump();
+
+  virtual int32_t reset();
+
+  virtual int64_t alloc(const int64_t& size);
+
+  virtual inline char* getAddress(const int64_t& offset);
+
+  virtual char* getAddress(const int64_t& offset, const int64_t& length);
+
+  virtual char* getAddressSafe(const int64_t& offset);
+
+  virtual inline char* getBase();
+
+  virtual inline int64_t getUsedSize();
+
+  virtual int64_t getCapacity();
+
+  virtual int64_t getExpandCount() {
+    return expand_count_;
+  }
+
+  virtual void setExpandSize(const int64_t& size) {
+    expand_size_ = size;
+  }
+
+  virtual int32_t shrink(const int64_t& end, const int64_t& new_end);
+
+  virtual int32_t extend(const int64_t& end, const int64_t& new_end);
+
+  virtual int32_t release(const int64_t& offset, const int64_t& length);
+
+  virtual int32_t restoreUsedSize(const int64_t& used_size);
+
+  virtual int64_t skipUnallocated(const int64_t& offset);
+
+  // Segment size of pools created by init, a power of two.  Existing pools
+  // keep the size they were created with.
+  int32_t setSegmentSize(const int64_t& size);
+
+  int64_t getSegmentSize() {
+    return segment_size_;
+  }
+
+  int64_t getSegmentCount() {
+    return header_ == NULL ? 0 : header_->tail + 1;
+  }
+
+  // Threads init and dump work on segments with, one by default.
+  void setThreads(uint32_t threads) {
+    threads_ = threads == 0 ? 1 : threads;
+  }
+
+ private:
+  struct SegmentedFileHeader {
+    int64_t segment_size;
+    int64_t used_size;
+    // Last segment in use, the used size lies within it.
+    int64_t tail;
+    // Bytes used in each segment before tail.
+    int64_t ends[kMaxSegments];
+  };
+
+  struct SegmentTask {
+    SegmentedMempool* pool;
+    std::vector<int64_t> segments;
+    int32_t ret;
+  };
+
+  // Reserves the address range for kMaxSegments segments.
+  int32_t reserve();
+
+  // Unmaps and closes everything.
+  void unmap();
+
+  int32_t loadFile();
+
+  int32_t createFile();
+
+  // Opens segment's file, creating it if asked to, and maps it into place.
+  int32_t openSegment(int64_t segment, bool create);
+
+  // Bytes in use in segment.
+  int64_t segmentUsed(int64_t segment);
+
+  // Grows segment's file to hold at least end bytes.
+  int32_t growSegment(int64_t segment, int64_t end);
+
+  // Runs main over segments [0, count) from threads_ threads.
+  int32_t forSegments(void* (*main)(void*), int64_t count);
+
+  static void* loadMain(void* task);
+
+  static void* dumpMain(void* task);
+
+  int32_t fd_header_;
+  SegmentedFileHeader* header_;
+  char* base_;
+  bool read_only_;
+  int64_t segment_size_;
+  int64_t expand_size_;
+  int64_t expand_count_;
+  uint32_t threads_;
+  // File and file size of every mapped segment.
+  std::vector<int32_t> fds_;
+  std::vector<int64_t> sizes_;
+};
+
+inline char* SegmentedMempool::getAddress(const int64_t& offset) {
+  return base_ + offset;
+}
+
+inline char* SegmentedMempool::getBase() {
+  return base_;
+}
+
+inline int64_t SegmentedMempool::getUsedSize() {
+  return header_->used_size;
+}
+
+}  // namespace base
+
+#endif  // BASE_SEGMENTED_MEMPOOL_H_
@@ -0,0 +1,58 @@
+#ifndef BASE_SLAB_H_
+#define BASE_SLAB_H_
+
+#include <stdint.h>
+
+namespace base {
+
+// Slab objects carry no length prefix.  Their keys have kSlabKeyTag set and
+// point sizeof(uint32_t) bytes before the object, so that for every key the
+// data starts at (key & kKeyOffsetMask) + sizeof(uint32_t).
+const int64_t kSlabKeyTag = 1LL << 62;
+const int64_t kKeyOffsetMask = kSlabKeyTag - 1;
+
+// Objects up to kSlabMaxObjectSize are packed into kSlabPageSize pages that
+// hold a single class, classes being kSlabGranularity bytes apart.
+const uint32_t kSlabPageSize = 4096;
+const uint32_t kSlabGranularity = 8;
+const uint32_t kSlabMaxObjectSize = 256;
+const uint32_t kSlabClassCount = kSlabMaxObjectSize / kSlabGranularity;
+const uint32_t kSlabBitmapWords = kSlabPageSize / kSlabGranularity / 64;
+// Pages are carved from the pool kSlabChunkPages at a time.
+const uint32_t kSlabChunkPages = 64;
+// Payload length of the internal block holding a chunk, one page more for
+// alignment.  No other internal block is this long.
+const uint32_t kSlabChunkLength = (kSlabChunkPages + 1) * kSlabPageSize;
+
+// DelayNode level of a retired slab object.
+const uint32_t kSlabLevel = 0xFFFFFFFF;
+
+// Length prefix of blocks the arena carves for its own structures, followed
+// by a uint32_t payload length.  Keeps the data region walkable block by
+// block, no size class ever reaches this value.
+const uint32_t kInternalBlockMark = 0xFFFFFFFF;
+
+// Header at the start of every slab page, objects follow it.
+struct SlabPage {
+  uint32_t object_size;
+  uint32_t capacity;
+  uint32_t used;
+  uint32_t reserved;
+  int64_t prev;  // neighbours in the class' partial list, -1 terminated
+  int64_t next;  // also links empty pages on the free page list
+  uint64_t bitmap[kSlabBitmapWords];  // one bit per occupied object
+};
+
+// Persistent slab state in the arena header.
+struct SlabHeader {
+  int64_t partial[kSlabClassCount];  // pages with at least one free slot
+  int64_t free_pages;
+};
+
+inline bool isSlabKey(int64_t key) {
+  return key > 0 && (key & kSlabKeyTag) != 0;
+}
+
+}  // namespace base
+
+#endif  // BASE_SLAB_H_
@@ -0,0 +1,61 @@
+#ifndef BASE_THREAD_CACHE_H_
+#define BASE_THREAD_CACHE_H_
+
+#include <stdint.h>
+#include <vector>
+#include "arena/arena_stats.h"
+#include "arena/delay_queue.h"
+
+namespace base {
+
+class Arena;
+
+// Blocks up to this class size are served from per-thread caches when the
+// arena runs in thread safe mode, bigger ones always take the arena lock.
+const uint32_t kThreadCacheMaxSize = 32 * 1024;
+// Number of blocks moved between a cache and the shared lists at a time.
+const uint32_t kThreadCacheBatch = 32;
+// A bin holding more than this many blocks gives kThreadCacheBatch back.
+const uint32_t kThreadCacheBinLimit = 2 * kThreadCacheBatch;
+// Counter updates a cache collects before folding them into the arena.
+const uint32_t kThreadCacheCountLimit = 1024;
+
+// Free blocks owned by one thread for one arena.  Only the owning thread
+// touches a cache, except when the arena flushes every cache on close.
+struct ThreadCache {
+  ThreadCache(Arena* arena, uint32_t levels)
+      : owner(arena),
+        bins(levels),
+        bitmap((levels + 63) / 64, 0),
+        counters(levels + 1, ClassCounters()),
+        pending(0) {
+  }
+
+  void push(uint32_t level, int64_t key) {
+    bins[level].push_back(key);
+    bitmap[level >> 6] |= 1ULL << (level & 63);
+  }
+
+  int64_t pop(uint32_t level) {
+    int64_t key = bins[level].back();
+    bins[level].pop_back();
+    if (bins[level].empty()) {
+      bitmap[level >> 6] &= ~(1ULL << (level & 63));
+    }
+    return key;
+  }
+
+  Arena* owner;
+  std::vector<std::vector<int64_t> > bins;
+  std::vector<uint64_t> bitmap;
+  // Frees waiting to be pushed onto the shared delay queue.
+  std::vector<DelayNode> retired;
+  // Live block changes not folded into the arena's counters yet, one entry
+  // per level plus one for slab objects.
+  std::vector<ClassCounters> counters;
+  uint32_t pending;
+};
+
+}  // namespace base
+
+#endif  // BASE_THREAD_CACHE_H_
@@ -0,0 +1,80 @@
+#ifndef BASE_TYPED_ARENA_H_
+#define BASE_TYPED_ARENA_H_
+
+#include <stdint.h>
+#include <type_traits>
+#include "arena/arena.h"
+
+namespace base {
+
+// Arena over a pool of a known concrete type.  Key lookups call the pool
+// non-virtually and inline, instead of through two virtual, bounds checked
+// Mempool::getAddress calls.  Pool must keep one mapping for its lifetime,
+// so that getBase() never changes, as MMapMempool and its subclasses do.
+// Everything else is Arena's.
+template <typename Pool>
+class TypedArena : public Arena {
+ public:
+  static_assert(std::is_base_of<Mempool, Pool>::value,
+                "TypedArena needs a Mempool");
+
+  TypedArena() : typed_pool_(NULL), base_(NULL) {}
+
+  int32_t init(Pool* pool,
+               uint32_t minMemSize = 32,
+               uint32_t maxMemSize = 1U << 31,
+               float rate = 1.05,
+               uint32_t delayTime = 10) {
+    int32_t ret = Arena::init(pool, minMemSize, maxMemSize, rate, delayTime);
+    if (ret == 0) {
+      typed_pool_ = pool;
+      base_ = pool->Pool::getBase();
+    }
+    return ret;
+  }
+
+  Pool* getPool() {
+    return typed_pool_;
+  }
+
+  // Same checks and result as Arena::getAddress.
+  char* getAddress(int64_t key) {
+    if (key < 0) {
+      return NULL;
+    }
+    int64_t used_size = typed_pool_->Pool::getUsedSize();
+    int64_t data = (key & kKeyOffsetMask) + sizeof(uint32_t);
+    if (isSlabKey(key)) {
+      return data < used_size ? base_ + data : NULL;
+    }
+    if (data > used_size
+        || data + *reinterpret_cast<uint32_t*>(base_ + key) > used_size) {
+      return NULL;
+    }
+    return base_ + data;
+  }
+
+  // No checks at all, key must be live.  Slab and prefixed keys both keep
+  // their data a prefix's length past (key & kKeyOffsetMask), so this is a
+  // mask and an add.
+  char* getAddressUnchecked(int64_t key) {
+    return base_ + sizeof(uint32_t) + (key & kKeyOffsetMask);
+  }
+
+  uint32_t getSize(int64_t key) {
+    if (isSlabKey(key)) {
+      int64_t page = ((key & kKeyOffsetMask) + sizeof(uint32_t))
+          & ~static_cast<int64_t>(kSlabPageSize - 1);
+      return reinterpret_cast<SlabPage*>(base_ + page)->object_size;
+    }
+    return *reinterpret_cast<uint32_t*>(base_ + key);
+  }
+
+ private:
+  Pool* typed_pool_;
+  char* base_;
+};
+
+}  // namespace base
+
+#endif  // BASE_TYPED_ARENA_H_